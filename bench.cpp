@@ -0,0 +1,489 @@
+/*
+BSD 2-Clause License
+
+Copyright (c) 2017, Anton Erdman.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+
+/* Microbenchmarks of the scheduler, the queue between two threads, the parser and the sequencer.
+   Prints the results as JSON. */
+
+#include <atomic>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+#include "sequencer.h"
+#include "midiheap.h"
+#include "midiqueue.h"
+#include "noteevent.h"
+#include "rtlog.h"
+#include "timingwheel.h"
+#include "virtualbackend.h"
+
+#define BENCH_SCHEDULER_OPS            2000000  // Insert/pop pairs per fill level.
+#define BENCH_SPAN                     48000    // Frames; how far ahead the scheduled events go.
+#define BENCH_CONCURRENT_MSGS          2000000  // Messages passed from the producer thread to the consumer.
+#define BENCH_CONCURRENT_LINE          8        // Messages pushed together, like the events of a line.
+#define BENCH_CONCURRENT_LEAD          4096     // Messages the producer may be ahead of the consumer.
+#define BENCH_PARSE_LINES              100000   // Lines of a parser corpus.
+#define BENCH_NOTE_TOKENS              1000000  // Notes for the note parser alone.
+#define BENCH_LEX_THREADS              4        // Threads for the lexed ahead parser runs.
+#define BENCH_SONG_LINES               50000    // Lines of a sequencer corpus.
+#define BENCH_COLUMNS                  8
+#define BENCH_LEAD_MS                  2000     // Like the player, run at most this far ahead.
+
+static const size_t gFillLevels[] = { 16, 256, 4096, 65536 };
+
+/*******************************************************************************************/
+/* An output that only counts the events. */
+class NullBackend : public VirtualBackend
+{
+   public:
+      uint64_t mEvents;
+
+      NullBackend() : VirtualBackend(48000, 256), mEvents(0) {}
+
+      void close() {}
+
+   protected:
+      void deliver(unsigned port, uint64_t cycle, jack_nframes_t offset, int64_t frame,
+            const unsigned char *data, size_t size)
+      {
+         mEvents ++;
+      }
+};
+
+/*******************************************************************************************/
+/* Monotonic time in seconds. */
+static double now()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*******************************************************************************************/
+/* A deterministic pseudo random number. */
+static unsigned nextRandom()
+{
+   static uint32_t state = 12345;
+   state = state * 1103515245 + 12345;
+   return state >> 8;
+}
+
+/*******************************************************************************************/
+/* Steady state insert/pop of a scheduler holding the given number of events. Returns ns per pair. */
+static double benchScheduler(MidiScheduler &s, size_t fill)
+{
+   for (size_t i = 0; i < fill; i ++)
+      s.insert(MidiMessage(MIDI_NOTE_ON, 60, 64, nextRandom() % BENCH_SPAN));
+
+   frametime_t sum = 0;
+   double start = now();
+   for (size_t i = 0; i < BENCH_SCHEDULER_OPS; i ++)
+   {
+      MidiMessage m = s.popMin();
+      sum += m.time;
+      m.time += 1 + nextRandom() % BENCH_SPAN;
+      s.insert(m);
+   }
+   double elapsed = now() - start;
+
+   while (s.count() > 0)
+      s.popMin();
+
+   // Keep the loop from being optimized out.
+   if (sum == 1)
+      fprintf(stderr, " ");
+   return elapsed * 1e9 / BENCH_SCHEDULER_OPS;
+}
+
+/*******************************************************************************************/
+/* The same through the queue: push from the producer side, pop from the consumer side. */
+static double benchQueue(SchedulerType type, size_t fill)
+{
+   MidiQueue q (fill, type);
+   MidiMessage m;
+
+   for (size_t i = 0; i < fill; i ++)
+      q.push(MidiMessage(MIDI_NOTE_ON, 60, 64, nextRandom() % BENCH_SPAN));
+
+   double start = now();
+   for (size_t i = 0; i < BENCH_SCHEDULER_OPS; i ++)
+   {
+      q.popUntil(UINT64_MAX, &m, 1);
+      m.time += 1 + nextRandom() % BENCH_SPAN;
+      q.push(m);
+   }
+   double elapsed = now() - start;
+
+   return elapsed * 1e9 / BENCH_SCHEDULER_OPS;
+}
+
+/*******************************************************************************************/
+/* The state shared by the producer and the consumer threads of a concurrent run. Either the
+   lock-free queue or, for the baseline, a heap behind a mutex. */
+struct ConcurrentBench
+{
+   MidiQueue          *queue;
+   MidiHeap           *heap;
+   pthread_mutex_t     mutex;
+   uint64_t            lockStalls;       // The producer found the mutex taken.
+   std::atomic<size_t> consumed;
+};
+
+/*******************************************************************************************/
+/* The producer thread: pushes the lines of messages, staying within the lead like the player. */
+static void* concurrentProducer(void *arg)
+{
+   ConcurrentBench *b = (ConcurrentBench*) arg;
+   MidiMessage line[BENCH_CONCURRENT_LINE];
+
+   for (size_t i = 0; i < BENCH_CONCURRENT_MSGS; i += BENCH_CONCURRENT_LINE)
+   {
+      while (i - b->consumed.load(std::memory_order_acquire) > BENCH_CONCURRENT_LEAD)
+         sched_yield();
+
+      for (size_t k = 0; k < BENCH_CONCURRENT_LINE; k ++)
+         line[k] = MidiMessage(MIDI_NOTE_ON, 60 + k, 64, i + nextRandom() % BENCH_CONCURRENT_LINE, 0, k % 4);
+
+      if (b->queue != NULL)
+         b->queue->push(line, BENCH_CONCURRENT_LINE);
+      else
+      {
+         if (pthread_mutex_trylock(&b->mutex) != 0)
+         {
+            b->lockStalls ++;
+            pthread_mutex_lock(&b->mutex);
+         }
+         for (size_t k = 0; k < BENCH_CONCURRENT_LINE; k ++)
+            b->heap->insert(line[k]);
+         pthread_mutex_unlock(&b->mutex);
+      }
+   }
+   return NULL;
+}
+
+/*******************************************************************************************/
+/* Pass the messages from a producer thread to the consumer on this one, through the queue or
+   through the heap behind a mutex if no scheduler type is given. The producer stalls are the
+   arena allocations of the queue, or the times the mutex was taken for the heap. */
+static void benchConcurrent(const char *impl, SchedulerType *type, std::ostream &out)
+{
+   ConcurrentBench b;
+   b.queue = type != NULL ? new MidiQueue(BENCH_CONCURRENT_LEAD, *type) : NULL;
+   b.heap = type == NULL ? new MidiHeap(BENCH_CONCURRENT_LEAD) : NULL;
+   pthread_mutex_init(&b.mutex, NULL);
+   b.lockStalls = 0;
+   b.consumed = 0;
+
+   MidiMessage msgs[BENCH_CONCURRENT_LEAD];
+   size_t consumed = 0;
+   double start = now();
+
+   pthread_t producer;
+   if (pthread_create(&producer, NULL, concurrentProducer, &b) != 0)
+   {
+      std::cerr << "Cannot start the producer thread" << std::endl;
+      exit(1);
+   }
+
+   while (consumed < BENCH_CONCURRENT_MSGS)
+   {
+      size_t n = 0;
+      if (b.queue != NULL)
+         n = b.queue->popUntil(UINT64_MAX, msgs, BENCH_CONCURRENT_LEAD);
+      else
+      {
+         pthread_mutex_lock(&b.mutex);
+         while (n < BENCH_CONCURRENT_LEAD && b.heap->count() > 0)
+            msgs[n ++] = b.heap->popMin();
+         pthread_mutex_unlock(&b.mutex);
+      }
+
+      consumed += n;
+      b.consumed.store(consumed, std::memory_order_release);
+      if (n == 0)
+         sched_yield();
+   }
+
+   pthread_join(producer, NULL);
+   double elapsed = now() - start;
+   uint64_t stalls = b.queue != NULL ? b.queue->producerStalls() : b.lockStalls;
+
+   out << "{\"impl\": \"" << impl << "\", \"messages\": " << consumed << ", \"msgs_per_s\": " << consumed / elapsed
+      << ", \"producer_stalls\": " << stalls << "}";
+
+   pthread_mutex_destroy(&b.mutex);
+   delete b.queue;
+   delete b.heap;
+}
+
+/*******************************************************************************************/
+/* A random note token. */
+static std::string randomNote()
+{
+   static const char *names[] = { "c", "d", "e", "f", "g", "a", "b", "C#", "Eb", "F#", "Ab", "B&" };
+   std::ostringstream ss;
+
+   ss << names[nextRandom() % 12] << 2 + nextRandom() % 5;
+   switch (nextRandom() % 4)
+   {
+      case 0: ss << "!" << nextRandom() % 64; break;
+      case 1: ss << ":1/2"; break;
+      default: break;
+   }
+   return ss.str();
+}
+
+/*******************************************************************************************/
+/* A corpus line of the given kind. A column continues a note only after it has got one. */
+static std::string corpusLine(const std::string &kind, std::vector<bool> &hasNote)
+{
+   std::string line;
+
+   for (unsigned c = 0; c < BENCH_COLUMNS; c ++)
+   {
+      unsigned r = nextRandom() % 8;
+      if (c > 0)
+         line += " ";
+
+      if (kind == "ramps" && c == 0)
+         line += "$7=0..127:4";
+      else if (kind == "controls" && r < 2)
+         line += "$" + std::to_string(1 + nextRandom() % 100) + "=" + std::to_string(nextRandom() % 128);
+      else if (r < 3 || (r < 5 && !hasNote[c]))
+      {
+         line += randomNote();
+         hasNote[c] = true;
+      }
+      else if (r < 5)
+         line += "|";
+      else
+         line += ".";
+   }
+   return line;
+}
+
+/*******************************************************************************************/
+/* Count the whitespace separated tokens. */
+static size_t countTokens(const std::string &line)
+{
+   std::istringstream ss (line);
+   std::string token;
+   size_t n = 0;
+
+   while (ss >> token)
+      n ++;
+   return n;
+}
+
+/*******************************************************************************************/
+/* Parse a generated corpus of the given kind; lexed ahead if more than one thread is given. */
+static void benchParser(const std::string &kind, unsigned threads, std::ostream &out)
+{
+   std::vector<std::string> lines;
+   std::vector<bool> hasNote (BENCH_COLUMNS, false);
+   size_t tokens = 0;
+   for (size_t i = 0; i < BENCH_PARSE_LINES; i ++)
+   {
+      lines.push_back(corpusLine(kind, hasNote));
+      tokens += countTokens(lines.back());
+   }
+
+   std::map<std::string, Sequencer*> subseq;
+   Parser parser (&subseq);
+
+   // The parser keeps pointers to the last notes, so the events stay alive like in a song.
+   size_t events = 0;
+   double start, elapsed;
+   if (threads > 1)
+   {
+      std::string text;
+      for (size_t i = 0; i < lines.size(); i ++)
+         text.append(lines[i]).push_back('\n');
+
+      start = now();
+      ParallelLineReader reader (new StreamLineReader(*new std::istringstream(text), true), threads);
+      const char *line;
+      size_t length;
+      while (reader.next(line, length))
+         events += parser.parseLine(*reader.lexed()).size();
+      elapsed = now() - start;
+   }
+   else
+   {
+      start = now();
+      for (size_t i = 0; i < lines.size(); i ++)
+         events += parser.parseLine(lines[i]).size();
+      elapsed = now() - start;
+   }
+
+   out << "{\"corpus\": \"" << kind << "\", \"threads\": " << threads << ", \"lines\": " << lines.size() << ", \"tokens\": " << tokens
+      << ", \"events\": " << events << ", \"lines_per_s\": " << lines.size() / elapsed << ", \"tokens_per_s\": " << tokens / elapsed << "}";
+}
+
+/*******************************************************************************************/
+/* The note parser alone. */
+static void benchNoteParser(std::ostream &out)
+{
+   std::vector<std::string> notes;
+   for (size_t i = 0; i < BENCH_NOTE_TOKENS; i ++)
+      notes.push_back(randomNote());
+
+   unsigned sum = 0;
+   double start = now();
+   for (size_t i = 0; i < notes.size(); i ++)
+   {
+      NoteEvent n (notes[i]);
+      sum += n.pitch;
+   }
+   double elapsed = now() - start;
+
+   if (sum == 1)
+      fprintf(stderr, " ");
+   out << "{\"tokens\": " << notes.size() << ", \"tokens_per_s\": " << notes.size() / elapsed << "}";
+}
+
+/*******************************************************************************************/
+/* Play a generated song of the given kind into the null output, like the player does. */
+static void benchSequencer(JackEngine *jack, NullBackend *backend, const std::string &kind, std::ostream &out)
+{
+   std::vector<bool> hasNote (BENCH_COLUMNS, false);
+   std::string song = "tempo 240\n";
+   for (size_t i = 0; i < BENCH_SONG_LINES; i ++)
+      song += corpusLine(kind, hasNote) + "\n";
+
+   std::istringstream ss (song);
+   Sequencer seq (jack);
+   seq.readFromStream(ss);
+
+   jack_nframes_t lead = jack->msToNframes(BENCH_LEAD_MS);
+   uint64_t events = backend->mEvents;
+   size_t lines = 0;
+
+   double start = now();
+   while (seq.playNextLine())
+   {
+      lines ++;
+      jack->releaseEvents(seq.releaseTime());
+      while (seq.getCurrentTime() > jack->currentFrameTime() + lead)
+      {
+         jack->releaseEvents(seq.releaseTime());
+         jack->idle(1);
+      }
+   }
+   seq.silence();
+   while (jack->hasPendingEvents())
+   {
+      jack->releaseEvents(jack->currentFrameTime() + lead);
+      jack->idle(10);
+   }
+   double elapsed = now() - start;
+
+   events = backend->mEvents - events;
+   out << "{\"corpus\": \"" << kind << "\", \"lines\": " << lines << ", \"events\": " << events
+      << ", \"lines_per_s\": " << lines / elapsed << ", \"events_per_s\": " << events / elapsed << "}";
+}
+
+/*******************************************************************************************/
+/* main */
+int main(int argc, char **argv)
+{
+   gPlaying = true;
+   RtLog::instance()->start(stderr);
+
+   NullBackend *backend = new NullBackend();
+   JackEngine *jack = JackEngine::instance();
+   jack->setBackend(backend);
+   jack->setDirectDispatch(true);
+   try {
+      jack->init();
+   } catch (const char *s) {
+      std::cerr << "Error during the output initialization: " << s << std::endl;
+      return 1;
+   }
+
+   std::ostream &out = std::cout;
+   const char *sep = "";
+
+   out << "{" << std::endl << "  \"scheduler\": [";
+   for (size_t i = 0; i < sizeof(gFillLevels) / sizeof(gFillLevels[0]); i ++)
+   {
+      size_t fill = gFillLevels[i];
+      MidiHeap heap (fill);
+      TimingWheel wheel (fill);
+
+      out << sep << std::endl << "    {\"impl\": \"heap\", \"fill\": " << fill << ", \"ns_per_op\": " << benchScheduler(heap, fill) << "}";
+      sep = ",";
+      out << sep << std::endl << "    {\"impl\": \"wheel\", \"fill\": " << fill << ", \"ns_per_op\": " << benchScheduler(wheel, fill) << "}";
+      out << sep << std::endl << "    {\"impl\": \"queue/heap\", \"fill\": " << fill << ", \"ns_per_op\": " << benchQueue(SCHEDULER_HEAP, fill) << "}";
+      out << sep << std::endl << "    {\"impl\": \"queue/wheel\", \"fill\": " << fill << ", \"ns_per_op\": " << benchQueue(SCHEDULER_WHEEL, fill) << "}";
+   }
+   out << std::endl << "  ]," << std::endl;
+
+   SchedulerType heapType = SCHEDULER_HEAP, wheelType = SCHEDULER_WHEEL;
+   out << "  \"concurrent\": [" << std::endl << "    ";
+   benchConcurrent("queue/heap", &heapType, out);
+   out << "," << std::endl << "    ";
+   benchConcurrent("queue/wheel", &wheelType, out);
+   out << "," << std::endl << "    ";
+   benchConcurrent("mutex/heap", NULL, out);
+   out << std::endl << "  ]," << std::endl;
+
+   out << "  \"parser\": [" << std::endl << "    ";
+   benchParser("notes", 1, out);
+   out << "," << std::endl << "    ";
+   benchParser("controls", 1, out);
+   out << "," << std::endl << "    ";
+   benchParser("notes", BENCH_LEX_THREADS, out);
+   out << "," << std::endl << "    ";
+   benchParser("controls", BENCH_LEX_THREADS, out);
+   out << std::endl << "  ]," << std::endl;
+
+   out << "  \"note_parser\": ";
+   benchNoteParser(out);
+   out << "," << std::endl;
+
+   out << "  \"sequencer\": [" << std::endl << "    ";
+   benchSequencer(jack, backend, "notes", out);
+   out << "," << std::endl << "    ";
+   benchSequencer(jack, backend, "ramps", out);
+   out << std::endl << "  ]" << std::endl << "}" << std::endl;
+
+   gPlaying = false;
+   jack->shutdown();
+   RtLog::instance()->stop();
+   return 0;
+}
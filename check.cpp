@@ -0,0 +1,566 @@
+/*
+BSD 2-Clause License
+
+Copyright (c) 2017, Anton Erdman.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+
+
+/* Checks of the timeline, the tempo clock and the full port buffers that the simulated songs of "make check" do not reach. Prints one line
+   per check; the exit status is not zero if any has failed. Given a MIDI file and a simulation record
+   instead, checks that the file holds the same events at the same frames. */
+
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+
+#include "common.h"
+#include "sequencer.h"
+#include "midiheap.h"
+#include "rtlog.h"
+#include "timingwheel.h"
+#include "virtualbackend.h"
+
+#define CHECK_WRAP                     0x100000000ULL    // Where the 32-bit jack frame time wraps.
+#define CHECK_WRAP_LEAD                48000    // Frames; the clock starts this far before the wrap.
+#define CHECK_WRAP_EVENTS              4096     // Messages scheduled around the wrap.
+#define CHECK_WRAP_LINES               64       // Lines played across the wrap.
+#define CHECK_LEAD_MS                  2000     // Like the player, run at most this far ahead.
+#define CHECK_DRIFT_LINES              1000000  // Lines the tempo clock advances.
+#define CHECK_DRIFT_TEMPO              130
+#define CHECK_DRIFT_QUANT              4
+#define CHECK_PARTS_LINES              7        // Lines before the long note, to leave a fraction of a frame.
+#define CHECK_PARTS_TIME               1000     // The note lasts CHECK_PARTS_TIME / 16 lines.
+#define CHECK_PARTS_RAMP               64       // Lines of the controller ramp.
+#define CHECK_PAIR_NOTES               16       // Short notes put into one cycle.
+#define CHECK_PAIR_ROOM                4        // Events a port buffer takes in a cycle.
+
+/*******************************************************************************************/
+/* An output that keeps the events it has received. The clock starts at the given frame. */
+class RecordBackend : public VirtualBackend
+{
+   public:
+      std::vector<int64_t>        mEventFrames;
+      std::vector<jack_nframes_t> mEventOffsets;
+      std::vector<unsigned char>  mEventStatus;
+      std::vector<unsigned char>  mEventKeys;
+      size_t                      mRoom;       // Events a port buffer takes; 0 for no limit.
+
+      RecordBackend(uint64_t start) : VirtualBackend(48000, 256), mRoom(0) { mFrames = start; }
+
+      void close() {}
+
+      void clearRecord()
+      {
+         mEventFrames.clear();
+         mEventOffsets.clear();
+         mEventStatus.clear();
+         mEventKeys.clear();
+      }
+
+      unsigned char* reserveEvent(void *buffer, jack_nframes_t offset, size_t size)
+      {
+         if (mRoom > 0 && ((VirtualPort*) buffer)->events.size() >= mRoom)
+            return NULL;
+         return VirtualBackend::reserveEvent(buffer, offset, size);
+      }
+
+   protected:
+      void deliver(unsigned port, uint64_t cycle, jack_nframes_t offset, int64_t frame,
+            const unsigned char *data, size_t size)
+      {
+         mEventFrames.push_back(frame);
+         mEventOffsets.push_back(offset);
+         mEventStatus.push_back(size > 0 ? data[0] : 0);
+         mEventKeys.push_back(size > 1 ? data[1] : 0);
+      }
+};
+
+/*******************************************************************************************/
+/* Print the result of a check. */
+static bool report(const char *name, bool ok, const std::string &detail = "")
+{
+   if (ok)
+      printf("%s: ok\n", name);
+   else
+      printf("%s: FAILED, %s\n", name, detail.c_str());
+   return ok;
+}
+
+/*******************************************************************************************/
+/* Schedule the messages on both sides of the wrap in a mixed order; they have to come out in
+   the order of the time. */
+static bool checkSchedulerWrap(const char *name, MidiScheduler &s)
+{
+   frametime_t base = CHECK_WRAP - CHECK_WRAP_EVENTS / 2;
+
+   for (size_t i = 0; i < CHECK_WRAP_EVENTS; i ++)
+      s.insert(MidiMessage(MIDI_NOTE_ON, 60, 64, base + (i * 2749) % CHECK_WRAP_EVENTS));
+
+   size_t n = 0;
+   frametime_t prev = 0;
+   bool ordered = true;
+   while (s.count() > 0)
+   {
+      MidiMessage m = s.popMin();
+      if (m.time < prev || m.time != base + n)
+         ordered = false;
+      prev = m.time;
+      n ++;
+   }
+
+   return report(name, ordered && n == CHECK_WRAP_EVENTS, "the messages around the wrap come out of order");
+}
+
+/*******************************************************************************************/
+/* Play a song across the wrap of the jack frame time. The events have to keep the order and
+   the line distances of the 64-bit timeline. */
+static bool checkEngineWrap(JackEngine *jack, RecordBackend *backend)
+{
+   std::string song;
+   for (size_t i = 0; i < CHECK_WRAP_LINES; i ++)
+      song += i % 2 == 0 ? "C\n" : "E\n";
+
+   std::istringstream ss (song);
+   Sequencer seq (jack);
+   seq.readFromStream(ss);
+
+   frametime_t start = seq.getCurrentTime();
+   jack_nframes_t lead = jack->msToNframes(CHECK_LEAD_MS);
+   backend->clearRecord();
+
+   // A broken timeline could keep the song waiting forever; the clock stops well after its end.
+   backend->setFrameLimit(start + (CHECK_WRAP_LINES + 1) * seq.getLineDuration() + lead);
+
+   while (gPlaying && seq.playNextLine())
+   {
+      jack->releaseEvents(seq.releaseTime());
+      while (gPlaying && seq.getCurrentTime() > jack->currentFrameTime() + lead)
+         jack->idle(1);
+   }
+   seq.silence();
+   while (gPlaying && jack->hasPendingEvents())
+   {
+      jack->releaseEvents(jack->currentFrameTime() + lead);
+      jack->idle(10);
+   }
+
+   backend->setFrameLimit(0);
+   if (!gPlaying)
+      return report("wrap/engine", false, "the song does not end");
+
+   const std::vector<int64_t> &frames = backend->mEventFrames;
+   std::vector<int64_t> noteOns;
+   for (size_t i = 0; i < frames.size(); i ++)
+   {
+      if (i > 0 && frames[i] < frames[i - 1])
+         return report("wrap/engine", false, "an event goes before the previous one");
+      if (backend->mEventOffsets[i] >= backend->bufferSize())
+         return report("wrap/engine", false, "an offset is out of the cycle");
+      if ((backend->mEventStatus[i] & 0xf0) == MIDI_NOTE_ON)
+         noteOns.push_back(frames[i]);
+   }
+
+   if (noteOns.size() != CHECK_WRAP_LINES)
+      return report("wrap/engine", false, "some notes are missing");
+   if (noteOns.front() != (int64_t)start || (uint64_t)noteOns.back() < CHECK_WRAP)
+      return report("wrap/engine", false, "the song does not cross the wrap");
+
+   for (size_t i = 1; i < noteOns.size(); i ++)
+      if (noteOns[i] - noteOns[i - 1] != seq.getLineDuration())
+         return report("wrap/engine", false, "the line distances change");
+
+   return report("wrap/engine", true);
+}
+
+/*******************************************************************************************/
+/* Advance the tempo clock by a million lines of a duration that is not a whole number of frames.
+   The total has to be the exact rational duration, rounded down once. */
+static bool checkTempoDrift(JackEngine *jack)
+{
+   Sequencer seq (jack);
+   seq.setTempo(CHECK_DRIFT_TEMPO);
+   seq.setQuant(CHECK_DRIFT_QUANT);
+
+   frametime_t start = seq.getCurrentTime();
+   for (size_t i = 0; i < CHECK_DRIFT_LINES; i ++)
+      seq.advanceLine();
+
+   uint64_t total = seq.getCurrentTime() - start;
+   uint64_t exact = (uint64_t)CHECK_DRIFT_LINES * 60 * jack->sampleRate() / (CHECK_DRIFT_TEMPO * CHECK_DRIFT_QUANT);
+
+   char detail[128];
+   snprintf(detail, sizeof(detail), "%llu frames instead of %llu", (unsigned long long)total, (unsigned long long)exact);
+   return report("tempo/drift", total == exact, detail);
+}
+
+/*******************************************************************************************/
+/* Play a long note and a controller ramp at a tempo whose line is not a whole number of frames.
+   The note off and the end of the ramp have to fall on the exact rational time, rounded down once. */
+static bool checkTempoParts(JackEngine *jack, RecordBackend *backend)
+{
+   char last[64];
+   snprintf(last, sizeof(last), "C/16:%u $7=0..127..1:%u\n", CHECK_PARTS_TIME, CHECK_PARTS_RAMP);
+
+   std::string song = "tempo " + std::to_string(CHECK_DRIFT_TEMPO) + "\n";
+   for (size_t i = 0; i < CHECK_PARTS_LINES; i ++)
+      song += ".\n";
+   song += last;
+
+   std::istringstream ss (song);
+   Sequencer seq (jack);
+   seq.readFromStream(ss);
+
+   frametime_t start = seq.getCurrentTime();
+   jack_nframes_t lead = jack->msToNframes(CHECK_LEAD_MS);
+   uint64_t num = (uint64_t)jack->sampleRate() * 60, den = (uint64_t)CHECK_DRIFT_TEMPO * CHECK_DRIFT_QUANT;
+   uint64_t noteOff = start + (CHECK_PARTS_LINES * 16 + CHECK_PARTS_TIME) * num / (16 * den) - 2;
+   uint64_t rampEnd = start + (CHECK_PARTS_LINES + CHECK_PARTS_RAMP) * num / den;
+   backend->clearRecord();
+
+   backend->setFrameLimit(rampEnd + lead);
+   while (gPlaying && seq.playNextLine())
+   {
+      jack->releaseEvents(seq.releaseTime());
+      while (gPlaying && seq.getCurrentTime() > jack->currentFrameTime() + lead)
+         jack->idle(1);
+   }
+   seq.silence();
+   while (gPlaying && jack->hasPendingEvents())
+   {
+      jack->releaseEvents(jack->currentFrameTime() + lead);
+      jack->idle(10);
+   }
+
+   backend->setFrameLimit(0);
+   if (!gPlaying)
+      return report("tempo/parts", false, "the song does not end");
+
+   int64_t offFrame = -1, rampFrame = -1;
+   for (size_t i = 0; i < backend->mEventFrames.size(); i ++)
+   {
+      unsigned status = backend->mEventStatus[i] & 0xf0;
+      if (status == MIDI_NOTE_OFF)
+         offFrame = backend->mEventFrames[i];
+      else if (status == MIDI_CONTROLLER)
+         rampFrame = backend->mEventFrames[i];
+   }
+
+   char detail[160];
+   snprintf(detail, sizeof(detail), "the note ends at %lld instead of %llu, the ramp at %lld instead of %llu",
+         (long long)offFrame, (unsigned long long)noteOff, (long long)rampFrame, (unsigned long long)rampEnd);
+   return report("tempo/parts", offFrame == (int64_t)noteOff && rampFrame == (int64_t)rampEnd, detail);
+}
+
+/*******************************************************************************************/
+/* Put more short notes into one cycle than the port buffer takes. Whatever is carried over, the
+   note off of each note has to come after its note on. */
+static bool checkNotePairs(JackEngine *jack, RecordBackend *backend)
+{
+   frametime_t start = jack->currentFrameTime() + jack->msToNframes(CHECK_LEAD_MS);
+   backend->clearRecord();
+   backend->mRoom = CHECK_PAIR_ROOM;
+
+   for (unsigned k = 0; k < CHECK_PAIR_NOTES; k ++)
+   {
+      jack->queueMidiEvent(MidiMessage(MIDI_NOTE_ON, 60 + k, 64, start + 2 * k));
+      jack->queueMidiEvent(MidiMessage(MIDI_NOTE_OFF, 60 + k, 0, start + 2 * k + 1));
+   }
+   jack->releaseEvents(start + 2 * CHECK_PAIR_NOTES);
+
+   backend->setFrameLimit(start + 2 * jack->msToNframes(CHECK_LEAD_MS));
+   while (gPlaying && jack->hasPendingEvents())
+      jack->idle(10);
+   backend->setFrameLimit(0);
+   backend->mRoom = 0;
+   if (!gPlaying)
+      return report("pressure/pairs", false, "the notes are never sent");
+
+   int sounding[128] = { 0 };
+   size_t ons = 0;
+   for (size_t i = 0; i < backend->mEventStatus.size(); i ++)
+   {
+      unsigned status = backend->mEventStatus[i] & 0xf0;
+      unsigned key = backend->mEventKeys[i] & 0x7f;
+      if (status == MIDI_NOTE_ON)
+      {
+         sounding[key] ++;
+         ons ++;
+      }
+      else if (status == MIDI_NOTE_OFF && -- sounding[key] < 0)
+         return report("pressure/pairs", false, "a note off goes before its note on");
+   }
+
+   for (unsigned k = 0; k < 128; k ++)
+      if (sounding[k] != 0)
+         return report("pressure/pairs", false, "a note is left hanging");
+   return report("pressure/pairs", ons == CHECK_PAIR_NOTES, "some notes are missing");
+}
+
+/* An event of a port: the frame and the bytes in hex, as in the simulation record. */
+typedef std::vector<std::pair<int64_t, std::string> > PortEvents;
+
+/*******************************************************************************************/
+/* Read a simulation record into the events of every port. */
+static bool readRecord(const char *path, std::map<std::string, PortEvents> &ports, unsigned &rate)
+{
+   std::ifstream in (path);
+   std::string line;
+   rate = 0;
+
+   while (std::getline(in, line))
+   {
+      std::istringstream ss (line);
+      std::string port, bytes, word;
+      unsigned long long cycle;
+      unsigned offset;
+      long long frame;
+
+      if (line.compare(0, 7, "# rate ") == 0)
+         rate = strtoul(line.c_str() + 7, NULL, 10);
+      if (line.empty() || line[0] == '#')
+         continue;
+
+      if (!(ss >> cycle >> offset >> frame >> port))
+         return false;
+      while (ss >> word)
+         bytes += (bytes.empty() ? "" : " ") + word;
+      ports[port].push_back(std::make_pair((int64_t)frame, bytes));
+   }
+
+   return in.eof() && rate > 0;
+}
+
+/*******************************************************************************************/
+/* Set the error. Returns false. */
+static bool fail(std::string &error, const char *what)
+{
+   error = what;
+   return false;
+}
+
+/*******************************************************************************************/
+/* Read a variable length quantity. */
+static bool readVarLen(const std::vector<unsigned char> &d, size_t &pos, uint64_t &value)
+{
+   value = 0;
+   for (int i = 0; i < 10 && pos < d.size(); i ++)
+   {
+      value = (value << 7) | (d[pos] & 0x7f);
+      if ((d[pos ++] & 0x80) == 0)
+         return true;
+   }
+   return false;
+}
+
+/*******************************************************************************************/
+/* Read a Standard MIDI File into the events of every track, named after the port. The times are
+   converted to frames at the given rate; a tick that does not fall on a frame is an error. */
+static bool readSmf(const char *path, unsigned rate, std::map<std::string, PortEvents> &ports, std::string &error)
+{
+   std::ifstream in (path, std::ios::binary);
+   std::vector<unsigned char> d ((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+   uint64_t division = 0, tempo = 500000;
+   size_t pos = 0;
+
+   while (pos + 8 <= d.size())
+   {
+      std::string type (d.begin() + pos, d.begin() + pos + 4);
+      size_t len = (d[pos + 4] << 24) | (d[pos + 5] << 16) | (d[pos + 6] << 8) | d[pos + 7];
+      size_t end = pos + 8 + len;
+      pos += 8;
+      if (end > d.size())
+         break;
+
+      if (type == "MThd")
+      {
+         division = (d[pos + 4] << 8) | d[pos + 5];
+         if (division == 0 || division >= 0x8000)
+            return fail(error, "unsupported division");
+      }
+      else if (type == "MTrk")
+      {
+         std::string name;
+         PortEvents events;
+         uint64_t tick = 0, delta;
+         unsigned char status = 0;
+
+         while (pos < end)
+         {
+            if (!readVarLen(d, pos, delta) || pos >= end)
+               return fail(error, "broken track");
+            tick += delta;
+
+            std::vector<unsigned char> msg;
+            if (d[pos] == 0xff)
+            {
+               // A meta event; the tempo and the track name matter.
+               uint64_t n;
+               unsigned char meta = d[pos + 1];
+               pos += 2;
+               if (!readVarLen(d, pos, n) || pos + n > end)
+                  return fail(error, "broken meta event");
+               if (meta == 0x51 && n == 3)
+                  tempo = (d[pos] << 16) | (d[pos + 1] << 8) | d[pos + 2];
+               if (meta == 0x03)
+                  name.assign(d.begin() + pos, d.begin() + pos + n);
+               pos += n;
+               continue;
+            }
+            else if (d[pos] == 0xf0 || d[pos] == 0xf7)
+            {
+               // SysEx keeps its status byte; the escaped messages are sent as they are.
+               uint64_t n;
+               unsigned char type = d[pos ++];
+               if (!readVarLen(d, pos, n) || pos + n > end)
+                  return fail(error, "broken sysex event");
+               if (type == 0xf0)
+                  msg.push_back(0xf0);
+               msg.insert(msg.end(), d.begin() + pos, d.begin() + pos + n);
+               pos += n;
+            }
+            else
+            {
+               if (d[pos] & 0x80)
+                  status = d[pos ++];
+               if (status == 0)
+                  return fail(error, "data byte without a status");
+
+               size_t n = (status & 0xf0) == 0xc0 || (status & 0xf0) == 0xd0 ? 1 : 2;
+               if (pos + n > end)
+                  return fail(error, "broken channel message");
+               msg.push_back(status);
+               msg.insert(msg.end(), d.begin() + pos, d.begin() + pos + n);
+               pos += n;
+            }
+
+            // A tick lasts tempo / division microseconds.
+            uint64_t num = tick * tempo * rate, den = division * 1000000;
+            if (num % den != 0)
+               return fail(error, "a tick does not fall on a frame");
+
+            std::string bytes;
+            char buf[4];
+            for (size_t i = 0; i < msg.size(); i ++)
+            {
+               snprintf(buf, sizeof(buf), i == 0 ? "%02x" : " %02x", msg[i]);
+               bytes += buf;
+            }
+            events.push_back(std::make_pair((int64_t)(num / den), bytes));
+         }
+
+         if (!events.empty())
+            ports[name] = events;
+      }
+
+      pos = end;
+   }
+
+   if (division == 0)
+      return fail(error, "no header");
+   return true;
+}
+
+/*******************************************************************************************/
+/* Compare a MIDI file with a simulation record port by port. */
+static bool compareSmf(const char *smfPath, const char *recordPath)
+{
+   std::map<std::string, PortEvents> record, smf;
+   std::string error;
+   unsigned rate;
+
+   if (!readRecord(recordPath, record, rate))
+      error = "cannot read the record";
+   else if (readSmf(smfPath, rate, smf, error))
+   {
+      for (std::map<std::string, PortEvents>::iterator it = record.begin(); it != record.end() && error.empty(); it ++)
+      {
+         const PortEvents &a = it->second, &b = smf[it->first];
+         for (size_t i = 0; i < a.size() && error.empty(); i ++)
+         {
+            if (i >= b.size() || a[i] != b[i])
+            {
+               std::ostringstream ss;
+               ss << "port " << it->first << " differs at the event " << i << ": " << a[i].first << " " << a[i].second;
+               if (i < b.size())
+                  ss << " in the record, " << b[i].first << " " << b[i].second << " in the file";
+               error = ss.str();
+            }
+         }
+         if (error.empty() && b.size() > a.size())
+            error = "port " + it->first + " has more events in the file";
+      }
+      if (error.empty() && smf.size() > record.size())
+         error = "the file has more ports";
+   }
+
+   if (!error.empty())
+      printf("%s: FAILED, %s\n", smfPath, error.c_str());
+   return error.empty();
+}
+
+/*******************************************************************************************/
+/* main */
+int main(int argc, char **argv)
+{
+   if (argc == 3)
+      return compareSmf(argv[1], argv[2]) ? 0 : 1;
+
+   gPlaying = true;
+   RtLog::instance()->start(stderr);
+
+   RecordBackend *backend = new RecordBackend(CHECK_WRAP - CHECK_WRAP_LEAD);
+   JackEngine *jack = JackEngine::instance();
+   jack->setBackend(backend);
+   jack->setDirectDispatch(true);
+   try {
+      jack->init();
+   } catch (const char *s) {
+      std::cerr << "Error during the output initialization: " << s << std::endl;
+      return 1;
+   }
+
+   bool ok = true;
+   {
+      MidiHeap heap (16);
+      TimingWheel wheel (16);
+      ok &= checkSchedulerWrap("wrap/heap", heap);
+      ok &= checkSchedulerWrap("wrap/wheel", wheel);
+   }
+   ok &= checkEngineWrap(jack, backend);
+   ok &= checkTempoDrift(jack);
+   ok &= checkTempoParts(jack, backend);
+   ok &= checkNotePairs(jack, backend);
+
+   gPlaying = false;
+   jack->shutdown();
+   RtLog::instance()->stop();
+   return ok ? 0 : 1;
+}
@@ -3,7 +3,11 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 
+/* A point on the 64-bit monotonic frame timeline. It does not wrap like the 32-bit jack frame
+   counter; the conversion to jack offsets happens in the process callback only. */
+typedef uint64_t frametime_t;
 
 extern bool gPlaying;
 
@@ -13,12 +17,14 @@ extern bool gPlaying;
 #define MIDI_CONTROLLER                0xB0
 #define MIDI_RESET                     0xFF
 #define MIDI_HOLD_PEDAL                64
-#define MIDI_ALL_SOUND_OFF             0x7B
+#define MIDI_ALL_SOUND_OFF             120
 #define MIDI_ALL_MIDI_CONTROLLERS_OFF  121
 #define MIDI_ALL_NOTES_OFF             123
 #define MIDI_BANK_SELECT_MSB           0
 #define MIDI_BANK_SELECT_LSB           32
 #define MIDI_PITCH_BEND                0xE0
+#define MIDI_POLY_PRESSURE             0xA0
+#define MIDI_CHANNEL_PRESSURE          0xD0
 
 /*******************************************************************************************/
 /* TRACE */
@@ -141,7 +141,7 @@ ControlFlow WaitEvent::execute(JackEngine *jack, Sequencer *seq)
          for (Event *e : chEvents)
          {
             e->sustain(jack, seq);
-            seq->advanceTime(jack->msToNframes(60 * 1000 / seq->getTempo() / seq->getQuant()));
+            seq->advanceLine();
          }
 
    return {false, false, false};
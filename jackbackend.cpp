@@ -0,0 +1,165 @@
+#include "jackbackend.h"
+
+#include <string.h>
+#include <unistd.h>
+
+/*****************************************************************************************************/
+/* Constructor. */
+JackBackend::JackBackend()
+{
+   mClient = NULL;
+   mInputPort = NULL;
+   memset(mOutputPorts, 0, sizeof(mOutputPorts));
+}
+
+/*****************************************************************************************************/
+/* Open the output and connect the callbacks to the engine. Throws a message on failure. */
+void JackBackend::open(JackEngine *engine)
+{
+   jack_options_t options = JackNullOption;
+   jack_status_t  status;
+
+   if ((mClient = jack_client_open("jctracker", options, &status)) == 0)
+      throw "Jack server is not running.";
+
+   // Set the callbacks.
+   jack_set_process_callback(mClient, jack_process_cb, (void*) engine);
+   jack_set_buffer_size_callback(mClient, jack_buffsize_cb, (void*) engine);
+   jack_set_xrun_callback(mClient, jack_xrun_cb, (void*) engine);
+   jack_on_shutdown(mClient, jack_shutdown_cb, (void*) engine);
+
+   mInputPort = jack_port_register(mClient, "input", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+}
+
+/*****************************************************************************************************/
+/* Start running the process cycles. */
+void JackBackend::activate()
+{
+   if (jack_activate(mClient))
+      throw "cannot activate Jack client";
+}
+
+/*****************************************************************************************************/
+/* Close the output. */
+void JackBackend::close()
+{
+   jack_port_unregister(mClient, mInputPort);
+   jack_port_unregister(mClient, mOutputPorts[0]);
+   jack_client_close(mClient);
+}
+
+/*****************************************************************************************************/
+/* The sample rate in frames per second. */
+jack_nframes_t JackBackend::sampleRate()
+{
+   return jack_get_sample_rate(mClient);
+}
+
+/*****************************************************************************************************/
+/* The number of frames in a process cycle. */
+jack_nframes_t JackBackend::bufferSize()
+{
+   return jack_get_buffer_size(mClient);
+}
+
+/*****************************************************************************************************/
+/* The current frame time. */
+jack_nframes_t JackBackend::frameTime()
+{
+   return jack_frame_time(mClient);
+}
+
+/*****************************************************************************************************/
+/* The frame time the current process cycle started at. Called from the process callback. */
+jack_nframes_t JackBackend::cycleStart()
+{
+   jack_nframes_t cycleFrames;
+   jack_time_t cycleUsecs, nextUsecs;
+   float periodUsecs;
+
+   if (jack_get_cycle_times(mClient, &cycleFrames, &cycleUsecs, &nextUsecs, &periodUsecs) != 0)
+      cycleFrames = jack_last_frame_time(mClient);
+   return cycleFrames;
+}
+
+/*****************************************************************************************************/
+/* The current time in microseconds. */
+jack_time_t JackBackend::time()
+{
+   return jack_get_time();
+}
+
+/*****************************************************************************************************/
+/* The time of the given frame in microseconds. Jack maps it using the timing of the recent cycles. */
+jack_time_t JackBackend::frameToTime(jack_nframes_t frame)
+{
+   return jack_frames_to_time(mClient, frame);
+}
+
+/*****************************************************************************************************/
+/* How long the latest xrun was, in microseconds. */
+float JackBackend::xrunDelay()
+{
+   return jack_get_xrun_delayed_usecs(mClient);
+}
+
+/*****************************************************************************************************/
+/* The realtime priority of the process cycles, or -1 if they do not run realtime. */
+int JackBackend::realtimePriority()
+{
+   return jack_client_real_time_priority(mClient);
+}
+
+/*****************************************************************************************************/
+/* Register an output port with the given index. Returns false on failure. */
+bool JackBackend::registerPort(unsigned idx, const std::string &name)
+{
+   jack_port_t *p = jack_port_register(mClient, name.c_str(), JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
+   if (p == NULL)
+      return false;
+
+   mOutputPorts[idx] = p;
+   return true;
+}
+
+/*****************************************************************************************************/
+/* The short name of the output port. */
+std::string JackBackend::portName(unsigned idx)
+{
+   return jack_port_short_name(mOutputPorts[idx]);
+}
+
+/*****************************************************************************************************/
+/* Connect the output port to the destination. Returns 0 on success. */
+int JackBackend::connectPort(unsigned idx, const std::string &destination)
+{
+   return jack_connect(mClient, jack_port_name(mOutputPorts[idx]), destination.c_str());
+}
+
+/*****************************************************************************************************/
+/* The midi buffer of the output port for the current cycle, or NULL. Called from the process callback. */
+void* JackBackend::portBuffer(unsigned idx, jack_nframes_t nframes)
+{
+   return jack_port_get_buffer(mOutputPorts[idx], nframes);
+}
+
+/*****************************************************************************************************/
+/* Remove all the events from the midi buffer. */
+void JackBackend::clearBuffer(void *buffer)
+{
+   jack_midi_clear_buffer(buffer);
+}
+
+/*****************************************************************************************************/
+/* Make room for an event in the midi buffer. Returns NULL if it does not fit. */
+unsigned char* JackBackend::reserveEvent(void *buffer, jack_nframes_t offset, size_t size)
+{
+   return jack_midi_event_reserve(buffer, offset, size);
+}
+
+/*****************************************************************************************************/
+/* Let the given time pass: the Jack server runs the cycles meanwhile. */
+void JackBackend::idle(unsigned ms)
+{
+   usleep(ms * 1000);
+}
@@ -0,0 +1,43 @@
+#ifndef JACKBACKEND_H
+#define JACKBACKEND_H
+
+#include <jack/jack.h>
+#include <jack/midiport.h>
+
+#include "jackengine.h"
+#include "midibackend.h"
+
+/*******************************************************************************************/
+/* The output through a Jack server in real time. */
+class JackBackend : public MidiBackend
+{
+   private:
+      jack_client_t     *mClient;          // The client representation.
+      jack_port_t       *mInputPort;       // Isn't used yet.
+      jack_port_t       *mOutputPorts[MAX_OUTPUT_PORTS];
+
+   public:
+      /* Constructor. */
+      JackBackend();
+
+      void open(JackEngine *engine);
+      void activate();
+      void close();
+      jack_nframes_t sampleRate();
+      jack_nframes_t bufferSize();
+      jack_nframes_t frameTime();
+      jack_nframes_t cycleStart();
+      jack_time_t time();
+      jack_time_t frameToTime(jack_nframes_t frame);
+      float xrunDelay();
+      int realtimePriority();
+      bool registerPort(unsigned idx, const std::string &name);
+      std::string portName(unsigned idx);
+      int connectPort(unsigned idx, const std::string &destination);
+      void* portBuffer(unsigned idx, jack_nframes_t nframes);
+      void clearBuffer(void *buffer);
+      unsigned char* reserveEvent(void *buffer, jack_nframes_t offset, size_t size);
+      void idle(unsigned ms);
+};
+
+#endif
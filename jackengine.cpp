@@ -1,11 +1,28 @@
 #include "jackengine.h"
 
+#include <algorithm>
 #include <iostream>
 
+#include <errno.h>
+#include <math.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "jackbackend.h"
+#include "realtime.h"
+#include "rtlog.h"
+
+/* The states of the events within a process cycle. */
+enum
+{
+   EVENT_PENDING,
+   EVENT_SENT,
+   EVENT_SKIPPED,          // Superseded by a later value of the same controller.
+   EVENT_DEFERRED,         // Carried over to the next cycle.
+   EVENT_DROPPED
+};
 
 /*****************************************************************************************************/
 /* A thread for moving the midi events from the heap and to the ringbuffer */
@@ -14,13 +31,15 @@ void* bufferProcessingThread(void *arg)
    JackEngine *jack = (JackEngine*) arg;
    if (jack == NULL) return NULL;
 
+   if (jack->mbLockMemory)
+      prefaultStack();
+
    while (gPlaying)
    {
-      // While we have an upcoming events that should be sent in the next buffer, do write them in the ringbuffer.
-      while (jack->mMidiHeap->peekMin().time <= jack->currentFrameTime() + 100)
-         jack->writeMidiData(jack->mMidiHeap->popMin());
+      // Move the events that should be sent in the next buffer to the ringbuffer.
+      jack->dispatchEvents(jack->currentFrameTime() + jack->mLookahead.load());
 
-      usleep(1000);
+      jack->waitForDeadline();
    }
 
    return NULL;
@@ -31,77 +50,161 @@ void* bufferProcessingThread(void *arg)
 int jack_process_cb(jack_nframes_t nframes, void *arg)
 {
    JackEngine *jack = (JackEngine*) arg;
-   jack_port_t *portP = NULL;
-   void *portbuffer = NULL;
+   unsigned portCount = jack->mOutputPortCount.load(std::memory_order_acquire);
+   MidiMessage *cycle = jack->mCycle;
 
-   int t = 0;
-   jack_nframes_t lastFrameTime = jack_last_frame_time(jack->mClient);
+   // The start of the current cycle on the 64-bit timeline.
+   frametime_t cycleStart = jack->extendFrameTime(jack->mBackend->cycleStart());
 
-   // Clear all buffer first.
-   for (std::vector<jack_port_t*>::iterator it = jack->mOutputPorts.begin();
-         it != jack->mOutputPorts.end();
-         it ++)
+   // After an xrun the events of the lost time arrive late; the shift policy moves the timeline past it.
+   if (jack->mbXrunPending.exchange(false))
    {
-      void *pbuf = jack_port_get_buffer(*it, nframes);
+      frametime_t gap = jack->mPrevCycleEnd != 0 && cycleStart > jack->mPrevCycleEnd ? cycleStart - jack->mPrevCycleEnd : 0;
+      if (gap == 0)
+         gap = jack->mXrunDelayFrames.load();
+
+      jack->mbRecovering = true;
+      if (jack->mXrunPolicy == XRUN_SHIFT)
+         jack->mTimeShift.fetch_add(gap);
+   }
+   jack->mPrevCycleEnd = cycleStart + nframes;
+
+   frametime_t lastFrameTime = cycleStart - jack->mTimeShift.load();
+
+   // Get and clear all the port buffers once per cycle.
+   for (unsigned i = 0; i < portCount; i ++)
+   {
+      void *pbuf = jack->mBackend->portBuffer(i, nframes);
       if (pbuf != NULL)
-         jack_midi_clear_buffer(pbuf);
+         jack->mBackend->clearBuffer(pbuf);
+      jack->mPortBuffers[i] = pbuf;
    }
 
-   // Read the data from the ringbuffer.
-   while (jack_ringbuffer_read_space(jack->mRingbuffer) >= sizeof(MidiMessage))
+   size_t ringUsed = jack_ringbuffer_read_space(jack->mRingbuffer) / sizeof(MidiMessage);
+   if (ringUsed > jack->mRingHighWater.load(std::memory_order_relaxed))
+      jack->mRingHighWater.store(ringUsed, std::memory_order_relaxed);
+
+   // The events carried over from the previous cycle are already there; add the due events from the ringbuffer.
+   size_t n = jack->mCycleCount;
+   while (n < CYCLE_MAX_EVENTS && jack_ringbuffer_read_space(jack->mRingbuffer) >= sizeof(MidiMessage))
    {
-      MidiMessage midiData;
-      if (jack_ringbuffer_peek(jack->mRingbuffer, (char*)&midiData, sizeof(MidiMessage)) != sizeof(MidiMessage))
+      if (jack_ringbuffer_peek(jack->mRingbuffer, (char*)&cycle[n], sizeof(MidiMessage)) != sizeof(MidiMessage))
       {
-         std::cerr << "WARNING! Incomplete MIDI message read." << std::endl;
-         continue;
+         rtwarn("Incomplete MIDI message read.");
+         break;
       }
 
-      t = midiData.time + nframes - lastFrameTime;
-      if (t >= (int)nframes)
+      // Only here the timeline is converted to the offset within the jack buffer.
+      if ((int64_t)(cycle[n].time + nframes - lastFrameTime) >= (int64_t)nframes)
          break;
 
       jack_ringbuffer_read_advance(jack->mRingbuffer, sizeof(MidiMessage));
+      n ++;
+   }
+
+   for (size_t i = 0; i < n; i ++)
+   {
+      // Late and carried over events go at the start of the buffer.
+      int64_t t = (int64_t)(cycle[i].time + nframes - lastFrameTime);
+      jack->mCycleOffset[i] = t < 0 ? 0 : t;
+      jack->mCycleState[i] = EVENT_PENDING;
 
-      if (t < 0)
-         t = 0;
+      // Use the default midi port if the port is unknown.
+      if (cycle[i].port >= portCount)
+         cycle[i].port = 0;
+   }
+
+   if (jack->mbRecovering)
+      jack->recoverLateEvents(n, nframes, lastFrameTime);
 
-      // Initialize output buffer.
-      if (midiData.port == 0)
-         midiData.port = jack->mDefaultOutputPort;
-      if (portP != midiData.port)
+   // Write the events in order, each port as far as its buffer allows.
+   size_t fullCount = 0;
+   for (size_t i = 0; i < n; i ++)
+   {
+      unsigned port = cycle[i].port;
+      if (jack->mPortFull[port] || jack->mCycleState[i] != EVENT_PENDING)
+         continue;
+
+      void *portbuffer = jack->mPortBuffers[port];
+      if (portbuffer == NULL)
       {
-         // The port has changed since the previous iteration or was not yet initialize. Reinitialize the buffer.
-         portP = midiData.port;
+         jack->mCycleState[i] = EVENT_DROPPED;
+         jack->countDropped(cycle[i]);
+      }
+      else if (jack->writeCycleEvent(portbuffer, i))
+         jack->mCycleState[i] = EVENT_SENT;
+      else
+      {
+         jack->mPortFull[port] = true;
+         jack->mFullPorts[fullCount ++] = port;
+      }
+   }
 
-         // Use the default midi port if no port specified.
-         if (portP == NULL)
-            portP = jack->mDefaultOutputPort;
+   for (size_t f = 0; f < fullCount; f ++)
+   {
+      jack->resolveFullPort(jack->mFullPorts[f], n);
+      jack->mPortFull[jack->mFullPorts[f]] = false;
+   }
 
-         // Get the buffer
-         portbuffer = jack_port_get_buffer(portP, nframes);
-         if (portbuffer == NULL)
-         {
-            std::cerr << "WARNING! Cannot get jack port buffer." << std::endl;
-            return -1;
-         }
+   // Keep the deferred events for the next cycle; the payloads of the others are done with.
+   size_t carried = 0;
+   for (size_t i = 0; i < n; i ++)
+   {
+      if (jack->mCycleState[i] == EVENT_DEFERRED)
+      {
+         cycle[carried ++] = cycle[i];
+         continue;
       }
 
-      jack_midi_data_t *buffer = jack_midi_event_reserve(portbuffer, t, midiData.len);
-      if (buffer == NULL)
+      if (jack->mCycleState[i] == EVENT_SENT)
       {
-         std::cerr << "WARNING! Cannot get buffer for midi content." << std::endl;
-         break;
+         jack->countLateness(cycle[i], (int64_t)(cycle[i].time + nframes - lastFrameTime));
+         rttrace("jack_process_cb: midi(%x,%x,%x) t=%llu\n", cycle[i].data[0], cycle[i].data[1], cycle[i].data[2],
+               (long long unsigned)cycle[i].time);
       }
-      memcpy(buffer, midiData.data, midiData.len);
 
-      trace("jack_process_cb: midi(%x,%x,%x) t=%llu\n", midiData.data[0], midiData.data[1], midiData.data[2],
-            (long long unsigned)midiData.time);
+      if (cycle[i].isPooled())
+         jack->mPayloadPool->release(cycle[i].handle);
    }
+   jack->mCycleCount = carried;
+   jack->mCarriedPending.store(carried, std::memory_order_release);
 
    return 0;      
 }
 
+/*****************************************************************************************************/
+/* Jack buffer size callback. */
+int jack_buffsize_cb(jack_nframes_t nframes, void *arg)
+{
+   JackEngine *jack = (JackEngine*) arg;
+
+   jack->mBufferSize = nframes;
+   jack->updateLookahead();
+
+   // Let the dispatch thread see the new horizon at once.
+   if (!jack->mbDirectDispatch)
+      jack->wakeDispatcher(0);
+
+   return 0;
+}
+
+/*****************************************************************************************************/
+/* Jack xrun callback. Remember where it happened; the next process cycle recovers. */
+int jack_xrun_cb(void *arg)
+{
+   JackEngine *jack = (JackEngine*) arg;
+   float delay = jack->mBackend->xrunDelay();
+   uint64_t n = jack->mXrunCount.load();
+
+   jack->mXrunFrames[n % XRUN_LOG_SIZE] = jack->currentFrameTime();
+   jack->mXrunDelays[n % XRUN_LOG_SIZE] = delay;
+   jack->mXrunDelayFrames = (frametime_t)delay * jack->mSampleRate / 1000000;
+   jack->mXrunCount.store(n + 1);
+   jack->mbXrunPending = true;
+
+   return 0;
+}
+
 /*****************************************************************************************************/
 /* Jack shutdown callback. */
 void jack_shutdown_cb(void *arg)
@@ -111,27 +214,466 @@ void jack_shutdown_cb(void *arg)
 }
 
 /*****************************************************************************************************/
-/* Write the midi message into the ringbuffer which is processed by jack callback in its turn. */
-void JackEngine::writeMidiData(MidiMessage theMessage)
+/* Write the midi message into the ringbuffer which is processed by jack callback in its turn.
+   Returns false if there is no space for it. */
+bool JackEngine::writeMidiData(const MidiMessage &theMessage)
+{
+   if (jack_ringbuffer_write_space(mRingbuffer) <= sizeof(MidiMessage))
+      return false;
+
+   if (jack_ringbuffer_write(mRingbuffer, (const char*) &theMessage, sizeof(MidiMessage)) != sizeof(MidiMessage))
+      rtwarn("Midi message is not written entirely.");
+   return true;
+}
+
+/*****************************************************************************************************/
+/* Move the events up to the given time to the ringbuffer as long as there is space for them.
+   The popped events that do not fit are held back and go first on the next call, so the
+   ringbuffer stays sorted and nothing is lost while the process callback catches up. */
+void JackEngine::dispatchEvents(frametime_t time)
+{
+   bool full = false;
+
+   do
+   {
+      for (; mHeldPos < mHeldCount && !full; mHeldPos ++)
+         full = !writeMidiData(mHeld[mHeldPos]);
+
+      if (full)
+      {
+         mHeldPos --;
+
+         // Count each held back event once, however many passes it waits.
+         for (size_t i = std::max(mHeldPos, mHeldCounted); i < mHeldCount; i ++)
+         {
+            unsigned port = mHeld[i].port < MAX_OUTPUT_PORTS ? mHeld[i].port : 0;
+            mDeferred[port].fetch_add(1, std::memory_order_relaxed);
+         }
+         mHeldCounted = mHeldCount;
+         break;
+      }
+
+      mHeldPos = mHeldCounted = 0;
+      mHeldCount = mMidiQueue->popUntil(time, mHeld, DISPATCH_BATCH_SIZE);
+   }
+   while (mHeldCount > 0);
+
+   mHeldPending.store(mHeldCount - mHeldPos, std::memory_order_release);
+}
+
+/*****************************************************************************************************/
+/* Apply the xrun recovery policy to the late events of the cycle. The recovery ends with
+   the first cycle that has no late events. RT safe. */
+void JackEngine::recoverLateEvents(size_t n, jack_nframes_t nframes, frametime_t lastFrameTime)
 {
-   if (jack_ringbuffer_write_space(mRingbuffer) > sizeof(MidiMessage))
+   size_t late = 0;
+
+   for (size_t i = 0; i < n; i ++)
    {
-      if (jack_ringbuffer_write(mRingbuffer, (const char*) &theMessage, sizeof(MidiMessage)) != sizeof(MidiMessage))
-         std::cerr << "WARNING! Midi message is not written entirely." << std::endl;
+      int64_t t = (int64_t)(mCycle[i].time + nframes - lastFrameTime);
+      if (t >= 0)
+         continue;
+
+      // Dropping a note off would leave the note hanging.
+      if (mXrunPolicy == XRUN_DROP && -t > (int64_t)mXrunDropAge
+            && mCycle[i].deliveryClass() != MIDI_CLASS_ESSENTIAL)
+      {
+         mCycleState[i] = EVENT_DROPPED;
+         countDropped(mCycle[i]);
+         mXrunDropped.fetch_add(1, std::memory_order_relaxed);
+      }
+      else
+         late ++;
    }
-   return;
+
+   if (late == 0)
+      mbRecovering = false;
+   else if (mXrunPolicy == XRUN_SPREAD)
+   {
+      // Give the late events even distances over the period; the rest keep the order after them.
+      size_t k = 0;
+      jack_nframes_t prev = 0;
+      for (size_t i = 0; i < n; i ++)
+      {
+         if (mCycleState[i] != EVENT_PENDING)
+            continue;
+         if ((int64_t)(mCycle[i].time + nframes - lastFrameTime) < 0)
+            mCycleOffset[i] = k ++ * nframes / late;
+         mCycleOffset[i] = prev = std::max(prev, mCycleOffset[i]);
+      }
+   }
+}
+
+/*****************************************************************************************************/
+/* Count a sent message in the lateness histogram of its port. RT safe. */
+void JackEngine::countLateness(const MidiMessage &msg, int64_t offset)
+{
+   unsigned bucket = 0;
+   for (int64_t late = -offset; late > 0 && bucket < STATS_LATENESS_BUCKETS - 1; late >>= 1)
+      bucket ++;
+
+   mLateness[msg.port][bucket].fetch_add(1, std::memory_order_relaxed);
+   mEventsSent.fetch_add(1, std::memory_order_relaxed);
+}
+
+/*****************************************************************************************************/
+/* Count a message that could not be delivered. RT safe. */
+void JackEngine::countDropped(const MidiMessage &msg)
+{
+   unsigned port = msg.port < MAX_OUTPUT_PORTS ? msg.port : 0;
+   mDropped[port].fetch_add(1, std::memory_order_relaxed);
+}
+
+/*****************************************************************************************************/
+/* Reserve the space for the given event of the cycle in the port buffer and copy it there. RT safe. */
+bool JackEngine::writeCycleEvent(void *portbuffer, size_t i)
+{
+   const MidiMessage &msg = mCycle[i];
+
+   // Long messages are copied from the payload pool right into the jack buffer.
+   size_t size = msg.len;
+   const unsigned char *bytes = msg.data;
+   if (msg.isPooled())
+   {
+      size = mPayloadPool->size(msg.handle);
+      bytes = mPayloadPool->data(msg.handle);
+   }
+
+   unsigned char *buffer = mBackend->reserveEvent(portbuffer, mCycleOffset[i], size);
+   if (buffer == NULL)
+      return false;
+
+   memcpy(buffer, bytes, size);
+   return true;
+}
+
+/*****************************************************************************************************/
+/* Rewrite the buffer of the given port with the pending events of the given class and above, and
+   with the `extra` earliest events of the class below; the events are the first `m` of mPortEvents.
+   Once an event of a note is held back, the later events of that note stay back with it, so a note
+   off never goes out before its note on. Returns false if an event meant to go did not fit. RT safe. */
+bool JackEngine::fillPort(unsigned port, size_t m, int level, size_t extra)
+{
+   void *portbuffer = mPortBuffers[port];
+   size_t below = 0;
+   bool empty = true;
+
+   for (size_t k = 0; k < m; k ++)
+   {
+      size_t i = mPortEvents[k];
+      if (mCycleState[i] == EVENT_SENT)
+         mCycleState[i] = EVENT_PENDING;
+
+      int key = mCycle[i].noteKey();
+      if (key >= 0)
+         mHeldKeys[key] = false;
+   }
+
+   mBackend->clearBuffer(portbuffer);
+
+   for (size_t k = 0; k < m; k ++)
+   {
+      size_t i = mPortEvents[k];
+      if (mCycleState[i] != EVENT_PENDING)
+         continue;
+
+      int cls = mCycle[i].deliveryClass();
+      int key = mCycle[i].noteKey();
+      bool wanted = cls >= level || (cls == level - 1 && below ++ < extra);
+      if (!wanted || (key >= 0 && mHeldKeys[key]))
+      {
+         if (key >= 0)
+            mHeldKeys[key] = true;
+         continue;
+      }
+
+      if (writeCycleEvent(portbuffer, i))
+      {
+         mCycleState[i] = EVENT_SENT;
+         empty = false;
+      }
+      else if (empty)
+      {
+         // It does not fit even into the empty buffer.
+         mCycleState[i] = EVENT_DROPPED;
+         countDropped(mCycle[i]);
+      }
+      else
+         return false;
+   }
+
+   return true;
+}
+
+/*****************************************************************************************************/
+/* Refill the full buffer of the given port by priority; what does not fit is carried over. RT safe.
+   Jack wants the events of a buffer in time order, so the buffer is rewritten from scratch with
+   fewer classes each time until the rest fits; the room left goes to the earliest events of the
+   class held back last, so no class starves. The events of the port are gathered once and every
+   pass is linear in them. */
+void JackEngine::resolveFullPort(unsigned port, size_t n)
+{
+   size_t m = 0;
+   for (size_t i = 0; i < n; i ++)
+      if (mCycle[i].port == port && (mCycleState[i] == EVENT_PENDING || mCycleState[i] == EVENT_SENT))
+         mPortEvents[m ++] = i;
+
+   // Thin the controller ramps first: only the latest value of each controller matters.
+   for (size_t k = m; k-- > 0; )
+   {
+      size_t i = mPortEvents[k];
+      int key = mCycle[i].controlKey();
+      if (key < 0)
+         continue;
+
+      if (mSeenControls[key])
+      {
+         mCycleState[i] = EVENT_SKIPPED;
+         mCoalesced.fetch_add(1, std::memory_order_relaxed);
+      }
+      else
+         mSeenControls[key] = true;
+   }
+   for (size_t k = 0; k < m; k ++)
+   {
+      int key = mCycle[mPortEvents[k]].controlKey();
+      if (key >= 0)
+         mSeenControls[key] = false;
+   }
+
+   int level = MIDI_CLASS_CONTROL;
+   bool fits;
+   while (!(fits = fillPort(port, m, level, 0)) && level < MIDI_CLASS_COUNT - 1)
+      level ++;
+
+   // Take as many of the class below as still fit along with the rest. More of them never take
+   // less room, so the count is found by halving.
+   if (fits && level > MIDI_CLASS_CONTROL)
+   {
+      size_t low = 0, high = 0, tried = 0;
+      for (size_t k = 0; k < m; k ++)
+      {
+         size_t i = mPortEvents[k];
+         if (mCycleState[i] == EVENT_PENDING && mCycle[i].deliveryClass() == level - 1)
+            high ++;
+      }
+
+      while (low < high)
+      {
+         tried = (low + high + 1) / 2;
+         if (fillPort(port, m, level, tried))
+            low = tried;
+         else
+            high = tried - 1;
+      }
+      if (tried != low)
+         fillPort(port, m, level, low);
+   }
+
+   for (size_t k = 0; k < m; k ++)
+   {
+      size_t i = mPortEvents[k];
+      if (mCycleState[i] == EVENT_PENDING)
+      {
+         mCycleState[i] = EVENT_DEFERRED;
+         mClassDeferred[mCycle[i].deliveryClass()].fetch_add(1, std::memory_order_relaxed);
+      }
+   }
+}
+
+/*****************************************************************************************************/
+/* Convert a frame time to the absolute CLOCK_MONOTONIC time.
+   Jack maps the frames to its microsecond clock using the timing of the recent cycles. */
+struct timespec JackEngine::frameToTimespec(frametime_t frame)
+{
+   struct timespec ts;
+   int64_t usecs = (int64_t)mBackend->frameToTime((jack_nframes_t)(frame + mTimeShift.load()))
+      - (int64_t)mBackend->time();
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   if (usecs > 0)
+   {
+      ts.tv_sec  += usecs / 1000000;
+      ts.tv_nsec += (usecs % 1000000) * 1000;
+      if (ts.tv_nsec >= 1000000000)
+      {
+         ts.tv_sec ++;
+         ts.tv_nsec -= 1000000000;
+      }
+   }
+
+   return ts;
+}
+
+/*****************************************************************************************************/
+/* Put the dispatch thread to sleep until the next event is due or an earlier event is queued. */
+void JackEngine::waitForDeadline()
+{
+   frametime_t next;
+
+   // The held back events are retried once the process callback has drained the ringbuffer.
+   if (mHeldPending.load(std::memory_order_relaxed) > 0)
+      next = currentFrameTime() + mBufferSize;
+   else if (mMidiQueue->nextTime(next))
+      next -= mLookahead.load();
+   else
+      next = currentFrameTime() + msToNframes(DISPATCH_IDLE_MS);
+
+   // Publish the deadline first, then check for the events queued meanwhile;
+   // the producer does it in the opposite order, so one of us sees the other.
+   mDispatchDeadline.store(next);
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+   if (mMidiQueue->hasUnread())
+      return;
+
+   struct timespec ts = frameToTimespec(next);
+   bool timedOut = false;
+
+   pthread_mutex_lock(&mDispatchMutex);
+   while (!mbDispatchWake && gPlaying && !timedOut)
+      timedOut = pthread_cond_timedwait(&mDispatchCond, &mDispatchMutex, &ts) == ETIMEDOUT;
+   mbDispatchWake = false;
+   pthread_mutex_unlock(&mDispatchMutex);
+
+   mDispatchWakeups.fetch_add(1, std::memory_order_relaxed);
+
+   // Only the wakeups on the deadline tell how late the thread gets to run.
+   if (timedOut)
+   {
+      frametime_t now = currentFrameTime();
+      noteDispatchJitter(now > next ? now - next : 0);
+   }
+}
+
+/*****************************************************************************************************/
+/* Wake the dispatch thread up if the given event time is before its deadline. */
+void JackEngine::wakeDispatcher(frametime_t time)
+{
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+   if (time >= mDispatchDeadline.load() + mLookahead.load())
+      return;
+
+   pthread_mutex_lock(&mDispatchMutex);
+   mbDispatchWake = true;
+   pthread_cond_signal(&mDispatchCond);
+   pthread_mutex_unlock(&mDispatchMutex);
+}
+
+/*****************************************************************************************************/
+/* Account a dispatch thread wakeup that came the given number of frames after its deadline. */
+void JackEngine::noteDispatchJitter(double late)
+{
+   double mean = mJitterMean.load();
+   double dev = mJitterDev.load();
+   double err = late - mean;
+
+   mJitterMean.store(mean + DISPATCH_JITTER_WEIGHT * err);
+   mJitterDev.store(dev + DISPATCH_JITTER_WEIGHT * (fabs(err) - dev));
+
+   if (mbAdaptiveLookahead)
+      updateLookahead();
+}
+
+/*****************************************************************************************************/
+/* Recompute the lookahead from the buffer size and, in the adaptive mode, the dispatch jitter.
+   A period ahead is always enough; the adaptive lookahead is usually much shorter, which keeps
+   the ringbuffer short, and grows up to two periods when the thread is woken up badly late. */
+void JackEngine::updateLookahead()
+{
+   double period = mBufferSize.load();
+   double lookahead = period;
+
+   if (mbAdaptiveLookahead)
+      lookahead = std::min(mJitterMean.load() + DISPATCH_JITTER_MARGIN * mJitterDev.load() + DISPATCH_MIN_LOOKAHEAD,
+            2 * period);
+
+   mLookahead.store(std::max(lookahead, (double)DISPATCH_MIN_LOOKAHEAD));
 }
 
 /*****************************************************************************************************/
 /* Hide the constructor, as it is a singleton. */
 JackEngine::JackEngine()
 {
+   mSchedulerType = SCHEDULER_HEAP;
+   mbDirectDispatch = false;
+   mbAdaptiveLookahead = false;
+   mbLockMemory = false;
+   mbDispatchRealtime = false;
+   mDispatchPriority = 0;
+   mbDispatchAffinity = false;
+   CPU_ZERO(&mDispatchCpus);
+   mBufferSize = 0;
+   mLookahead = DISPATCH_MIN_LOOKAHEAD;
+   mJitterMean = 0;
+   mJitterDev = 0;
+   mQueueSize = MIDI_HEAP_SIZE;
+   mRingbufferSize = RINGBUFFER_SIZE;
+   mRingbuffer = NULL;
+   mMidiQueue = NULL;
+   mPayloadPool = new PayloadPool();
+   mbDispatchWake = false;
+   mDispatchDeadline = 0;
+   mFrameAnchor = 0;
+   mOutputPortCount = 0;
+   mBackend = NULL;
+   memset(mPortBuffers, 0, sizeof(mPortBuffers));
+   mDispatchWakeups = 0;
+   mStartTime = 0;
+   mHeldPos = mHeldCount = mHeldCounted = 0;
+   mHeldPending = 0;
+   mCycleCount = 0;
+   mCarriedPending = 0;
+   mCoalesced = 0;
+   memset(mPortFull, 0, sizeof(mPortFull));
+   memset(mSeenControls, 0, sizeof(mSeenControls));
+   for (unsigned i = 0; i < MIDI_CLASS_COUNT; i ++)
+      mClassDeferred[i] = 0;
+   for (unsigned i = 0; i < MAX_OUTPUT_PORTS; i ++)
+      for (unsigned j = 0; j < STATS_LATENESS_BUCKETS; j ++)
+         mLateness[i][j] = 0;
+   mEventsSent = 0;
+   mRingHighWater = 0;
+   mXrunPolicy = XRUN_CLAMP;
+   mXrunDropAge = 0;
+   mXrunCount = 0;
+   mXrunDropped = 0;
+   mXrunDelayFrames = 0;
+   mbXrunPending = false;
+   mbRecovering = false;
+   mPrevCycleEnd = 0;
+   mTimeShift = 0;
+   for (unsigned i = 0; i < XRUN_LOG_SIZE; i ++)
+   {
+      mXrunFrames[i] = 0;
+      mXrunDelays[i] = 0;
+   }
+   mSeqLead = 0;
+   mSeqLeadMin = INT64_MAX;      // Until the first measure.
+   mSeqLeadMax = INT64_MIN;
+   mStatsLastEvents = 0;
+   mStatsLastTime = 0;
+   for (unsigned i = 0; i < MAX_OUTPUT_PORTS; i ++)
+   {
+      mDeferred[i] = 0;
+      mDropped[i] = 0;
+   }
+
+   pthread_condattr_t attr;
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&mDispatchCond, &attr);
+   pthread_condattr_destroy(&attr);
+   pthread_mutex_init(&mDispatchMutex, NULL);
 }
 
 /*****************************************************************************************************/
 JackEngine::~JackEngine()
 {
-   delete mMidiHeap;
+   delete mMidiQueue;
+   delete mPayloadPool;
+   delete mBackend;
+   pthread_cond_destroy(&mDispatchCond);
+   pthread_mutex_destroy(&mDispatchMutex);
 }
 
 /*****************************************************************************************************/
@@ -142,72 +684,261 @@ JackEngine* JackEngine::instance()
    return inst;
 }
 
+/*****************************************************************************************************/
+/* Choose the event scheduler implementation. Must be called before init(). */
+void JackEngine::setSchedulerType(SchedulerType type)
+{
+   mSchedulerType = type;
+}
+
+/*****************************************************************************************************/
+/* Use the given output instead of Jack; the engine owns it. Must be called before init(). */
+void JackEngine::setBackend(MidiBackend *backend)
+{
+   delete mBackend;
+   mBackend = backend;
+}
+
+/*****************************************************************************************************/
+/* Feed the ringbuffer from the sequencer thread instead of the dispatch thread.
+   Must be called before init(). */
+void JackEngine::setDirectDispatch(bool direct)
+{
+   mbDirectDispatch = direct;
+}
+
+/*****************************************************************************************************/
+/* Size the dispatch lookahead from the measured wakeup jitter instead of the buffer size.
+   Must be called before init(). */
+void JackEngine::setAdaptiveLookahead(bool adaptive)
+{
+   mbAdaptiveLookahead = adaptive;
+}
+
+/*****************************************************************************************************/
+/* Choose how to recover the timing after an xrun. The drop policy drops the events late by
+   more than the given number of frames. Must be called before init(). */
+void JackEngine::setXrunPolicy(XrunPolicy policy, jack_nframes_t dropAge)
+{
+   mXrunPolicy = policy;
+   mXrunDropAge = dropAge;
+}
+
+/*****************************************************************************************************/
+/* Lock the process memory and prefault the buffers and the dispatch thread stack.
+   Must be called before init(). */
+void JackEngine::setLockMemory(bool lock)
+{
+   mbLockMemory = lock;
+}
+
+/*****************************************************************************************************/
+/* Run the dispatch thread under SCHED_FIFO with the priority relative to the jack one.
+   Must be called before init(). */
+void JackEngine::setDispatchPriority(int offset)
+{
+   mbDispatchRealtime = true;
+   mDispatchPriority = offset;
+}
+
+/*****************************************************************************************************/
+/* Pin the dispatch thread to the given CPUs. Must be called before init(). */
+void JackEngine::setDispatchAffinity(const cpu_set_t &cpus)
+{
+   mbDispatchAffinity = true;
+   mDispatchCpus = cpus;
+}
+
+/*****************************************************************************************************/
+/* The SCHED_FIFO priority relative to the jack realtime priority. */
+int JackEngine::realtimePriority(int offset)
+{
+   int base = mBackend->realtimePriority();
+   if (base < 0)
+      base = RT_FALLBACK_PRIORITY;
+
+   return std::max(sched_get_priority_min(SCHED_FIFO), std::min(base + offset, sched_get_priority_max(SCHED_FIFO)));
+}
+
+/*****************************************************************************************************/
+/* Set the number of preallocated queue entries. Must be called before init(). */
+void JackEngine::setQueueSize(size_t size)
+{
+   mQueueSize = size;
+}
+
+/*****************************************************************************************************/
+/* Set the ringbuffer capacity in messages. Must be called before init(). */
+void JackEngine::setRingbufferSize(size_t size)
+{
+   mRingbufferSize = size;
+}
+
+/*****************************************************************************************************/
+/* The maximal number of events that were waiting in the queue. */
+size_t JackEngine::queueHighWater()
+{
+   return mMidiQueue->highWater();
+}
+
+/*****************************************************************************************************/
+/* The number of the registered output ports. */
+unsigned JackEngine::outputPortCount()
+{
+   return mOutputPortCount.load(std::memory_order_acquire);
+}
+
+/*****************************************************************************************************/
+/* The name of the output port with the given index. */
+std::string JackEngine::outputPortName(unsigned port)
+{
+   if (port >= outputPortCount())
+      return "";
+   return mBackend->portName(port);
+}
+
+/*****************************************************************************************************/
+/* The number of messages for the given port that had to wait for the ringbuffer space. */
+uint64_t JackEngine::deferredCount(unsigned port)
+{
+   return port < MAX_OUTPUT_PORTS ? mDeferred[port].load(std::memory_order_relaxed) : 0;
+}
+
+/*****************************************************************************************************/
+/* The number of messages for the given port that were lost. */
+uint64_t JackEngine::droppedCount(unsigned port)
+{
+   return port < MAX_OUTPUT_PORTS ? mDropped[port].load(std::memory_order_relaxed) : 0;
+}
+
+/*****************************************************************************************************/
+/* The number of times a message of the given class was carried over to the next process cycle. */
+uint64_t JackEngine::classDeferredCount(MidiClass cls)
+{
+   return cls < MIDI_CLASS_COUNT ? mClassDeferred[cls].load(std::memory_order_relaxed) : 0;
+}
+
+/*****************************************************************************************************/
+/* The number of controller values left out because a later value was due in the same cycle. */
+uint64_t JackEngine::coalescedCount()
+{
+   return mCoalesced.load(std::memory_order_relaxed);
+}
+
 /*****************************************************************************************************/
 /* Initialization and activation of jack interface. */
 void JackEngine::init()
 {
-   jack_options_t options = JackNullOption;
-   jack_status_t  status;
+   // The locked memory is also faulted in, the preallocated queue included.
+   if (mbLockMemory)
+      lockMemory();
+
+   // Midi event queue.
+   mMidiQueue = new MidiQueue(mQueueSize, mSchedulerType);
+
+   // Create the ringbuffer; jack keeps one byte of it empty.
+   mRingbuffer = jack_ringbuffer_create((mRingbufferSize + 1) * sizeof(MidiMessage));
+   if (mbLockMemory)
+      jack_ringbuffer_mlock(mRingbuffer);
 
-   // Midi event heap.
-   mMidiHeap = new MidiHeap(MIDI_HEAP_SIZE);
+   // Jack is the output unless another backend was set.
+   if (mBackend == NULL)
+      mBackend = new JackBackend();
+   mBackend->open(this);
 
-   // Create the ringbuffer.
-   mRingbuffer = jack_ringbuffer_create(RINGBUFFER_SIZE * sizeof(MidiMessage));
+   // Start the 64-bit timeline from the current backend time.
+   mFrameAnchor = mBackend->frameTime();
 
-   if ((mClient = jack_client_open("jctracker", options, &status)) == 0)
-      throw "Jack server is not running.";
+   mSampleRate = mBackend->sampleRate();
 
-   // Set the callbacks.
-   jack_set_process_callback(mClient, jack_process_cb, (void*) this);
-   jack_on_shutdown(mClient, jack_shutdown_cb, (void*) this);
+   // The default output port.
+   if (!registerOutputPortAt(0, "default"))
+      throw "cannot register the default port";
 
-   mSampleRate = jack_get_sample_rate(mClient);
+   // Find out the buffer size. The adaptive lookahead starts at about a period and learns from there.
+   mBufferSize = mBackend->bufferSize();
+   mJitterDev = (double)mBufferSize / DISPATCH_JITTER_MARGIN;
+   updateLookahead();
 
-   // Create two ports.
-   mInputPort  = jack_port_register(mClient, "input",  JACK_DEFAULT_MIDI_TYPE, JackPortIsInput,  0);
-   mDefaultOutputPort = jack_port_register(mClient, "default", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
-   mOutputPorts.push_back(mDefaultOutputPort);
+   mBackend->activate();
 
-   // Find out the buffer size.
-   mBufferSize = jack_get_buffer_size(mClient);
+   mStartTime = mStatsLastTime = mBackend->time();
 
-   if (jack_activate(mClient))
-      throw "cannot activate Jack client";
+   // In the direct mode the process callback takes the events the sequencer thread has released.
+   if (mbDirectDispatch)
+      return;
 
    pthread_create(&mMidiWriteThread, NULL, bufferProcessingThread, this);
+
+   if (mbDispatchRealtime)
+      setRealtimePriority(mMidiWriteThread, realtimePriority(mDispatchPriority), "dispatch");
+   if (mbDispatchAffinity)
+      setCpuAffinity(mMidiWriteThread, mDispatchCpus, "dispatch");
 }
 
 /*****************************************************************************************************/
-/* Register an output port. */
-jack_port_t* JackEngine::registerOutputPort(std::string name)
+/* Register an output port. Returns the index of the port; the default port has index 0. */
+unsigned JackEngine::registerOutputPort(std::string name)
 {
-   for (std::vector<jack_port_t*>::iterator it = mOutputPorts.begin();
-         it != mOutputPorts.end(); it ++)
+   std::unordered_map<std::string, unsigned>::iterator it = mPortIndex.find(name);
+   if (it != mPortIndex.end())
+      return it->second;
+
+   unsigned idx = mOutputPortCount.load(std::memory_order_relaxed);
+   if (idx >= MAX_OUTPUT_PORTS)
+   {
+      std::cerr << "WARNING! Too many output ports; " << name << " goes to the default port." << std::endl;
+      return 0;
+   }
+
+   if (!registerOutputPortAt(idx, name))
    {
-      if (name == jack_port_short_name(*it))
-         return *it;
+      std::cerr << "WARNING! Cannot register port " << name << "; using the default port." << std::endl;
+      return 0;
    }
 
-   jack_port_t *p = jack_port_register(mClient, name.c_str(), JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
-   mOutputPorts.push_back(p);
-   return p;
+   return idx;
+}
+
+/*****************************************************************************************************/
+/* Register a backend port with the given index and publish it to the process callback. */
+bool JackEngine::registerOutputPortAt(unsigned idx, std::string name)
+{
+   if (!mBackend->registerPort(idx, name))
+      return false;
+
+   mPortBuffers[idx] = NULL;
+   mPortIndex[name] = idx;
+   mOutputPortCount.store(idx + 1, std::memory_order_release);
+   return true;
 }
 
 /*****************************************************************************************************/
 /* Connect to a port. */
-int JackEngine::connectPort(jack_port_t *port, std::string destination)
+int JackEngine::connectPort(unsigned port, std::string destination)
 {
-   return jack_connect(mClient, jack_port_name(port), destination.c_str());
+   return mBackend->connectPort(port, destination);
+}
+
+/*****************************************************************************************************/
+/* Return the storage for the long midi messages. */
+PayloadPool* JackEngine::payloadPool()
+{
+   return mPayloadPool;
 }
 
 /*****************************************************************************************************/
 /* Shutdown the jack interface. */
 void JackEngine::shutdown()
 {
-   jack_port_unregister(mClient, mInputPort);
-   jack_port_unregister(mClient, mDefaultOutputPort);
-   jack_client_close(mClient);
+   mBackend->close();
+}
+
+/*****************************************************************************************************/
+/* The sample rate in frames per second. */
+jack_nframes_t JackEngine::sampleRate()
+{
+   return mSampleRate;
 }
 
 /*****************************************************************************************************/
@@ -218,49 +949,220 @@ jack_nframes_t JackEngine::msToNframes(uint64_t ms)
 }
 
 /*****************************************************************************************************/
-/* Return the current time in nframes. */
-jack_nframes_t JackEngine::currentFrameTime()
+/* Extend a 32-bit jack frame time close to the present to the 64-bit timeline. RT safe.
+   The anchor follows the latest time seen; the process callback moves it every cycle,
+   so the distance to it is always far below the 32-bit wrap. */
+frametime_t JackEngine::extendFrameTime(jack_nframes_t frames)
+{
+   frametime_t anchor = mFrameAnchor.load();
+   frametime_t t;
+
+   do
+      t = anchor + (int32_t)(frames - (jack_nframes_t)anchor);
+   while (t > anchor && !mFrameAnchor.compare_exchange_weak(anchor, t));
+
+   return t;
+}
+
+/*****************************************************************************************************/
+/* Return the current time on the 64-bit frame timeline. */
+frametime_t JackEngine::currentFrameTime()
+{
+   return extendFrameTime(mBackend->frameTime()) - mTimeShift.load();
+}
+
+/*****************************************************************************************************/
+/* The number of xruns since the start. */
+uint64_t JackEngine::xrunCount()
+{
+   return mXrunCount.load();
+}
+
+/*****************************************************************************************************/
+/* Average number of the dispatch thread wakeups per second. */
+double JackEngine::dispatchWakeupRate()
+{
+   double seconds = (mBackend->time() - mStartTime) / 1000000.0;
+   return seconds > 0 ? mDispatchWakeups.load(std::memory_order_relaxed) / seconds : 0;
+}
+
+/*****************************************************************************************************/
+/* Let the given time pass on the backend clock. */
+void JackEngine::idle(unsigned ms)
 {
-   return jack_frame_time(mClient);
+   mBackend->idle(ms);
 }
 
 /*****************************************************************************************************/
 /* Is there are unprocessed midi events. */
 bool JackEngine::hasPendingEvents()
 {
-   return mMidiHeap->count() > 0;
+   return mMidiQueue->count() > 0 || mHeldPending.load(std::memory_order_acquire) > 0
+      || jack_ringbuffer_read_space(mRingbuffer) > 0 || mCarriedPending.load(std::memory_order_acquire) > 0;
 }
 
 /*****************************************************************************************************/
 /* Put a midi message into the heap. */
 void JackEngine::queueMidiEvent(MidiMessage &message)
 {
-   mMidiHeap->insert(message);
+   queueMidiEvents(&message, 1);
 }
 
 /*****************************************************************************************************/
 /* Put a midi message into the midi heap. */
 void JackEngine::queueMidiEvent(MidiMessage message)
 {
-   mMidiHeap->insert(message);
+   queueMidiEvents(&message, 1);
+}
+
+/*****************************************************************************************************/
+/* In the direct dispatch mode, move the queued events up to the given time to the ringbuffer.
+   No event earlier than that time may be queued afterwards, so the ringbuffer stays sorted. */
+void JackEngine::releaseEvents(frametime_t time)
+{
+   if (!mbDirectDispatch)
+      return;
+
+   dispatchEvents(time);
+}
+
+/*****************************************************************************************************/
+/* Put a number of midi messages into the heap at once. */
+void JackEngine::queueMidiEvents(const MidiMessage *messages, size_t n)
+{
+   if (n == 0)
+      return;
+
+   mMidiQueue->push(messages, n);
+
+   if (mbDirectDispatch)
+      return;
+
+   frametime_t first = messages[0].time;
+   for (size_t i = 1; i < n; i ++)
+      if (messages[i].time < first)
+         first = messages[i].time;
+   wakeDispatcher(first);
 }
 
 /*****************************************************************************************************/
 /* Construct and put a midi message into the heap. */
-void JackEngine::queueMidiEvent(unsigned char b0, unsigned char b1, unsigned char b2, jack_nframes_t time, unsigned channel, jack_port_t *port)
+void JackEngine::queueMidiEvent(unsigned char b0, unsigned char b1, unsigned char b2, frametime_t time, unsigned channel, unsigned port)
 {
    MidiMessage msg (b0, b1, b2, time, channel, port);
-   mMidiHeap->insert(msg);
+   queueMidiEvents(&msg, 1);
 }
 
 /*****************************************************************************************************/
-/* Send a control midi message to stop all sounds. */
+/* Send the control midi messages to stop all sounds. The notes off goes too, as some synthesizers
+   do not know the all sound off. */
 void JackEngine::stopSounds()
 {
-   for (std::vector<jack_port_t*>::iterator it = mOutputPorts.begin();
-         it != mOutputPorts.end(); it ++)
+   static const unsigned controllers[] = { MIDI_ALL_SOUND_OFF, MIDI_ALL_NOTES_OFF };
+
+   for (unsigned i = 0; i < mOutputPortCount; i ++)
+   {
+      for (size_t c = 0; c < sizeof(controllers) / sizeof(controllers[0]); c ++)
+      {
+         MidiMessage msg(MIDI_CONTROLLER, controllers[c], 0, currentFrameTime(), 0, i);
+         if (!writeMidiData(msg))
+            countDropped(msg);
+      }
+   }
+}
+
+/*****************************************************************************************************/
+/* Record how far ahead of the playback the sequencer has got with the given time. */
+void JackEngine::noteSequencerLead(frametime_t time)
+{
+   int64_t lead = (int64_t)(time - currentFrameTime());
+
+   if (lead < mSeqLeadMin.load())
+      mSeqLeadMin.store(lead);
+   if (lead > mSeqLeadMax.load())
+      mSeqLeadMax.store(lead);
+   mSeqLead.store(lead);
+}
+
+/*****************************************************************************************************/
+/* Quote a string for JSON. */
+static std::string jsonString(const std::string &s)
+{
+   std::string r = "\"";
+   for (size_t i = 0; i < s.size(); i ++)
    {
-      MidiMessage msg(MIDI_CONTROLLER, MIDI_ALL_SOUND_OFF, 0, currentFrameTime(), 0, (*it));
-      writeMidiData(msg);
+      if (s[i] == '"' || s[i] == '\\')
+         r += '\\';
+      if ((unsigned char)s[i] >= 0x20)
+         r += s[i];
    }
+   return r + "\"";
+}
+
+/*****************************************************************************************************/
+/* Write the runtime statistics as a JSON object. Not RT safe; call from one thread only. */
+void JackEngine::writeStats(std::ostream &out)
+{
+   jack_time_t now = mBackend->time();
+   uint64_t sent = mEventsSent.load(std::memory_order_relaxed);
+   double seconds = (now - mStartTime) / 1000000.0;
+   double interval = (now - mStatsLastTime) / 1000000.0;
+   unsigned ports = outputPortCount();
+   int64_t leadMin = mSeqLeadMin.load(), leadMax = mSeqLeadMax.load();
+   if (leadMin > leadMax)
+      leadMin = leadMax = 0;
+
+   out << "{" << std::endl
+      << "  \"uptime_s\": " << seconds << "," << std::endl
+      << "  \"sample_rate\": " << mSampleRate << "," << std::endl
+      << "  \"events_sent\": " << sent << "," << std::endl
+      << "  \"events_per_second\": " << (seconds > 0 ? sent / seconds : 0) << "," << std::endl
+      << "  \"events_per_second_recent\": " << (interval > 0 ? (sent - mStatsLastEvents) / interval : 0) << "," << std::endl
+      << "  \"queue\": {\"count\": " << mMidiQueue->count() << ", \"high_water\": " << mMidiQueue->highWater()
+      << ", \"capacity\": " << mMidiQueue->capacity() << "}," << std::endl
+      << "  \"ringbuffer\": {\"size\": " << mRingbufferSize << ", \"high_water\": "
+      << mRingHighWater.load(std::memory_order_relaxed) << "}," << std::endl
+      << "  \"dispatch_wakeups_per_second\": " << dispatchWakeupRate() << "," << std::endl
+      << "  \"dispatch_lookahead_frames\": " << mLookahead.load() << ", \"buffer_size\": " << mBufferSize.load()
+      << "," << std::endl
+      << "  \"dispatch_jitter_frames\": {\"mean\": " << mJitterMean.load() << ", \"deviation\": "
+      << mJitterDev.load() << "}," << std::endl
+      << "  \"sequencer_lead_frames\": {\"last\": " << mSeqLead.load() << ", \"min\": " << leadMin
+      << ", \"max\": " << leadMax << "}," << std::endl
+      << "  \"deferred_by_class\": {\"control\": " << classDeferredCount(MIDI_CLASS_CONTROL)
+      << ", \"other\": " << classDeferredCount(MIDI_CLASS_OTHER)
+      << ", \"note\": " << classDeferredCount(MIDI_CLASS_NOTE)
+      << ", \"essential\": " << classDeferredCount(MIDI_CLASS_ESSENTIAL) << "}," << std::endl
+      << "  \"coalesced\": " << coalescedCount() << "," << std::endl;
+
+   uint64_t xruns = xrunCount();
+   out << "  \"xruns\": {\"count\": " << xruns << ", \"dropped\": " << mXrunDropped.load()
+      << ", \"timeline_shift_frames\": " << mTimeShift.load() << ", \"recent\": [";
+   for (uint64_t i = xruns > XRUN_LOG_SIZE ? xruns - XRUN_LOG_SIZE : 0; i < xruns; i ++)
+      out << "{\"frame\": " << mXrunFrames[i % XRUN_LOG_SIZE].load()
+         << ", \"delay_us\": " << mXrunDelays[i % XRUN_LOG_SIZE].load() << "}"
+         << (i + 1 < xruns ? ", " : "");
+   out << "]}," << std::endl;
+
+   out << "  \"lateness_buckets_frames\": [0";
+   for (unsigned j = 1; j < STATS_LATENESS_BUCKETS; j ++)
+      out << ", " << (1ull << (j - 1));
+   out << "]," << std::endl;
+
+   out << "  \"ports\": [";
+   for (unsigned i = 0; i < ports; i ++)
+   {
+      out << (i ? "," : "") << std::endl
+         << "    {\"name\": " << jsonString(outputPortName(i))
+         << ", \"deferred\": " << deferredCount(i)
+         << ", \"dropped\": " << droppedCount(i)
+         << ", \"lateness\": [";
+      for (unsigned j = 0; j < STATS_LATENESS_BUCKETS; j ++)
+         out << (j ? ", " : "") << mLateness[i][j].load(std::memory_order_relaxed);
+      out << "]}";
+   }
+   out << std::endl << "  ]" << std::endl << "}" << std::endl;
+
+   mStatsLastEvents = sent;
+   mStatsLastTime = now;
 }
@@ -1,42 +1,199 @@
 #ifndef JACKENGINE_H
 #define JACKENGINE_H
 
+#include <atomic>
 #include <iostream>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <pthread.h>
+#include <sched.h>
 
 #include <jack/jack.h>
 #include <jack/midiport.h>
 #include <jack/ringbuffer.h>
 
+#include "midibackend.h"
 #include "midimessage.h"
-#include "midiheap.h"
+#include "midiqueue.h"
+#include "payloadpool.h"
 
-#define MIDI_HEAP_SIZE                 1024
-#define RINGBUFFER_SIZE                1024
+#define MIDI_HEAP_SIZE                 1024     // Default number of preallocated queue entries.
+#define DISPATCH_BATCH_SIZE            64
+#define DISPATCH_MIN_LOOKAHEAD         32       // Frames; the least of how early the events go to the ringbuffer.
+#define DISPATCH_JITTER_WEIGHT         0.05     // The weight of a new sample in the dispatch jitter average.
+#define DISPATCH_JITTER_MARGIN         4        // The adaptive lookahead covers this many mean deviations.
+#define DISPATCH_IDLE_MS               100      // The longest dispatcher sleep when nothing is queued.
+#define RINGBUFFER_SIZE                1024     // Default ringbuffer capacity in messages.
+#define MAX_OUTPUT_PORTS               1024
+#define CYCLE_MAX_EVENTS               1024     // Events handled in one process cycle, the carried ones included.
+#define STATS_LATENESS_BUCKETS         16       // Bucket i > 0 counts the events late by [2^(i-1), 2^i) frames.
+
+#define XRUN_LOG_SIZE                  16       // The number of the recent xruns remembered.
 
 typedef jack_default_audio_sample_t sample_t;
 
+/* What to do with the events that got late because of an xrun. */
+enum XrunPolicy
+{
+   XRUN_CLAMP,                // Play them all at the start of the next cycle.
+   XRUN_DROP,                 // Drop the ones late by more than a given age; the note offs stay.
+   XRUN_SHIFT,                // Shift the timeline forward by the lost time.
+   XRUN_SPREAD                // Spread the late ones evenly across the next cycle.
+};
+
 /*******************************************************************************************/
 /* Manage Jack connection and hide specific objects. Singleton. */
 class JackEngine
 {
    private:
-      MidiHeap          *mMidiHeap;        // A sorted queue of midi events.
-      jack_client_t     *mClient;          // The client representation.
+      MidiQueue         *mMidiQueue;       // A sorted queue of midi events.
+      PayloadPool       *mPayloadPool;     // The data of the long midi messages.
+      MidiBackend       *mBackend;         // The clock and the output ports; Jack by default.
       jack_ringbuffer_t *mRingbuffer;
-      jack_nframes_t     mBufferSize;
+      size_t             mRingbufferSize;  // The ringbuffer capacity in messages.
+      std::atomic<jack_nframes_t>
+                         mBufferSize;
       jack_nframes_t     mSampleRate;
-      jack_port_t       *mDefaultOutputPort;
-      jack_port_t       *mInputPort;      // Isn't used yet.
+      SchedulerType      mSchedulerType;
+      bool               mbDirectDispatch; // The sequencer thread feeds the ringbuffer itself.
+      bool               mbAdaptiveLookahead;  // Size the lookahead from the measured dispatch jitter.
+      size_t             mQueueSize;       // Number of preallocated queue entries.
+      bool               mbLockMemory;     // Lock and prefault the memory the realtime threads use.
+      bool               mbDispatchRealtime;
+      int                mDispatchPriority;  // Relative to the jack priority.
+      bool               mbDispatchAffinity;
+      cpu_set_t          mDispatchCpus;
 
       pthread_t          mMidiWriteThread;
+      pthread_mutex_t    mDispatchMutex;   // Guards mbDispatchWake.
+      pthread_cond_t     mDispatchCond;    // Wakes the dispatch thread up before its deadline.
+      bool               mbDispatchWake;
+      std::atomic<frametime_t>
+                         mDispatchDeadline;  // The frame the dispatch thread sleeps until.
+      std::atomic<jack_nframes_t>
+                         mLookahead;       // Frames; how early the events go to the ringbuffer.
+      std::atomic<double>
+                         mJitterMean;      // Average lateness of the dispatch thread wakeups, in frames.
+      std::atomic<double>
+                         mJitterDev;       // Its average deviation.
+      std::atomic<frametime_t>
+                         mFrameAnchor;     // The latest known point of the 64-bit timeline.
+      std::atomic<uint64_t>
+                         mDispatchWakeups;
+      jack_time_t        mStartTime;
+
+      void              *mPortBuffers[MAX_OUTPUT_PORTS];     // The port buffers of the current cycle.
+      std::atomic<unsigned>
+                         mOutputPortCount;
+      std::unordered_map<std::string, unsigned>
+                         mPortIndex;       // Port name to port number.
+
+      std::atomic<uint64_t>
+                         mDeferred[MAX_OUTPUT_PORTS];        // Messages held back while the ringbuffer was full.
+      std::atomic<uint64_t>
+                         mDropped[MAX_OUTPUT_PORTS];         // Messages lost on the way to the port buffer.
+
+      MidiMessage        mHeld[DISPATCH_BATCH_SIZE];         // Popped events waiting for the ringbuffer space.
+      size_t             mHeldPos;         // The first held event not written yet.
+      size_t             mHeldCount;
+      size_t             mHeldCounted;     // The held events up to here are already counted as deferred.
+      std::atomic<size_t>
+                         mHeldPending;     // The number of held events, for the other threads.
+
+      MidiMessage        mCycle[CYCLE_MAX_EVENTS];           // The events of the current process cycle.
+      jack_nframes_t     mCycleOffset[CYCLE_MAX_EVENTS];     // Their offsets within the jack buffer.
+      unsigned char      mCycleState[CYCLE_MAX_EVENTS];
+      size_t             mCycleCount;      // Between the cycles, the number of the carried over events.
+      std::atomic<size_t>
+                         mCarriedPending;  // The same, for the other threads.
+      bool               mPortFull[MAX_OUTPUT_PORTS];        // The port buffer ran out of space this cycle.
+      unsigned           mFullPorts[MAX_OUTPUT_PORTS];
+      size_t             mPortEvents[CYCLE_MAX_EVENTS];      // The events of the port being refilled, in time order.
+      bool               mHeldKeys[MIDI_NOTE_KEYS];          // The notes of that port with an event held back.
+      bool               mSeenControls[MIDI_CONTROL_KEYS];   // Its controllers with a later value this cycle.
+      std::atomic<uint64_t>
+                         mClassDeferred[MIDI_CLASS_COUNT];   // Messages carried to the next cycle, by class.
+      std::atomic<uint64_t>
+                         mCoalesced;       // Controller values skipped in favour of a later one.
+
+      std::atomic<uint64_t>
+                         mLateness[MAX_OUTPUT_PORTS][STATS_LATENESS_BUCKETS];
+      std::atomic<uint64_t>
+                         mEventsSent;
+      std::atomic<size_t>
+                         mRingHighWater;   // The maximal ringbuffer occupancy in messages.
+      std::atomic<int64_t>
+                         mSeqLead;         // How far the sequencer is ahead of the playback, in frames.
+      std::atomic<int64_t>
+                         mSeqLeadMin;
+      std::atomic<int64_t>
+                         mSeqLeadMax;
+      XrunPolicy         mXrunPolicy;
+      jack_nframes_t     mXrunDropAge;     // Frames; the drop policy keeps the events less late.
+      std::atomic<uint64_t>
+                         mXrunCount;
+      std::atomic<frametime_t>
+                         mXrunFrames[XRUN_LOG_SIZE];         // Where the recent xruns happened.
+      std::atomic<float> mXrunDelays[XRUN_LOG_SIZE];         // How long they were, in microseconds.
+      std::atomic<frametime_t>
+                         mXrunDelayFrames; // The length of the latest xrun.
+      std::atomic<bool>  mbXrunPending;    // An xrun happened since the last process cycle.
+      std::atomic<uint64_t>
+                         mXrunDropped;
+      bool               mbRecovering;     // The late events after an xrun are being handled.
+      frametime_t        mPrevCycleEnd;    // Where the current cycle should start if nothing was lost.
+      std::atomic<frametime_t>
+                         mTimeShift;       // Frames the timeline lags behind jack time after xruns.
+
+      uint64_t           mStatsLastEvents; // The state at the previous writeStats() call.
+      jack_time_t        mStatsLastTime;
+
+      /* Write the midi message into the ringbuffer which is processed by jack callback in its turn.
+         Returns false if there is no space for it. */
+      bool writeMidiData(const MidiMessage &theMessage);
+
+      /* Move the events up to the given time to the ringbuffer as long as there is space for them.
+         The rest is held back and goes first on the next call. */
+      void dispatchEvents(frametime_t time);
+
+      /* Apply the xrun recovery policy to the late events of the cycle. RT safe. */
+      void recoverLateEvents(size_t n, jack_nframes_t nframes, frametime_t lastFrameTime);
 
-      std::vector<jack_port_t*> mOutputPorts;
+      /* Count a sent message in the lateness histogram of its port. RT safe. */
+      void countLateness(const MidiMessage &msg, int64_t offset);
 
-      /* Write the midi message into the ringbuffer which is processed by jack callback in its turn. */
-      void writeMidiData(MidiMessage theMessage);
+      /* Count a message that could not be delivered. RT safe. */
+      void countDropped(const MidiMessage &msg);
+
+      /* Reserve the space for the given event of the cycle in the port buffer and copy it there. RT safe. */
+      bool writeCycleEvent(void *portbuffer, size_t i);
+
+      /* Rewrite the buffer of the given port with the pending events of the given class and above,
+         and with the `extra` earliest events of the class below. RT safe. */
+      bool fillPort(unsigned port, size_t m, int level, size_t extra);
+
+      /* Refill the full buffer of the given port by priority; what does not fit is carried over. RT safe. */
+      void resolveFullPort(unsigned port, size_t n);
+
+      /* Register a backend port with the given index and publish it to the process callback. */
+      bool registerOutputPortAt(unsigned idx, std::string name);
+
+      /* Convert a frame time to the absolute CLOCK_MONOTONIC time. */
+      struct timespec frameToTimespec(frametime_t frame);
+
+      /* Put the dispatch thread to sleep until the next event is due or an earlier event is queued. */
+      void waitForDeadline();
+
+      /* Wake the dispatch thread up if the given event time is before its deadline. */
+      void wakeDispatcher(frametime_t time);
+
+      /* Account a dispatch thread wakeup that came the given number of frames after its deadline. */
+      void noteDispatchJitter(double late);
+
+      /* Recompute the lookahead from the buffer size and, in the adaptive mode, the dispatch jitter. */
+      void updateLookahead();
 
       /* Hide the constructor, as it is a singleton. */
       JackEngine();
@@ -46,23 +203,106 @@ class JackEngine
 
       ~JackEngine();
 
+      /* Choose the event scheduler implementation. Must be called before init(). */
+      void setSchedulerType(SchedulerType type);
+
+      /* Use the given output instead of Jack; the engine owns it. Must be called before init(). */
+      void setBackend(MidiBackend *backend);
+
+      /* Feed the ringbuffer from the sequencer thread instead of the dispatch thread.
+         Must be called before init(). */
+      void setDirectDispatch(bool direct);
+
+      /* Size the dispatch lookahead from the measured wakeup jitter instead of the buffer size.
+         Must be called before init(). */
+      void setAdaptiveLookahead(bool adaptive);
+
+      /* Choose how to recover the timing after an xrun. The drop policy drops the events late by
+         more than the given number of frames. Must be called before init(). */
+      void setXrunPolicy(XrunPolicy policy, jack_nframes_t dropAge = 0);
+
+      /* Lock the process memory and prefault the buffers and the dispatch thread stack.
+         Must be called before init(). */
+      void setLockMemory(bool lock);
+
+      /* Run the dispatch thread under SCHED_FIFO with the priority relative to the jack one.
+         Must be called before init(). */
+      void setDispatchPriority(int offset);
+
+      /* Pin the dispatch thread to the given CPUs. Must be called before init(). */
+      void setDispatchAffinity(const cpu_set_t &cpus);
+
+      /* The SCHED_FIFO priority relative to the jack realtime priority. */
+      int realtimePriority(int offset);
+
+      /* Set the number of preallocated queue entries. Must be called before init(). */
+      void setQueueSize(size_t size);
+
+      /* Set the ringbuffer capacity in messages. Must be called before init(). */
+      void setRingbufferSize(size_t size);
+
+      /* The maximal number of events that were waiting in the queue. */
+      size_t queueHighWater();
+
+      /* The number of the registered output ports. */
+      unsigned outputPortCount();
+
+      /* The name of the output port with the given index. */
+      std::string outputPortName(unsigned port);
+
+      /* The number of messages for the given port that had to wait for the ringbuffer space. */
+      uint64_t deferredCount(unsigned port);
+
+      /* The number of messages for the given port that were lost. */
+      uint64_t droppedCount(unsigned port);
+
+      /* The number of times a message of the given class was carried over to the next process cycle. */
+      uint64_t classDeferredCount(MidiClass cls);
+
+      /* The number of controller values left out because a later value was due in the same cycle. */
+      uint64_t coalescedCount();
+
+      /* Record how far ahead of the playback the sequencer has got with the given time. */
+      void noteSequencerLead(frametime_t time);
+
+      /* Write the runtime statistics as a JSON object. Not RT safe; call from one thread only. */
+      void writeStats(std::ostream &out);
+
       /* Initialization and activation of jack interface. */
       void init();
 
-      /* Register an output port. */
-      jack_port_t* registerOutputPort(std::string name);
+      /* Register an output port. Returns the index of the port; the default port has index 0. */
+      unsigned registerOutputPort(std::string name);
 
       /* Connect to a port. */
-      int connectPort(jack_port_t *port, std::string destination);
+      int connectPort(unsigned port, std::string destination);
+
+      /* Return the storage for the long midi messages. */
+      PayloadPool* payloadPool();
 
       /* Shutdown the jack interface. */
       void shutdown();
 
+      /* The sample rate in frames per second. */
+      jack_nframes_t sampleRate();
+
       /* Convert microsecond time to jack nframes. */
       jack_nframes_t msToNframes(uint64_t ms);
 
-      /* Return the current time in nframes. */
-      jack_nframes_t currentFrameTime();
+      /* Extend a 32-bit jack frame time close to the present to the 64-bit timeline. RT safe. */
+      frametime_t extendFrameTime(jack_nframes_t frames);
+
+      /* Return the current time on the 64-bit frame timeline. */
+      frametime_t currentFrameTime();
+
+      /* The number of xruns since the start. */
+      uint64_t xrunCount();
+
+      /* Average number of the dispatch thread wakeups per second. */
+      double dispatchWakeupRate();
+
+      /* Let the given time pass on the backend clock. */
+      void idle(unsigned ms);
 
       /* Is there are unprocessed midi events. */
       bool hasPendingEvents();
@@ -72,9 +312,16 @@ class JackEngine
       
       void queueMidiEvent(MidiMessage message);
 
+      /* In the direct dispatch mode, move the queued events up to the given time to the ringbuffer.
+         No event earlier than that time may be queued afterwards. Does nothing otherwise. */
+      void releaseEvents(frametime_t time);
+
+      /* Put a number of midi messages into the heap at once. */
+      void queueMidiEvents(const MidiMessage *messages, size_t n);
+
       /* Put a midi message into the heap. */
-      void queueMidiEvent(unsigned char b0, unsigned char b1, unsigned char b2, jack_nframes_t time,
-            unsigned channel = 0, jack_port_t *port = NULL);
+      void queueMidiEvent(unsigned char b0, unsigned char b1, unsigned char b2, frametime_t time,
+            unsigned channel = 0, unsigned port = 0);
 
       /* Send a control midi message to stop all sounds. */
       void stopSounds();
@@ -82,9 +329,16 @@ class JackEngine
       /* Jack callbacks. */
       friend int jack_process_cb(jack_nframes_t nframes, void *arg);
       friend int jack_buffsize_cb(jack_nframes_t nframes, void *arg);
+      friend int jack_xrun_cb(void *arg);
       friend void jack_shutdown_cb(void *arg);
       friend void stop_all_sound();
       friend void* bufferProcessingThread(void *arg);
 };
 
+/* Jack callbacks; the backends call them with the engine as the argument. */
+int jack_process_cb(jack_nframes_t nframes, void *arg);
+int jack_buffsize_cb(jack_nframes_t nframes, void *arg);
+int jack_xrun_cb(void *arg);
+void jack_shutdown_cb(void *arg);
+
 #endif
@@ -0,0 +1,348 @@
+#include "lexer.h"
+
+#include <climits>
+#include <limits>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#define LEXER_MAX_NUMBER               64       // The longest floating point number read.
+
+/*****************************************************************************************************/
+/* The white space of the C locale. */
+static inline bool isSpace(char c)
+{
+   return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+/*****************************************************************************************************/
+/* The position of the first character from the set, or npos. */
+size_t TextSpan::findFirstOf(const char *set) const
+{
+   for (size_t i = 0; i < len; i ++)
+      if (strchr(set, ptr[i]) != NULL && ptr[i] != '\0')
+         return i;
+   return npos;
+}
+
+/*****************************************************************************************************/
+/* A part of the text. */
+TextSpan TextSpan::sub(size_t pos, size_t n) const
+{
+   if (pos > len)
+      pos = len;
+   if (n > len - pos)
+      n = len - pos;
+   return TextSpan(ptr + pos, n);
+}
+
+/*****************************************************************************************************/
+/* Constructor. */
+Lexer::Lexer(const char *buf, size_t len)
+{
+   mBuf = buf;
+   mLen = len;
+   mPos = 0;
+   mState = 0;
+}
+
+/*****************************************************************************************************/
+/* Constructor. */
+Lexer::Lexer(const TextSpan &text)
+{
+   mBuf = text.ptr;
+   mLen = text.len;
+   mPos = 0;
+   mState = 0;
+}
+
+/*****************************************************************************************************/
+/* Skip the white space before a formatted read. Returns false if the read should fail. */
+bool Lexer::sentry()
+{
+   if (mState != 0)
+   {
+      mState |= STATE_FAIL;
+      return false;
+   }
+
+   while (mPos < mLen && isSpace(mBuf[mPos]))
+      mPos ++;
+
+   if (mPos == mLen)
+   {
+      mState |= STATE_EOF | STATE_FAIL;
+      return false;
+   }
+   return true;
+}
+
+/*****************************************************************************************************/
+/* Move to the given position; does nothing after a failure. */
+void Lexer::seek(size_t pos)
+{
+   mState &= ~STATE_EOF;
+   if (mState & STATE_FAIL)
+      return;
+   mPos = pos < mLen ? pos : mLen;
+}
+
+/*****************************************************************************************************/
+/* The current position, or -1 after a failure. */
+long Lexer::tell() const
+{
+   return (mState & STATE_FAIL) ? -1 : (long)mPos;
+}
+
+/*****************************************************************************************************/
+/* Read the next character; EOF at the end. */
+int Lexer::get()
+{
+   if (mState != 0)
+   {
+      mState |= STATE_FAIL;
+      return EOF;
+   }
+   if (mPos == mLen)
+   {
+      mState |= STATE_EOF | STATE_FAIL;
+      return EOF;
+   }
+   return (unsigned char)mBuf[mPos ++];
+}
+
+/*****************************************************************************************************/
+/* Look at the next character; EOF at the end. */
+int Lexer::peek()
+{
+   if (mState != 0)
+   {
+      mState |= STATE_FAIL;
+      return EOF;
+   }
+   if (mPos == mLen)
+   {
+      mState |= STATE_EOF;
+      return EOF;
+   }
+   return (unsigned char)mBuf[mPos];
+}
+
+/*****************************************************************************************************/
+/* Read the next word. The token is unchanged on failure. */
+bool Lexer::next(TextSpan &token)
+{
+   if (!sentry())
+      return false;
+
+   size_t start = mPos;
+   while (mPos < mLen && !isSpace(mBuf[mPos]))
+      mPos ++;
+   if (mPos == mLen)
+      mState |= STATE_EOF;
+
+   token = TextSpan(mBuf + start, mPos - start);
+   return true;
+}
+
+/*****************************************************************************************************/
+/* Read the next non blank character. */
+bool Lexer::next(char &c)
+{
+   if (!sentry())
+      return false;
+
+   c = mBuf[mPos ++];
+   return true;
+}
+
+/*****************************************************************************************************/
+/* Read an optional sign and the decimal digits. Returns false if there are no digits. */
+bool Lexer::readDigits(bool &negative, uint64_t &magnitude, bool &overflow)
+{
+   bool digits = false;
+
+   negative = false;
+   magnitude = 0;
+   overflow = false;
+
+   if (mPos < mLen && (mBuf[mPos] == '+' || mBuf[mPos] == '-'))
+      negative = mBuf[mPos ++] == '-';
+
+   while (mPos < mLen && isdigit((unsigned char)mBuf[mPos]))
+   {
+      unsigned d = mBuf[mPos ++] - '0';
+      if (magnitude > (UINT64_MAX - d) / 10)
+         overflow = true;
+      else
+         magnitude = magnitude * 10 + d;
+      digits = true;
+   }
+
+   if (mPos == mLen)
+      mState |= STATE_EOF;
+   return digits;
+}
+
+/*****************************************************************************************************/
+/* Read an unsigned number of the given maximal value. A negative one wraps around like with strtoul. */
+bool Lexer::readUnsigned(uint64_t &v, uint64_t max)
+{
+   bool negative, overflow;
+   uint64_t m;
+
+   if (!readDigits(negative, m, overflow))
+   {
+      v = 0;
+      mState |= STATE_FAIL;
+      return false;
+   }
+
+   if (overflow || m > max)
+   {
+      v = max;
+      mState |= STATE_FAIL;
+      return false;
+   }
+
+   v = negative ? (max - m + 1) & max : m;
+   return true;
+}
+
+/*****************************************************************************************************/
+/* Read a number. */
+bool Lexer::next(unsigned &v)
+{
+   if (!sentry())
+      return false;
+
+   uint64_t r;
+   bool ok = readUnsigned(r, UINT_MAX);
+   v = r;
+   return ok;
+}
+
+bool Lexer::next(unsigned long &v)
+{
+   if (!sentry())
+      return false;
+
+   uint64_t r;
+   bool ok = readUnsigned(r, ULONG_MAX);
+   v = r;
+   return ok;
+}
+
+bool Lexer::next(unsigned long long &v)
+{
+   if (!sentry())
+      return false;
+
+   uint64_t r;
+   bool ok = readUnsigned(r, ULLONG_MAX);
+   v = r;
+   return ok;
+}
+
+bool Lexer::next(int &v)
+{
+   if (!sentry())
+      return false;
+
+   bool negative, overflow;
+   uint64_t m;
+
+   if (!readDigits(negative, m, overflow))
+   {
+      v = 0;
+      mState |= STATE_FAIL;
+      return false;
+   }
+
+   if (overflow || m > (negative ? (uint64_t)INT_MAX + 1 : (uint64_t)INT_MAX))
+   {
+      v = negative ? INT_MIN : INT_MAX;
+      mState |= STATE_FAIL;
+      return false;
+   }
+
+   v = negative ? (int)(0 - m) : (int)m;
+   return true;
+}
+
+/*****************************************************************************************************/
+/* Read a floating point number: a sign, digits with a point and an exponent, as the stream does. */
+bool Lexer::next(double &v)
+{
+   if (!sentry())
+      return false;
+
+   char buf[LEXER_MAX_NUMBER + 1];
+   size_t n = 0;
+   bool mantissa = false, point = false, exponent = false;
+
+   if (mPos < mLen && (mBuf[mPos] == '+' || mBuf[mPos] == '-'))
+      buf[n ++] = mBuf[mPos ++];
+
+   while (mPos < mLen)
+   {
+      char c = mBuf[mPos];
+
+      if (isdigit((unsigned char)c))
+         mantissa = true;
+      else if (c == '.' && !point && !exponent)
+         point = true;
+      else if ((c == 'e' || c == 'E') && mantissa && !exponent)
+      {
+         exponent = true;
+         if (n < LEXER_MAX_NUMBER)
+            buf[n ++] = c;
+         mPos ++;
+
+         // The exponent may have its own sign.
+         if (mPos < mLen && (mBuf[mPos] == '+' || mBuf[mPos] == '-'))
+            c = mBuf[mPos];
+         else
+            continue;
+      }
+      else
+         break;
+
+      if (n < LEXER_MAX_NUMBER)
+         buf[n ++] = c;
+      mPos ++;
+   }
+   buf[n] = '\0';
+
+   if (mPos == mLen)
+      mState |= STATE_EOF;
+
+   // The whole text read must make a number.
+   char *end;
+   errno = 0;
+   double r = strtod(buf, &end);
+   if (n == 0 || *end != '\0')
+   {
+      v = 0;
+      mState |= STATE_FAIL;
+      return false;
+   }
+
+   if (errno == ERANGE && (r > 1 || r < -1))
+   {
+      v = r > 0 ? std::numeric_limits<double>::max() : -std::numeric_limits<double>::max();
+      mState |= STATE_FAIL;
+      return false;
+   }
+
+   v = r;
+   return true;
+}
+
+/*****************************************************************************************************/
+/* The text after the current position. */
+TextSpan Lexer::rest() const
+{
+   return TextSpan(mBuf + mPos, mLen - mPos);
+}
@@ -0,0 +1,108 @@
+#ifndef LEXER_H
+#define LEXER_H
+
+#include <string>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*******************************************************************************************/
+/* A piece of text. Does not own the characters. */
+struct TextSpan
+{
+   static const size_t npos = (size_t)-1;
+
+   const char *ptr;
+   size_t      len;
+
+   TextSpan() : ptr(""), len(0) {}
+   TextSpan(const char *p, size_t n) : ptr(p), len(n) {}
+
+   bool empty() const { return len == 0; }
+
+   /* The first and the last characters; '\0' if empty. */
+   char front() const { return len > 0 ? ptr[0] : '\0'; }
+   char back() const { return len > 0 ? ptr[len - 1] : '\0'; }
+
+   /* Compare with a word; the length goes first. */
+   template <size_t N>
+   bool is(const char (&word)[N]) const { return len == N - 1 && memcmp(ptr, word, N - 1) == 0; }
+
+   /* Does the text start with the word. */
+   template <size_t N>
+   bool startsWith(const char (&word)[N]) const { return len >= N - 1 && memcmp(ptr, word, N - 1) == 0; }
+
+   /* The position of the first character from the set, or npos. */
+   size_t findFirstOf(const char *set) const;
+
+   /* A part of the text. */
+   TextSpan sub(size_t pos, size_t n = npos) const;
+
+   /* A copy of the text. */
+   std::string str() const { return std::string(ptr, len); }
+};
+
+/*******************************************************************************************/
+/* Read words and numbers from a text without copying it. The reads work exactly like the
+   std::istream extractions in the C locale, failure states included, so the parsers keep
+   their behavior: a failed read sets the fail state and the following reads fail until clear(). */
+class Lexer
+{
+   private:
+      enum { STATE_EOF = 1, STATE_FAIL = 2 };
+
+      const char        *mBuf;
+      size_t             mLen;
+      size_t             mPos;
+      unsigned           mState;
+
+      /* Skip the white space before a formatted read. Returns false if the read should fail. */
+      bool sentry();
+
+      /* Read an optional sign and the decimal digits. Returns false if there are no digits. */
+      bool readDigits(bool &negative, uint64_t &magnitude, bool &overflow);
+
+      /* Read an unsigned number of the given maximal value. */
+      bool readUnsigned(uint64_t &v, uint64_t max);
+
+   public:
+      /* Constructors. */
+      Lexer(const char *buf, size_t len);
+      Lexer(const TextSpan &text);
+
+      /* No read has failed. */
+      operator bool() const { return (mState & STATE_FAIL) == 0; }
+
+      /* Reset the failure state. */
+      void clear() { mState = 0; }
+
+      /* Move to the given position; does nothing after a failure. */
+      void seek(size_t pos);
+
+      /* The current position, or -1 after a failure. */
+      long tell() const;
+
+      /* Read or look at the next character; EOF at the end. */
+      int get();
+      int peek();
+
+      /* Read the next word. The token is unchanged on failure. */
+      bool next(TextSpan &token);
+
+      /* Read the next non blank character. */
+      bool next(char &c);
+
+      /* Read a number. */
+      bool next(unsigned &v);
+      bool next(unsigned long &v);
+      bool next(unsigned long long &v);
+      bool next(int &v);
+      bool next(double &v);
+
+      /* The text after the current position. */
+      TextSpan rest() const;
+};
+
+#endif
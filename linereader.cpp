@@ -0,0 +1,264 @@
+#include "linereader.h"
+
+#include <fstream>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*****************************************************************************************************/
+/* Open a file. Pipes and other non-regular files are read as a stream. */
+LineReader* LineReader::open(const char *path)
+{
+   int fd = ::open(path, O_RDONLY);
+   if (fd < 0)
+      throw "cannot open the pattern file";
+
+   struct stat st;
+   if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+   {
+      try
+      {
+         LineReader *r = new MappedLineReader(fd);
+         close(fd);
+         return r;
+      }
+      catch (const char *s)
+      {
+         // Fall back to the stream.
+      }
+   }
+   close(fd);
+
+   std::ifstream *f = new std::ifstream(path);
+   if (!f->is_open())
+   {
+      delete f;
+      throw "cannot open the pattern file";
+   }
+   return new StreamLineReader(*f, true);
+}
+
+/*****************************************************************************************************/
+/* Constructor. */
+StreamLineReader::StreamLineReader(std::istream &ss, bool own)
+   : mStream(ss)
+{
+   mOwned = own ? &ss : NULL;
+}
+
+/*****************************************************************************************************/
+/* Destructor. */
+StreamLineReader::~StreamLineReader()
+{
+   delete mOwned;
+}
+
+/*****************************************************************************************************/
+/* Get the next line. */
+bool StreamLineReader::next(const char *&line, size_t &length)
+{
+   if (!std::getline(mStream, mLine))
+      return false;
+
+   line = mLine.data();
+   length = mLine.size();
+   return true;
+}
+
+/*****************************************************************************************************/
+/* Constructor. */
+MappedLineReader::MappedLineReader(int fd)
+{
+   struct stat st;
+   if (fstat(fd, &st) != 0)
+      throw "cannot read the pattern file";
+
+   mSize = st.st_size;
+   mPos = 0;
+   mData = "";
+
+   // An empty file cannot be mapped, but there is nothing to read either.
+   if (mSize == 0)
+      return;
+
+   void *p = mmap(NULL, mSize, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (p == MAP_FAILED)
+      throw "cannot map the pattern file";
+
+   madvise(p, mSize, MADV_SEQUENTIAL);
+   mData = (const char*)p;
+}
+
+/*****************************************************************************************************/
+/* Destructor. */
+MappedLineReader::~MappedLineReader()
+{
+   if (mSize > 0)
+      munmap((void*)mData, mSize);
+}
+
+/*****************************************************************************************************/
+/* The mapped text. */
+bool MappedLineReader::text(const char *&data, size_t &size)
+{
+   data = mData;
+   size = mSize;
+   return true;
+}
+
+/*****************************************************************************************************/
+/* Get the next line. Same as getline: the last line may lack the end of line character. */
+bool MappedLineReader::next(const char *&line, size_t &length)
+{
+   if (mPos >= mSize)
+      return false;
+
+   const char *begin = mData + mPos;
+   const char *end = (const char*)memchr(begin, '\n', mSize - mPos);
+
+   line = begin;
+   if (end == NULL)
+   {
+      length = mSize - mPos;
+      mPos = mSize;
+   }
+   else
+   {
+      length = end - begin;
+      mPos += length + 1;
+   }
+   return true;
+}
+
+/*****************************************************************************************************/
+/* Split a chunk into lines and lex them. The lines end like with the MappedLineReader. */
+static void* lexChunk(void *arg)
+{
+   ParallelLineReader::Chunk *chunk = (ParallelLineReader::Chunk*)arg;
+   const char *p = chunk->begin;
+
+   while (p < chunk->end)
+   {
+      const char *end = (const char*)memchr(p, '\n', chunk->end - p);
+      if (end == NULL)
+         end = chunk->end;
+
+      chunk->lines.resize(chunk->lines.size() + 1);
+      Parser::lexLine(p, end - p, chunk->lines.back());
+      p = end + 1;
+   }
+
+   return NULL;
+}
+
+/*****************************************************************************************************/
+/* Constructor. */
+ParallelLineReader::ParallelLineReader(LineReader *source, unsigned threads)
+{
+   mSource = source;
+   mChunk = 0;
+   mLine = 0;
+   mCurrent = NULL;
+
+   // Collect the lines if the source does not keep the text.
+   const char *data;
+   size_t size;
+   if (!mSource->text(data, size))
+   {
+      const char *line;
+      size_t length;
+      while (mSource->next(line, length))
+      {
+         mBuffer.append(line, length);
+         mBuffer.push_back('\n');
+      }
+      data = mBuffer.data();
+      size = mBuffer.size();
+   }
+
+   size_t count = size / LINEREADER_CHUNK_MIN;
+   if (count > threads)
+      count = threads;
+   if (count < 1)
+      count = 1;
+
+   // Split at the line boundaries; a chunk may stay empty if a line is very long.
+   mChunks.resize(count);
+   size_t pos = 0;
+   for (size_t i = 0; i < count; i ++)
+   {
+      mChunks[i].begin = data + pos;
+
+      size_t split = size * (i + 1) / count;
+      if (i + 1 == count)
+         pos = size;
+      else if (split > pos)
+      {
+         const char *nl = (const char*)memchr(data + split, '\n', size - split);
+         pos = nl != NULL ? nl - data + 1 : size;
+      }
+
+      mChunks[i].end = data + pos;
+   }
+
+   // The first chunk is lexed in this thread; so are the others if no thread starts.
+   std::vector<pthread_t> tids (count);
+   std::vector<bool> started (count, false);
+   for (size_t i = 1; i < count; i ++)
+      started[i] = pthread_create(&tids[i], NULL, lexChunk, &mChunks[i]) == 0;
+
+   lexChunk(&mChunks[0]);
+
+   for (size_t i = 1; i < count; i ++)
+   {
+      if (started[i])
+         pthread_join(tids[i], NULL);
+      else
+         lexChunk(&mChunks[i]);
+   }
+}
+
+/*****************************************************************************************************/
+/* Destructor. */
+ParallelLineReader::~ParallelLineReader()
+{
+   for (size_t i = 0; i < mChunks.size(); i ++)
+      for (size_t j = 0; j < mChunks[i].lines.size(); j ++)
+         for (size_t k = 0; k < mChunks[i].lines[j].tokens.size(); k ++)
+            delete mChunks[i].lines[j].tokens[k].event;
+
+   delete mSource;
+}
+
+/*****************************************************************************************************/
+/* Get the next line. */
+bool ParallelLineReader::next(const char *&line, size_t &length)
+{
+   while (mChunk < mChunks.size() && mLine >= mChunks[mChunk].lines.size())
+   {
+      mChunk ++;
+      mLine = 0;
+   }
+
+   if (mChunk >= mChunks.size())
+   {
+      mCurrent = NULL;
+      return false;
+   }
+
+   mCurrent = &mChunks[mChunk].lines[mLine ++];
+   line = mCurrent->text;
+   length = mCurrent->length;
+   return true;
+}
+
+/*****************************************************************************************************/
+/* The lexed form of the line returned last. */
+LexedLine* ParallelLineReader::lexed()
+{
+   return mCurrent;
+}
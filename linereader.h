@@ -0,0 +1,107 @@
+#ifndef LINEREADER_H
+#define LINEREADER_H
+
+#include <istream>
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+
+#include "parser.h"
+
+#define LINEREADER_CHUNK_MIN           65536    // Bytes; smaller texts are not split between the threads.
+
+/*******************************************************************************************/
+/* A source of pattern lines. The line stays valid until the next call. */
+class LineReader
+{
+   public:
+      /* Destructor. */
+      virtual ~LineReader() {}
+
+      /* Get the next line without the end of line character. Returns false at the end. */
+      virtual bool next(const char *&line, size_t &length) = 0;
+
+      /* The current line lexed ahead, or NULL if only the text is known. */
+      virtual LexedLine* lexed() { return NULL; }
+
+      /* The whole text, if it is in the memory already. */
+      virtual bool text(const char *&data, size_t &size) { return false; }
+
+      /* Open a file; mapped into memory if possible, read as a stream otherwise. Throws on failure. */
+      static LineReader* open(const char *path);
+};
+
+/*******************************************************************************************/
+/* Read the lines from a stream, e.g. the standard input. */
+class StreamLineReader : public LineReader
+{
+   std::istream  &mStream;
+   std::istream  *mOwned;              // Deleted with the reader, if not NULL.
+   std::string    mLine;
+
+   public:
+      /* Constructor. Takes the ownership of the stream if own is true. */
+      StreamLineReader(std::istream &ss, bool own = false);
+
+      /* Destructor. */
+      ~StreamLineReader();
+
+      bool next(const char *&line, size_t &length);
+};
+
+/*******************************************************************************************/
+/* Hand out the lines straight from a memory mapped file. */
+class MappedLineReader : public LineReader
+{
+   const char    *mData;
+   size_t         mSize;
+   size_t         mPos;
+
+   public:
+      /* Constructor. Takes a descriptor of a regular file; throws if it cannot be mapped. */
+      MappedLineReader(int fd);
+
+      /* Destructor. Unmaps the file. */
+      ~MappedLineReader();
+
+      bool next(const char *&line, size_t &length);
+
+      bool text(const char *&data, size_t &size);
+};
+
+/*******************************************************************************************/
+/* Split the text into chunks at the line boundaries and lex the chunks on a number of threads
+   before the first line is read. The parser then only applies its state to the lexed lines. */
+class ParallelLineReader : public LineReader
+{
+   public:
+      /* A part of the text lexed by one thread. */
+      struct Chunk
+      {
+         const char             *begin;
+         const char             *end;
+         std::vector<LexedLine>  lines;
+      };
+
+   private:
+      LineReader          *mSource;
+      std::string          mBuffer;       // The text if the source does not keep it.
+      std::vector<Chunk>   mChunks;
+      size_t               mChunk;        // The position of the next line.
+      size_t               mLine;
+      LexedLine           *mCurrent;
+
+   public:
+      /* Constructor. Takes the ownership of the source and lexes all of its text. */
+      ParallelLineReader(LineReader *source, unsigned threads);
+
+      /* Destructor. Frees the events of the lines that were not parsed. */
+      ~ParallelLineReader();
+
+      bool next(const char *&line, size_t &length);
+
+      LexedLine* lexed();
+};
+
+#endif
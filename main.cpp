@@ -34,69 +34,62 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <signal.h>
 
 #include "common.h"
+#include "linereader.h"
+#include "rawmidibackend.h"
+#include "realtime.h"
+#include "rtlog.h"
 #include "sequencer.h"
+#include "simbackend.h"
+#include "smfbackend.h"
+#include "statsreporter.h"
+
+#define SEQUENCER_LEAD_MS              2000     // How far the sequencer may run ahead of the playback.
 
 
 /*******************************************************************************************/
-/* A class for synchronous output from realtime thread. */
-class OutputLine
+/* Print the command line help. */
+void usage(const char *name)
 {
-   private:
-      std::vector<std::string> mQueue;
-      unsigned mReadIdx, mWriteIdx;
-      pthread_mutex_t mMutex;
-      pthread_cond_t mCond;
-
-      inline unsigned advanceIndex(unsigned idx)
-      {
-         idx ++;
-         if (idx == mQueue.size())
-            idx = 0;
-         return idx;
-      }
-
-      inline bool isFull()
-      {
-         return advanceIndex(mWriteIdx) == mReadIdx;
-      }
-
-      inline bool isEmpty()
-      {
-         return mReadIdx == mWriteIdx;
-      }
-   
-   public:
-      OutputLine(size_t size)
-      {
-         mQueue.resize(size);
-         mReadIdx = mWriteIdx = 0;
-      }
-
-      void push(std::string msg)
-      {
-         if (isFull())
-            return;
-         else {
-            mQueue[mWriteIdx] = msg;
-            mWriteIdx = advanceIndex(mWriteIdx);
-         }
-      }
-
-      std::string pull()
-      {
-         pthread_mutex_lock(&mMutex);
-
-         if (isEmpty())
-            pthread_cond_wait(&mCond, &mMutex);
-
-         std::string s = mQueue[mReadIdx];
-         mReadIdx = advanceIndex(mReadIdx);
+   std::cerr << "Usage: " << name << " [options] [pattern.seq]" << std::endl
+      << "The pattern is read from the standard input if no file is given." << std::endl
+      << "Options:" << std::endl
+      << "  -q heap|wheel   event scheduler implementation (default: heap)" << std::endl
+      << "  -m size         number of preallocated event queue entries (default: " << MIDI_HEAP_SIZE << ")" << std::endl
+      << "  -r size         ringbuffer capacity in messages (default: " << RINGBUFFER_SIZE << ")" << std::endl
+      << "  -s file         rewrite the runtime statistics (JSON) to the file every second;" << std::endl
+      << "                  SIGUSR1 dumps them to stderr in any case" << std::endl
+      << "  -x policy       xrun recovery: clamp (default), drop:N (drop events late by more than N frames)," << std::endl
+      << "                  shift (move the timeline past the lost time) or spread (spread late events)" << std::endl
+      << "  -a              adapt the dispatch lookahead to the measured wakeup jitter" << std::endl
+      << "  -d              direct dispatch: no dispatch thread, the sequencer feeds Jack itself" << std::endl
+      << "  -o file.mid     render to a standard MIDI file as fast as possible instead of playing through Jack" << std::endl
+      << "  -t file         simulate the playback as fast as possible and write every emitted event" << std::endl
+      << "                  with its cycle and offset to the file (- for stdout)" << std::endl
+      << "  -w dest         play without Jack: write the raw MIDI bytes in time to a file or FIFO," << std::endl
+      << "                  fd:N for a file descriptor or - for stdout" << std::endl
+      << "  -z              leave out the repeated status bytes (running status) with -w" << std::endl
+      << "  -F rate         sample rate of the clock for -o, -t and -w (default: " << SMF_SAMPLE_RATE << ")" << std::endl
+      << "  -P frames       period of the clock for -o, -t and -w (default: " << SMF_BUFFER_SIZE << ")" << std::endl
+      << "  -T frames       stop -o and -t when the clock reaches the frame; for the songs that loop forever" << std::endl
+      << "  -L              lock the memory and prefault the buffers" << std::endl
+      << "  -R offset       run the dispatch thread under SCHED_FIFO at the Jack priority + offset" << std::endl
+      << "  -S offset       run the sequencer thread under SCHED_FIFO at the Jack priority + offset" << std::endl
+      << "  -c cpus         pin the dispatch thread to the CPUs, like 2 or 1,3-5" << std::endl
+      << "  -C cpus         pin the sequencer thread to the CPUs" << std::endl
+      << "  -j threads      lex the pattern on the threads before playing; 1 parses line by line" << std::endl
+      << "                  (default: the number of CPUs)" << std::endl
+      << "  -h              show this help" << std::endl;
+}
 
-         pthread_mutex_unlock(&mMutex);
+StatsReporter *gStatsReporter = NULL;
 
-         return s;
-      }
-};
+/*******************************************************************************************/
+/* SIGUSR1 handler: ask for the statistics. */
+void statsSignalHandler(int s)
+{
+   if (gStatsReporter != NULL)
+      gStatsReporter->requestDump();
+}
 
 /*******************************************************************************************/
 /* Signal handler. */
@@ -106,8 +99,9 @@ void signalHandler(int s)
    std::cerr << "Signal " << s << " arrived. Shutting down." << std::endl;
    jack->stopSounds();
    gPlaying = false;
-   usleep(100000);
+   jack->idle(100);
    jack->shutdown();
+   RtLog::instance()->stop();
    exit(1);
 }
 
@@ -115,13 +109,31 @@ void signalHandler(int s)
 /* Read the data from the sequencer and queue the midi events to Jack */
 void play(JackEngine *jack, Sequencer &seq)
 {
+   jack_nframes_t lead = jack->msToNframes(SEQUENCER_LEAD_MS);
+
    // Play while we got something to play.
-   while (gPlaying && seq.playNextLine());
+   while (gPlaying && seq.playNextLine())
+   {
+      jack->noteSequencerLead(seq.getCurrentTime());
+
+      // Nothing earlier than the release time can be queued anymore.
+      jack->releaseEvents(seq.releaseTime());
 
-   // Wait for all events to be processed.
+      // Do not run too far ahead of the playback; the event queue is unbounded.
+      while (gPlaying && seq.getCurrentTime() > jack->currentFrameTime() + lead)
+      {
+         jack->releaseEvents(seq.releaseTime());
+         jack->idle(1);
+      }
+   }
+
+   // Wait for all events to be processed. The song is over, so all the queued events are final.
    while (jack->hasPendingEvents() & gPlaying)
-      usleep(200000);
-   usleep(200000);
+   {
+      jack->releaseEvents(jack->currentFrameTime() + lead);
+      jack->idle(10);
+   }
+   jack->idle(200);
 
    gPlaying = false;
 }
@@ -144,28 +156,255 @@ int main(int argc, char **argv)
    sigaction(6, &action, 0L);
    sigaction(15, &action, 0L);
 
+   action.sa_handler = statsSignalHandler;
+   action.sa_flags = SA_RESTART;
+   sigaction(SIGUSR1, &action, 0L);
+
    gPlaying = true;
 
-   // Init Jackd connection.
+   // Everything the realtime threads report goes through the log thread.
+   RtLog::instance()->start(stderr);
+
    JackEngine *jack = JackEngine::instance();
+   StatsReporter stats (jack);
+   bool bSeqRealtime = false, bSeqAffinity = false;
+   int seqPriority = 0;
+   std::string smfPath, simPath, rawDestination;
+   bool bRunningStatus = false;
+   jack_nframes_t virtualRate = SMF_SAMPLE_RATE, virtualPeriod = SMF_BUFFER_SIZE;
+   uint64_t frameLimit = 0;
+   cpu_set_t cpus, seqCpus;
+   long lexThreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+   // Parse the command line options.
+   int opt;
+   while ((opt = getopt(argc, argv, "q:m:r:s:x:ado:t:w:zF:P:T:LR:S:c:C:j:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 'q':
+            if (std::string(optarg) == "heap")
+               jack->setSchedulerType(SCHEDULER_HEAP);
+            else if (std::string(optarg) == "wheel")
+               jack->setSchedulerType(SCHEDULER_WHEEL);
+            else
+            {
+               usage(argv[0]);
+               return 1;
+            }
+            break;
+
+         case 'm':
+            jack->setQueueSize(strtoul(optarg, NULL, 10));
+            break;
+
+         case 'r':
+            jack->setRingbufferSize(strtoul(optarg, NULL, 10));
+            break;
+
+         case 's':
+            stats.setPath(optarg);
+            break;
+
+         case 'x':
+            if (std::string(optarg) == "clamp")
+               jack->setXrunPolicy(XRUN_CLAMP);
+            else if (std::string(optarg).compare(0, 5, "drop:") == 0)
+               jack->setXrunPolicy(XRUN_DROP, strtoul(optarg + 5, NULL, 10));
+            else if (std::string(optarg) == "shift")
+               jack->setXrunPolicy(XRUN_SHIFT);
+            else if (std::string(optarg) == "spread")
+               jack->setXrunPolicy(XRUN_SPREAD);
+            else
+            {
+               usage(argv[0]);
+               return 1;
+            }
+            break;
+
+         case 'a':
+            jack->setAdaptiveLookahead(true);
+            break;
+
+         case 'd':
+            jack->setDirectDispatch(true);
+            break;
+
+         case 'o':
+            smfPath = optarg;
+            break;
+
+         case 't':
+            simPath = optarg;
+            break;
+
+         case 'w':
+            rawDestination = optarg;
+            break;
+
+         case 'z':
+            bRunningStatus = true;
+            break;
+
+         case 'F':
+            virtualRate = strtoul(optarg, NULL, 10);
+            break;
+
+         case 'P':
+            virtualPeriod = strtoul(optarg, NULL, 10);
+            break;
+
+         case 'T':
+            frameLimit = strtoull(optarg, NULL, 10);
+            break;
+
+         case 'L':
+            jack->setLockMemory(true);
+            break;
+
+         case 'R':
+            jack->setDispatchPriority(atoi(optarg));
+            break;
+
+         case 'S':
+            bSeqRealtime = true;
+            seqPriority = atoi(optarg);
+            break;
+
+         case 'c':
+            if (!parseCpuList(optarg, cpus))
+            {
+               usage(argv[0]);
+               return 1;
+            }
+            jack->setDispatchAffinity(cpus);
+            break;
+
+         case 'C':
+            if (!parseCpuList(optarg, seqCpus))
+            {
+               usage(argv[0]);
+               return 1;
+            }
+            bSeqAffinity = true;
+            break;
+
+         case 'j':
+            lexThreads = atol(optarg);
+            if (lexThreads < 1)
+            {
+               usage(argv[0]);
+               return 1;
+            }
+            break;
+
+         default:
+            usage(argv[0]);
+            return 1;
+      }
+   }
+
+   if (virtualRate == 0 || virtualPeriod == 0
+         || !smfPath.empty() + !simPath.empty() + !rawDestination.empty() > 1
+         || optind < argc - 1)
+   {
+      usage(argv[0]);
+      return 1;
+   }
+
+   // The pattern file is mapped into memory; without one the standard input is read.
+   LineReader *reader;
+   if (optind < argc)
+   {
+      try {
+         reader = LineReader::open(argv[optind]);
+      } catch (const char *s) {
+         std::cerr << "Error: " << s << ": " << argv[optind] << std::endl;
+         return 1;
+      }
+   }
+   else
+      reader = new StreamLineReader(std::cin);
+
+   // Lex and decode the notes on the threads now; the parser then only applies its state.
+   if (lexThreads > 1)
+      reader = new ParallelLineReader(reader, lexThreads);
+
+   // The virtual clock runs in the sequencer thread, so there is no dispatch thread.
+   VirtualBackend *virtualBackend = NULL;
+   if (!smfPath.empty())
+      virtualBackend = new SmfBackend(smfPath, virtualRate, virtualPeriod);
+   if (!simPath.empty())
+      virtualBackend = new SimBackend(simPath, virtualRate, virtualPeriod);
+   if (virtualBackend != NULL)
+   {
+      virtualBackend->setFrameLimit(frameLimit);
+      jack->setBackend(virtualBackend);
+      jack->setDirectDispatch(true);
+   }
+
+   // The raw output keeps the real time, so the dispatch goes as with Jack.
+   if (!rawDestination.empty())
+      jack->setBackend(new RawMidiBackend(rawDestination, bRunningStatus, virtualRate, virtualPeriod));
+
+   // Init Jackd connection.
    try {
       jack->init();
    } catch (std::string &s) {
       std::cout << "Error during Jack initialization: " << s << std::endl;
+   } catch (const char *s) {
+      std::cerr << "Error during the output initialization: " << s << std::endl;
+      RtLog::instance()->stop();
+      return 1;
    }
    
+   gStatsReporter = &stats;
+   stats.start();
+
+   // The sequencer runs in this thread; the helper threads are started already, so they keep the normal priority.
+   if (bSeqRealtime)
+      setRealtimePriority(pthread_self(), jack->realtimePriority(seqPriority), "sequencer");
+   if (bSeqAffinity)
+      setCpuAffinity(pthread_self(), seqCpus, "sequencer");
+
    // Init the sequencer and load the pattern.
    Sequencer seq (jack);
-   seq.readFromStream(std::cin);
+   seq.readLines(*reader);
+   delete reader;
 
    // Play the pattern.
    play(jack, seq);
 
+   stats.stop();
+   gStatsReporter = NULL;
+
+   trace("event queue high-water mark: %zu\n", jack->queueHighWater());
+   trace("dispatch wakeups per second: %.1f\n", jack->dispatchWakeupRate());
+
+   if (jack->xrunCount() > 0)
+      std::cerr << "WARNING! " << jack->xrunCount() << " xruns during the playback." << std::endl;
+
+   for (unsigned i = 0; i < jack->outputPortCount(); i ++)
+   {
+      if (jack->droppedCount(i) > 0)
+         std::cerr << "WARNING! " << jack->droppedCount(i) << " messages dropped on port "
+            << jack->outputPortName(i) << "." << std::endl;
+      trace("port %s: %llu messages deferred\n", jack->outputPortName(i).c_str(),
+            (long long unsigned)jack->deferredCount(i));
+   }
+   trace("carried over to the next cycle: %llu control, %llu other, %llu note, %llu essential; %llu coalesced\n",
+         (long long unsigned)jack->classDeferredCount(MIDI_CLASS_CONTROL),
+         (long long unsigned)jack->classDeferredCount(MIDI_CLASS_OTHER),
+         (long long unsigned)jack->classDeferredCount(MIDI_CLASS_NOTE),
+         (long long unsigned)jack->classDeferredCount(MIDI_CLASS_ESSENTIAL),
+         (long long unsigned)jack->coalescedCount());
+
    // Shutdown the client and exit.
    jack->stopSounds();
-   usleep(200000);
+   jack->idle(200);
 
    jack->shutdown();
+   RtLog::instance()->stop();
 
    return 0;
 }
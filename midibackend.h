@@ -0,0 +1,75 @@
+#ifndef MIDIBACKEND_H
+#define MIDIBACKEND_H
+
+#include <string>
+
+#include <stddef.h>
+
+#include <jack/jack.h>
+
+class JackEngine;
+
+/*******************************************************************************************/
+/* The output side of the engine: the clock, the ports and their midi buffers. The backend
+   drives the engine through jack_process_cb() and the other engine callbacks. */
+class MidiBackend
+{
+   public:
+      virtual ~MidiBackend() {}
+
+      /* Open the output and connect the callbacks to the engine. Throws a message on failure. */
+      virtual void open(JackEngine *engine) = 0;
+
+      /* Start running the process cycles. */
+      virtual void activate() = 0;
+
+      /* Close the output. */
+      virtual void close() = 0;
+
+      /* The sample rate in frames per second. */
+      virtual jack_nframes_t sampleRate() = 0;
+
+      /* The number of frames in a process cycle. */
+      virtual jack_nframes_t bufferSize() = 0;
+
+      /* The current frame time. */
+      virtual jack_nframes_t frameTime() = 0;
+
+      /* The frame time the current process cycle started at. Called from the process callback. */
+      virtual jack_nframes_t cycleStart() = 0;
+
+      /* The current time in microseconds. */
+      virtual jack_time_t time() = 0;
+
+      /* The time of the given frame in microseconds. */
+      virtual jack_time_t frameToTime(jack_nframes_t frame) = 0;
+
+      /* How long the latest xrun was, in microseconds. */
+      virtual float xrunDelay() = 0;
+
+      /* The realtime priority of the process cycles, or -1 if they do not run realtime. */
+      virtual int realtimePriority() = 0;
+
+      /* Register an output port with the given index. Returns false on failure. */
+      virtual bool registerPort(unsigned idx, const std::string &name) = 0;
+
+      /* The short name of the output port. */
+      virtual std::string portName(unsigned idx) = 0;
+
+      /* Connect the output port to the destination. Returns 0 on success. */
+      virtual int connectPort(unsigned idx, const std::string &destination) = 0;
+
+      /* The midi buffer of the output port for the current cycle, or NULL. Called from the process callback. */
+      virtual void* portBuffer(unsigned idx, jack_nframes_t nframes) = 0;
+
+      /* Remove all the events from the midi buffer. */
+      virtual void clearBuffer(void *buffer) = 0;
+
+      /* Make room for an event in the midi buffer. Returns NULL if it does not fit. */
+      virtual unsigned char* reserveEvent(void *buffer, jack_nframes_t offset, size_t size) = 0;
+
+      /* Let the given time pass: sleep, or run the cycles on a virtual clock. */
+      virtual void idle(unsigned ms) = 0;
+};
+
+#endif
@@ -1,12 +1,14 @@
 #include "events.h"
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-#include <sstream>
+#include <vector>
 
 #include "common.h"
 #include "jackengine.h"
+#include "lexer.h"
 #include "sequencer.h"
 
 /*****************************************************************************************************/
@@ -24,11 +26,26 @@ MidiCtlEvent::MidiCtlEvent()
    time = 0;
    delay = 0;
    delayDiv = 1;
+   payload = (uint32_t)-1;
 }
 
 /*****************************************************************************************************/
 /* Construct the control by parsing the string. */
 MidiCtlEvent::MidiCtlEvent(const std::string &str, unsigned clmn)
+   : MidiCtlEvent(str.data(), str.length(), clmn)
+{
+}
+
+/*****************************************************************************************************/
+/* The value of a hex digit. */
+static unsigned hexDigit(char c)
+{
+   return isdigit((unsigned char)c) ? c - '0' : toupper((unsigned char)c) - 'A' + 10;
+}
+
+/*****************************************************************************************************/
+/* Construct the control by parsing a piece of text. */
+MidiCtlEvent::MidiCtlEvent(const char *buf, size_t len, unsigned clmn)
 {
    type = CTLTYPE_CONTROL;
    column = clmn;
@@ -41,57 +58,103 @@ MidiCtlEvent::MidiCtlEvent(const std::string &str, unsigned clmn)
    time = 0;
    delay = 0;
    delayDiv = 1;
+   payload = (uint32_t)-1;
 
+   TextSpan str (buf, len);
    if (str.front() != '$')
       throw 0;
 
-   std::istringstream iss (str.substr(1));
+   Lexer lex (str.sub(1));
+
+   // System exclusive message; the data is given as a string of hex digits.
+   if (str.startsWith("$sx="))
+   {
+      type = CTLTYPE_SYSEX;
+
+      std::vector<unsigned char> bytes;
+      size_t i = 4;
+      while (i + 1 < len && isxdigit((unsigned char)buf[i]) && isxdigit((unsigned char)buf[i + 1]))
+      {
+         bytes.push_back(hexDigit(buf[i]) * 16 + hexDigit(buf[i + 1]));
+         i += 2;
+      }
+
+      // A complete message: F0, the data bytes and F7.
+      if (bytes.size() < 2 || bytes.front() != 0xF0)
+         throw 4;
+      for (size_t k = 1; k + 1 < bytes.size(); k ++)
+         if (bytes[k] > 0x7F)
+            throw (int)(4 + 2 * k);
+      if (bytes.back() != 0xF7)
+         throw (int)(i - 2);
+
+      payload = JackEngine::instance()->payloadPool()->store(bytes.data(), bytes.size());
+      if (payload == (uint32_t)-1)
+         throw (int)i;
+
+      // Only the delay modifiers make sense for SysEx.
+      lex.seek(i - 1);
+      char c;
+      while ((c = lex.get()) != EOF)
+      {
+         switch (c)
+         {
+            case '+':
+               lex.next(delay);
+               break;
+            case '/':
+               lex.next(delayDiv);
+               break;
+         }
+      }
+      return;
+   }
 
    // Check if this is a special case of Pitch Bend.
-   if (str.substr(0, 3) == "$pb")
+   if (str.startsWith("$pb"))
    {
       type = CTLTYPE_PITCHBEND;
-      iss.seekg(2);
+      lex.seek(2);
    }
    else
    {
-      if (!(iss >> controller))
-         throw (int)iss.tellg();
+      if (!lex.next(controller))
+         throw (int)lex.tell();
    }
 
    // Read the initial value and throw the position in case of parsing error.
-   if (iss.get() != '=' || !(iss >> initValue))
-      throw (int)iss.tellg();
+   if (lex.get() != '=' || !lex.next(initValue))
+      throw (int)lex.tell();
 
    // Skip "..".
-   while (iss.peek() == '.')
-      iss.get();
+   while (lex.peek() == '.')
+      lex.get();
 
    // If there are no second value, set the value to the initial.
-   if (!(iss >> value))
+   if (!lex.next(value))
       value = initValue;
 
    // Skip "..".
-   while (iss.peek() == '.')
-      iss.get();
+   while (lex.peek() == '.')
+      lex.get();
 
-   // Try to read step value.
-   iss.clear();
-   iss >> step;
+   // Try to read step value. A failed read stops the modifiers too: "$7=0..127:4" has no time.
+   lex.clear();
+   lex.next(step);
 
    char c;
-   while ((c = iss.get()) != EOF)
+   while ((c = lex.get()) != EOF)
    {
       switch (c)
       {
          case ':':
-            iss >> time;
+            lex.next(time);
             break;
          case '+':
-            iss >> delay;
+            lex.next(delay);
             break;
          case '/':
-            iss >> delayDiv;
+            lex.next(delayDiv);
             break;
       }
    }
@@ -99,12 +162,17 @@ MidiCtlEvent::MidiCtlEvent(const std::string &str, unsigned clmn)
 
 /*****************************************************************************************************/
 /* Generate a MIDI message that corresponds to the object. */
-MidiMessage MidiCtlEvent::midiMsg(jack_nframes_t time, unsigned value, unsigned channel, jack_port_t *port)
+MidiMessage MidiCtlEvent::midiMsg(frametime_t time, unsigned value, unsigned channel, unsigned port)
 {
-   unsigned b0, b1, b2;
+   unsigned b0 = 0, b1 = 0, b2 = 0;
 
    switch (type)
    {
+      case CTLTYPE_SYSEX:
+         // The message holds its own reference; the process callback drops it.
+         JackEngine::instance()->payloadPool()->retain(payload);
+         return MidiMessage::pooled(payload, time, port);
+
       case CTLTYPE_PITCHBEND:
          b0 = MIDI_PITCH_BEND;
          b1 = 0b01111111 & value;
@@ -128,32 +196,31 @@ ControlFlow MidiCtlEvent::execute(JackEngine *jack, Sequencer *seq)
 
    PortMap pm = seq->getPortMap(column);
 
-   if (initValue == (unsigned)-1 || time == 0 || value == initValue)
+   if (type == CTLTYPE_SYSEX || initValue == (unsigned)-1 || time == 0 || value == initValue)
    {
       // This is a control message to the midi. Generate single event.
-      jack->queueMidiEvent(midiMsg(
-               seq->getCurrentTime() + (jack->msToNframes(60 * 1000 / seq->getTempo() / seq->getQuant()) * delay / delayDiv),
+      seq->queueMidiEvent(midiMsg(
+               seq->getCurrentTime() + seq->linesToFrames(delay, delayDiv),
                value,
                pm.channel, pm.port));
    }
    else
    {
       // This is ramp. Need to generate a bunch of messages.
-      unsigned timeStep = (jack->msToNframes(60 * 1000 / seq->getTempo() / seq->getQuant()) * time / delayDiv)
-         / std::abs((int)(initValue - value));
+      // The value i is due delay / delayDiv + time / delayDiv * |i - initValue| / span lines ahead.
+      double span = std::abs((int)(initValue - value));
       for (unsigned i = initValue;
             (value > initValue) ? (i < value) : (i > value);
             i += (value > initValue ? step : - step))
       {
-         jack->queueMidiEvent(midiMsg(
-                  seq->getCurrentTime() + (jack->msToNframes(60 * 1000 / seq->getTempo() / seq->getQuant()) * delay / delayDiv)
-                  + timeStep * std::abs((int)(initValue - i)),
+         seq->queueMidiEvent(midiMsg(
+                  seq->getCurrentTime() + seq->linesToFrames(
+                     delay * span + time * std::abs((int)(initValue - i)), delayDiv * span),
                   i,
                   pm.channel, pm.port));
       }
-      jack->queueMidiEvent(midiMsg(
-               seq->getCurrentTime() + (jack->msToNframes(60 * 1000 / seq->getTempo() / seq->getQuant()) * delay / delayDiv)
-               + timeStep * std::abs((int)(initValue - value)),
+      seq->queueMidiEvent(midiMsg(
+               seq->getCurrentTime() + seq->linesToFrames(delay + time, delayDiv),
                value,
                pm.channel, pm.port));
    }
@@ -9,7 +9,7 @@
 /* A message to a midi controller. */
 struct MidiCtlEvent : public Event
 {
-   enum {CTLTYPE_CONTROL, CTLTYPE_PITCHBEND} type;
+   enum {CTLTYPE_CONTROL, CTLTYPE_PITCHBEND, CTLTYPE_SYSEX} type;
    unsigned controller;
    unsigned value;
    unsigned initValue;
@@ -17,14 +17,18 @@ struct MidiCtlEvent : public Event
    double time;
    double delay;
    double delayDiv;
+   uint32_t payload;       // SysEx data handle in the engine's PayloadPool.
 
    MidiCtlEvent();
 
    /* Construct the control by parsing the string. */
    MidiCtlEvent(const std::string &str, unsigned clmn = 0);
 
+   /* Construct the control by parsing a piece of text. */
+   MidiCtlEvent(const char *str, size_t len, unsigned clmn = 0);
+
    /* Generate a MIDI message that corresponds to the object. */
-   MidiMessage midiMsg(jack_nframes_t time, unsigned value, unsigned channel, jack_port_t *port);
+   MidiMessage midiMsg(frametime_t time, unsigned value, unsigned channel, unsigned port);
 
    /* Virtual functions to schedule messages. */
    ControlFlow execute(JackEngine *jack, Sequencer *seq);
@@ -3,13 +3,22 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#define HEAP_CHUNK                     (1 << HEAP_CHUNK_BITS)
+
+/*****************************************************************************************************/
+/* Return the element with the given index. */
+inline MidiMessage& MidiHeap::at(size_t i)
+{
+   return mChunks[i >> HEAP_CHUNK_BITS][i & (HEAP_CHUNK - 1)];
+}
+
 /*****************************************************************************************************/
 /* Swap two elements with the given indicies. */
 inline void MidiHeap::swap(size_t i, size_t j)
 {
-   MidiMessage t = mArray[i];
-   mArray[i] = mArray[j];
-   mArray[j] = t;
+   MidiMessage t = at(i);
+   at(i) = at(j);
+   at(j) = t;
 }
 
 /*****************************************************************************************************/
@@ -33,6 +42,17 @@ inline size_t MidiHeap::rchild(size_t i)
    return (i + 1) * 2;
 }
 
+/*****************************************************************************************************/
+/* Return true if the element i should go before the element j.
+   Compare the two by the time and the port number. */
+inline bool MidiHeap::less(size_t i, size_t j)
+{
+   const MidiMessage &a = at(i), &b = at(j);
+   if (a.time != b.time)
+      return a.time < b.time;
+   return a.port < b.port;
+}
+
 /*****************************************************************************************************/
 /* Return an index of the smallest element of two given index elements. */
 inline size_t MidiHeap::imin(size_t i, size_t j)
@@ -45,15 +65,7 @@ inline size_t MidiHeap::imin(size_t i, size_t j)
    if (i >= mTop && j >= mTop)
       return (size_t) -1;
 
-   // Compare the two by the time and the port number.
-   if (mArray[i].time < mArray[j].time)
-      return i;
-   else if (mArray[i].time > mArray[j].time)
-      return j;
-   else if (mArray[i].port < mArray[j].port)
-      return i;
-   else
-      return j;
+   return less(j, i) ? j : i;
 }
 
 /*****************************************************************************************************/
@@ -62,7 +74,7 @@ void MidiHeap::bubbleDown(size_t i)
 {
    size_t j = imin(lchild(i), rchild(i));
 
-   while (j != (size_t)-1 && mArray[i].time > mArray[j].time)
+   while (j != (size_t)-1 && less(j, i))
    {
       swap(i, j);
       i = j;
@@ -71,79 +83,66 @@ void MidiHeap::bubbleDown(size_t i)
 }
 
 /*****************************************************************************************************/
+/* Add a chunk of storage. The messages already stored stay where they are; the chunks are kept
+   when the heap shrinks, so a heap that has grown once does not allocate again. */
+void MidiHeap::grow()
+{
+   mChunks.push_back(new MidiMessage[HEAP_CHUNK]);
+   mSize += HEAP_CHUNK;
+}
+
+/*****************************************************************************************************/
+/* Constructor. Preallocates the storage for s messages. */
 MidiHeap::MidiHeap(size_t s)
 {
-   mArray = new MidiMessage[s];
-   mSize = s;
-   pthread_mutex_init(&mMutex, NULL);
+   mSize = 0;
+   mTop = 0;
+   do
+      grow();
+   while (mSize < s);
 }
 
 /*****************************************************************************************************/
 MidiHeap::~MidiHeap()
 {
-   delete mArray;
-   pthread_mutex_destroy(&mMutex);
+   for (size_t i = 0; i < mChunks.size(); i ++)
+      delete[] mChunks[i];
 }
 
 /*****************************************************************************************************/
-/* Add a new element while maintaining the order.
-   The function locks until there is a space in the buffer. */
-void MidiHeap::insert(MidiMessage &msg)
+/* Add a new element while maintaining the order. The storage grows if needed. */
+void MidiHeap::insert(const MidiMessage &msg)
 {
-   pthread_mutex_lock(&mMutex);
-
-   if (mTop + 1 >= mSize)
-      pthread_cond_wait(&mbCanWrite, &mMutex);
+   if (mTop >= mSize)
+      grow();
 
    size_t i = mTop ++;
-   mArray[i] = msg;
+   at(i) = msg;
 
-   while (parent(i) != (size_t)-1 && mArray[i].time < mArray[parent(i)].time)
+   while (i > 0 && less(i, parent(i)))
    {
       swap(i, parent(i));
       i = parent(i);
    }
-
-   pthread_cond_broadcast(&mbCanRead);
-   pthread_mutex_unlock(&mMutex);
 }
 
 /*****************************************************************************************************/
-/* Pop the minimal element.
-   The function locks until there is an element to read. */
+/* Pop the minimal element. The heap must not be empty. */
 MidiMessage MidiHeap::popMin()
 {
-   pthread_mutex_lock(&mMutex);
-
-   if (mTop == 0)
-      pthread_cond_wait(&mbCanRead, &mMutex);
-
-   MidiMessage min = mArray[0];
-   mArray[0] = mArray[mTop - 1];
+   MidiMessage min = at(0);
+   at(0) = at(mTop - 1);
    mTop --;
    bubbleDown(0);
 
-   pthread_cond_broadcast(&mbCanWrite);
-   pthread_mutex_unlock(&mMutex);
-
    return min;
 }
 
 /*****************************************************************************************************/
-/* Look the minimal element without removing it from the buffer.
-   The function locks until there is an element to look at. */
-MidiMessage MidiHeap::peekMin()
+/* Look the minimal element without removing it from the buffer. The heap must not be empty. */
+const MidiMessage& MidiHeap::peekMin()
 {
-   MidiMessage min;
-
-   pthread_mutex_lock(&mMutex);
-   if (mTop == 0)
-      pthread_cond_wait(&mbCanRead, &mMutex);
-
-   min = mArray[0];
-   pthread_mutex_unlock(&mMutex);
-
-   return min;
+   return at(0);
 }
 
 /*****************************************************************************************************/
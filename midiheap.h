@@ -1,22 +1,28 @@
 #ifndef MIDIHEAP_H
 #define MIDIHEAP_H
 
-#include <pthread.h>
+#include <vector>
+
+#include <stddef.h>
 
 #include "midimessage.h"
+#include "midischeduler.h"
+
+#define HEAP_CHUNK_BITS                10       // Messages per storage chunk (log2).
 
 /*******************************************************************************************/
 /* A simple heap implementation to keep the midi messages in order. */
-class MidiHeap
+class MidiHeap : public MidiScheduler
 {
    private:
-      MidiMessage     *mArray;
-      pthread_mutex_t  mMutex;
-      pthread_cond_t   mbCanWrite;
-      pthread_cond_t   mbCanRead;
-      size_t           mSize;              // Maximum size (or array size).
+      std::vector<MidiMessage*>
+                       mChunks;            // The storage; grows without moving the messages.
+      size_t           mSize;              // Storage size.
       size_t           mTop;               // Current top position.
 
+      /* Return the element with the given index. */
+      inline MidiMessage& at(size_t i);
+
       /* Swap two elements with the given indicies. */
       inline void swap(size_t i, size_t j);
 
@@ -29,30 +35,33 @@ class MidiHeap
       /* Return an index of the right child of the given index element. */
       inline size_t rchild(size_t i);
 
+      /* Return true if the element i should go before the element j. */
+      inline bool less(size_t i, size_t j);
+
       /* Return an index of the smallest element of two given index elements. */
       inline size_t imin(size_t i, size_t j);
 
       /* Rearrange the buffer to maintain the order. */
       void bubbleDown(size_t i);
 
+      /* Add a chunk of storage. */
+      void grow();
+
    public:
-      /* Constructor. */
+      /* Constructor. Preallocates the storage for s messages. */
       MidiHeap(size_t s);
 
       /* Destructor. */
       ~MidiHeap();
 
-      /* Add a new element while maintaining the order.
-         The function locks until there is a space in the buffer. */
-      void insert(MidiMessage &msg);
+      /* Add a new element while maintaining the order. The storage grows if needed. */
+      void insert(const MidiMessage &msg);
 
-      /* Pop the minimal element.
-         The function locks until there is an element to read. */
+      /* Pop the minimal element. The heap must not be empty. */
       MidiMessage popMin();
 
-      /* Look the minimal element without removing it from the buffer.
-         The function locks until there is an element to look at. */
-      MidiMessage peekMin();
+      /* Look the minimal element without removing it from the buffer. The heap must not be empty. */
+      const MidiMessage& peekMin();
 
       /* The number of elements available in the buffer. */
       size_t count();
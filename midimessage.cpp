@@ -4,7 +4,7 @@
 
 /*****************************************************************************************************/
 /* Construct the message with the given midi data. */
-MidiMessage::MidiMessage(int b0, int b1, int b2, jack_nframes_t tm, unsigned channel, jack_port_t *p)
+MidiMessage::MidiMessage(int b0, int b1, int b2, frametime_t tm, unsigned channel, unsigned p)
 {
    if (b0 >= 0x80 && b0 <= 0xEF)
    {
@@ -12,6 +12,8 @@ MidiMessage::MidiMessage(int b0, int b1, int b2, jack_nframes_t tm, unsigned cha
       b0 += channel;       // Channel.
    }
 
+   memset(data, 0, MIDI_MSG_INLINE);
+
    if (b1 == -1)
    {
       len = 1;
@@ -33,13 +35,96 @@ MidiMessage::MidiMessage(int b0, int b1, int b2, jack_nframes_t tm, unsigned cha
 
    time = tm;
    port = p;
+   flags = 0;
 }
 
 /*****************************************************************************************************/
 /* Create the message with null data */
 MidiMessage::MidiMessage()
 {
-   memset(data, 0, 3);
+   memset(data, 0, MIDI_MSG_INLINE);
    len = 0;
    time = 0;
+   port = 0;
+   flags = 0;
+}
+
+/*****************************************************************************************************/
+/* Construct a message referring to a pooled payload. */
+MidiMessage MidiMessage::pooled(uint32_t h, frametime_t tm, unsigned p)
+{
+   MidiMessage msg;
+   msg.time = tm;
+   msg.port = p;
+   msg.len = 0;
+   msg.flags = MIDI_MSG_POOLED;
+   msg.handle = h;
+   return msg;
+}
+
+/*****************************************************************************************************/
+/* Is the data kept in the payload pool. */
+bool MidiMessage::isPooled() const
+{
+   return flags & MIDI_MSG_POOLED;
+}
+
+/*****************************************************************************************************/
+/* The delivery class of the message. */
+MidiClass MidiMessage::deliveryClass() const
+{
+   if (isPooled() || len == 0)
+      return MIDI_CLASS_OTHER;
+
+   switch (data[0] & 0xF0)
+   {
+      case MIDI_NOTE_OFF:
+         return MIDI_CLASS_ESSENTIAL;
+
+      case MIDI_NOTE_ON:
+         // Note on with zero velocity is a note off.
+         return len > 2 && data[2] == 0 ? MIDI_CLASS_ESSENTIAL : MIDI_CLASS_NOTE;
+
+      case MIDI_CONTROLLER:
+         if (data[1] == MIDI_ALL_SOUND_OFF || data[1] == MIDI_ALL_NOTES_OFF)
+            return MIDI_CLASS_ESSENTIAL;
+         return MIDI_CLASS_CONTROL;
+
+      case MIDI_PITCH_BEND:
+      case MIDI_POLY_PRESSURE:
+      case MIDI_CHANNEL_PRESSURE:
+         return MIDI_CLASS_CONTROL;
+
+      default:
+         return MIDI_CLASS_OTHER;
+   }
+}
+
+/*****************************************************************************************************/
+/* The channel and key number of a note on or off, below MIDI_NOTE_KEYS; -1 for the other messages. */
+int MidiMessage::noteKey() const
+{
+   if (isPooled() || len < 2)
+      return -1;
+
+   unsigned status = data[0] & 0xF0;
+   if (status != MIDI_NOTE_ON && status != MIDI_NOTE_OFF)
+      return -1;
+   return (data[0] & 0x0F) * 128 + (data[1] & 0x7F);
+}
+
+/*****************************************************************************************************/
+/* The controller set by a message of the control class, below MIDI_CONTROL_KEYS; only the latest
+   value of each matters. -1 for the other classes. */
+int MidiMessage::controlKey() const
+{
+   if (deliveryClass() != MIDI_CLASS_CONTROL)
+      return -1;
+
+   // Controllers and key pressure are told apart by the second byte.
+   int key = (data[0] - MIDI_POLY_PRESSURE) * 128;
+   unsigned status = data[0] & 0xF0;
+   if (status == MIDI_CONTROLLER || status == MIDI_POLY_PRESSURE)
+      key += data[1] & 0x7F;
+   return key;
 }
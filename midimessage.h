@@ -1,23 +1,65 @@
 #ifndef MIDIMESSAGE_H
 #define MIDIMESSAGE_H
 
+#include <stdint.h>
+
 #include <jack/jack.h>
 #include <jack/midiport.h>
 
+#include "common.h"
+
+#define MIDI_MSG_INLINE                4        // Longer messages keep their data in the PayloadPool.
+#define MIDI_MSG_POOLED                0x01     // The message refers to a pooled payload.
+#define MIDI_NOTE_KEYS                 (16 * 128)                          // The channels times the key numbers.
+#define MIDI_CONTROL_KEYS              ((0xF0 - MIDI_POLY_PRESSURE) * 128) // The control statuses times the controllers.
+
+/* Delivery classes, in the order they are held back when a port buffer is full. */
+enum MidiClass
+{
+   MIDI_CLASS_CONTROL,        // Controllers, pitch bend and pressure; a ramp may be thinned.
+   MIDI_CLASS_OTHER,          // Program changes, system and long messages.
+   MIDI_CLASS_NOTE,           // Note on.
+   MIDI_CLASS_ESSENTIAL,      // Note off and the all-sound/notes-off controllers.
+   MIDI_CLASS_COUNT
+};
+
 /* struct MidiMessage */
 struct MidiMessage
 {
-   jack_port_t    *port;
-   jack_nframes_t  time;
-   int             len;
+   frametime_t     time;
+   uint16_t        port;      // Output port index (see JackEngine::registerOutputPort).
+   uint8_t         len;       // Number of inline bytes; 0 for pooled data, whose size is in the pool.
+   uint8_t         flags;
 
-   unsigned char   data[3];
+   union
+   {
+      unsigned char data[MIDI_MSG_INLINE];
+      uint32_t      handle;   // PayloadPool handle if MIDI_MSG_POOLED is set.
+   };
 
    /* Construct the message with the given midi data. */
-   MidiMessage(int b0, int b1, int b2, jack_nframes_t tm, unsigned channel = 0, jack_port_t *p = NULL);
+   MidiMessage(int b0, int b1, int b2, frametime_t tm, unsigned channel = 0, unsigned p = 0);
 
    /* Create the message with null data */
    MidiMessage();
+
+   /* Construct a message referring to a pooled payload. */
+   static MidiMessage pooled(uint32_t h, frametime_t tm, unsigned p = 0);
+
+   /* Is the data kept in the payload pool. */
+   bool isPooled() const;
+
+   /* The delivery class of the message. */
+   MidiClass deliveryClass() const;
+
+   /* The channel and key number of a note on or off, below MIDI_NOTE_KEYS; -1 for the other messages. */
+   int noteKey() const;
+
+   /* The controller set by a message of the control class, below MIDI_CONTROL_KEYS; only the latest
+      value of each matters. -1 for the other classes. */
+   int controlKey() const;
 };
 
+static_assert(sizeof(MidiMessage) == 16, "MidiMessage is expected to be packed into 16 bytes");
+
 #endif
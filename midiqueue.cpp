@@ -0,0 +1,281 @@
+#include "midiqueue.h"
+
+#include "midiheap.h"
+#include "timingwheel.h"
+
+/*****************************************************************************************************/
+/* Constructor. Preallocates the space for s messages per port.
+   The scheduler type defines the ordered storage for the ports. */
+MidiQueue::MidiQueue(size_t s, SchedulerType type)
+   : mFreeChunks(NULL)
+   , mChunkCount(0)
+   , mCount(0)
+   , mHighWater(0)
+   , mProducerStalls(0)
+   , mPushed(0)
+{
+   mSchedulerType = type;
+   mShardSize = s;
+   shardFor(0);
+
+   for (size_t i = 0; i < s; i += QUEUE_CHUNK_SIZE)
+   {
+      Chunk *c = new Chunk;
+      mChunkCount ++;
+      freeChunk(c);
+   }
+
+   mTailChunk = mHeadChunk = allocChunk();
+   mTailPos = mHeadPos = 0;
+   mWritten = 0;
+   mRead = 0;
+}
+
+/*****************************************************************************************************/
+/* Destructor. */
+MidiQueue::~MidiQueue()
+{
+   for (size_t i = 0; i < mShards.size(); i ++)
+      delete mShards[i];
+
+   Chunk *c = mHeadChunk;
+   while (c != NULL)
+   {
+      Chunk *next = c->next.load();
+      delete c;
+      c = next;
+   }
+
+   c = mFreeChunks.load();
+   while (c != NULL)
+   {
+      Chunk *next = c->nextFree;
+      delete c;
+      c = next;
+   }
+}
+
+/*****************************************************************************************************/
+/* Take a chunk from the free list or allocate a new one.
+   Only the producer takes the chunks, so the list is safe from ABA. */
+MidiQueue::Chunk* MidiQueue::allocChunk()
+{
+   Chunk *c = mFreeChunks.load(std::memory_order_acquire);
+   while (c != NULL && !mFreeChunks.compare_exchange_weak(c, c->nextFree,
+            std::memory_order_acquire, std::memory_order_acquire));
+
+   if (c == NULL)
+   {
+      mProducerStalls.fetch_add(1, std::memory_order_relaxed);
+      c = new Chunk;
+      mChunkCount.fetch_add(1, std::memory_order_relaxed);
+   }
+
+   c->next.store(NULL, std::memory_order_relaxed);
+   return c;
+}
+
+/*****************************************************************************************************/
+/* Return a drained chunk to the free list. */
+void MidiQueue::freeChunk(Chunk *c)
+{
+   c->nextFree = mFreeChunks.load(std::memory_order_relaxed);
+   while (!mFreeChunks.compare_exchange_weak(c->nextFree, c,
+            std::memory_order_release, std::memory_order_relaxed));
+}
+
+/*****************************************************************************************************/
+/* Producer side. Write a message to the inbox without publishing it. */
+inline void MidiQueue::write(const MidiMessage &msg)
+{
+   // The current chunk is full; link a new one.
+   if (mTailPos == QUEUE_CHUNK_SIZE)
+   {
+      Chunk *c = allocChunk();
+      mTailChunk->next.store(c, std::memory_order_release);
+      mTailChunk = c;
+      mTailPos = 0;
+   }
+
+   mTailChunk->msgs[mTailPos ++] = msg;
+}
+
+/*****************************************************************************************************/
+/* Producer side. Make n written messages visible to the consumer. */
+inline void MidiQueue::publish(size_t n)
+{
+   size_t count = mCount.fetch_add(n, std::memory_order_relaxed) + n;
+   if (count > mHighWater.load(std::memory_order_relaxed))
+      mHighWater.store(count, std::memory_order_relaxed);
+   mPushed.fetch_add(n, std::memory_order_relaxed);
+
+   mWritten.store(mWritten.load(std::memory_order_relaxed) + n, std::memory_order_release);
+}
+
+/*****************************************************************************************************/
+/* Producer side. Add a message; never waits. */
+void MidiQueue::push(const MidiMessage &msg)
+{
+   write(msg);
+   publish(1);
+}
+
+/*****************************************************************************************************/
+/* Producer side. Add n messages at once; the consumer sees them all together. */
+void MidiQueue::push(const MidiMessage *msgs, size_t n)
+{
+   for (size_t i = 0; i < n; i ++)
+      write(msgs[i]);
+   publish(n);
+}
+
+/*****************************************************************************************************/
+/* Return the scheduler for the port. */
+MidiScheduler* MidiQueue::shardFor(unsigned port)
+{
+   // The first message for this port.
+   while (port >= mShards.size())
+   {
+      if (mSchedulerType == SCHEDULER_WHEEL)
+         mShards.push_back(new TimingWheel(mShardSize));
+      else
+         mShards.push_back(new MidiHeap(mShardSize));
+   }
+
+   return mShards[port];
+}
+
+/*****************************************************************************************************/
+/* Move the messages from the inbox to the schedulers. */
+void MidiQueue::drainInbox()
+{
+   size_t written = mWritten.load(std::memory_order_acquire);
+
+   while (mRead != written)
+   {
+      // Move to the next chunk; the producer has linked it before publishing its messages.
+      if (mHeadPos == QUEUE_CHUNK_SIZE)
+      {
+         Chunk *c = mHeadChunk;
+         mHeadChunk = c->next.load(std::memory_order_acquire);
+         mHeadPos = 0;
+         freeChunk(c);
+      }
+
+      const MidiMessage &msg = mHeadChunk->msgs[mHeadPos ++];
+      shardFor(msg.port)->insert(msg);
+      mRead ++;
+   }
+}
+
+/*****************************************************************************************************/
+/* Consumer side. Pop all the messages due not later than the given time into the array,
+   in the time order. Returns the number of messages written into out.
+   The ports are merged by time; the messages of one port with the same time go in a row. */
+size_t MidiQueue::popUntil(frametime_t time, MidiMessage *out, size_t max)
+{
+   size_t n = 0;
+
+   drainInbox();
+
+   while (n < max)
+   {
+      // Find the earliest port and the time of the next port after it.
+      MidiScheduler *best = NULL;
+      frametime_t bestTime = 0;
+      frametime_t limit = time;
+
+      for (size_t i = 0; i < mShards.size(); i ++)
+      {
+         if (mShards[i]->count() == 0)
+            continue;
+
+         frametime_t t = mShards[i]->peekMin().time;
+         if (t > time)
+            continue;
+
+         if (best == NULL || t < bestTime)
+         {
+            if (best != NULL)
+               limit = bestTime;
+            best = mShards[i];
+            bestTime = t;
+         }
+         else if (t < limit)
+            limit = t;
+      }
+
+      if (best == NULL)
+         break;
+
+      // Take the run of the earliest port until another port goes first.
+      do
+         out[n ++] = best->popMin();
+      while (n < max && best->count() > 0 && best->peekMin().time <= limit);
+   }
+
+   mCount.fetch_sub(n, std::memory_order_relaxed);
+   return n;
+}
+
+/*****************************************************************************************************/
+/* Consumer side. Get the time of the earliest message. Returns false if there are none. */
+bool MidiQueue::nextTime(frametime_t &time)
+{
+   bool bFound = false;
+
+   drainInbox();
+
+   for (size_t i = 0; i < mShards.size(); i ++)
+   {
+      if (mShards[i]->count() == 0)
+         continue;
+
+      frametime_t t = mShards[i]->peekMin().time;
+      if (!bFound || t < time)
+         time = t;
+      bFound = true;
+   }
+
+   return bFound;
+}
+
+/*****************************************************************************************************/
+/* Consumer side. Are there messages in the inbox that were not yet taken into account. */
+bool MidiQueue::hasUnread()
+{
+   return mWritten.load(std::memory_order_acquire) != mRead;
+}
+
+/*****************************************************************************************************/
+/* The number of messages waiting in the queue. */
+size_t MidiQueue::count()
+{
+   return mCount.load(std::memory_order_relaxed);
+}
+
+/*****************************************************************************************************/
+/* The maximal number of messages that were waiting in the queue. */
+size_t MidiQueue::highWater()
+{
+   return mHighWater.load(std::memory_order_relaxed);
+}
+
+/*****************************************************************************************************/
+/* The number of messages the inbox arena can hold without allocating. */
+size_t MidiQueue::capacity()
+{
+   return mChunkCount.load(std::memory_order_relaxed) * QUEUE_CHUNK_SIZE;
+}
+
+/*****************************************************************************************************/
+/* Contention counters. */
+uint64_t MidiQueue::producerStalls()
+{
+   return mProducerStalls.load(std::memory_order_relaxed);
+}
+
+uint64_t MidiQueue::pushed()
+{
+   return mPushed.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,110 @@
+#ifndef MIDIQUEUE_H
+#define MIDIQUEUE_H
+
+#include <atomic>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "midimessage.h"
+#include "midischeduler.h"
+
+#define QUEUE_CHUNK_SIZE               256      // Number of messages in one arena chunk.
+
+/*******************************************************************************************/
+/* Lock-free time-ordered scheduling queue.
+   One producer thread (the sequencer) pushes the messages into a wait-free inbox; one consumer
+   thread (the dispatcher) moves them into its private schedulers and pops the due ones.
+   No locks are shared between the two sides.
+   Every port has its own scheduler, so a flood of messages on one port does not slow down
+   the others. The due messages of all ports are merged by time when popping.
+   The inbox is a linked list of fixed-size chunks. It grows without moving the existing
+   messages and never blocks the producer; drained chunks go back to a free list. */
+class MidiQueue
+{
+   private:
+      /* A piece of the inbox arena. */
+      struct Chunk
+      {
+         MidiMessage          msgs[QUEUE_CHUNK_SIZE];
+         std::atomic<Chunk*>  next;             // Next chunk in the inbox.
+         Chunk               *nextFree;         // Next chunk in the free list.
+      };
+
+      Chunk                *mTailChunk;        // Producer side position.
+      size_t                mTailPos;
+      Chunk                *mHeadChunk;        // Consumer side position.
+      size_t                mHeadPos;
+      std::atomic<size_t>   mWritten;          // Total number of messages written to the inbox.
+      size_t                mRead;             // Total number of messages read from the inbox.
+      std::atomic<Chunk*>   mFreeChunks;       // Drained chunks ready for reuse.
+      std::atomic<size_t>   mChunkCount;       // Number of allocated chunks.
+
+      std::atomic<size_t>   mCount;            // Messages pushed but not yet popped.
+      std::atomic<size_t>   mHighWater;        // Maximal value of mCount.
+      SchedulerType         mSchedulerType;
+      size_t                mShardSize;        // Preallocated size of a scheduler.
+      std::vector<MidiScheduler*>
+                            mShards;           // Ordered storage per port index, owned by the consumer.
+
+      std::atomic<uint64_t> mProducerStalls;   // How many times the producer had to allocate memory.
+      std::atomic<uint64_t> mPushed;           // Total number of pushed messages.
+
+      /* Take a chunk from the free list or allocate a new one. */
+      Chunk* allocChunk();
+
+      /* Return a drained chunk to the free list. */
+      void freeChunk(Chunk *c);
+
+      /* Producer side. Write a message to the inbox without publishing it. */
+      inline void write(const MidiMessage &msg);
+
+      /* Producer side. Make n written messages visible to the consumer. */
+      inline void publish(size_t n);
+
+      /* Return the scheduler for the port. */
+      MidiScheduler* shardFor(unsigned port);
+
+      /* Move the messages from the inbox to the schedulers. */
+      void drainInbox();
+
+   public:
+      /* Constructor. Preallocates the space for s messages per port.
+         The scheduler type defines the ordered storage for the ports. */
+      MidiQueue(size_t s, SchedulerType type);
+
+      /* Destructor. */
+      ~MidiQueue();
+
+      /* Producer side. Add a message; never waits. */
+      void push(const MidiMessage &msg);
+
+      /* Producer side. Add n messages at once; the consumer sees them all together. */
+      void push(const MidiMessage *msgs, size_t n);
+
+      /* Consumer side. Pop all the messages due not later than the given time into the array,
+         in the time order. Returns the number of messages written into out. */
+      size_t popUntil(frametime_t time, MidiMessage *out, size_t max);
+
+      /* Consumer side. Get the time of the earliest message. Returns false if there are none. */
+      bool nextTime(frametime_t &time);
+
+      /* Consumer side. Are there messages in the inbox that were not yet taken into account. */
+      bool hasUnread();
+
+      /* The number of messages waiting in the queue. */
+      size_t count();
+
+      /* The maximal number of messages that were waiting in the queue. */
+      size_t highWater();
+
+      /* The number of messages the inbox arena can hold without allocating. */
+      size_t capacity();
+
+      /* Contention counters. */
+      uint64_t producerStalls();
+      uint64_t pushed();
+};
+
+#endif
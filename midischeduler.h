@@ -0,0 +1,36 @@
+#ifndef MIDISCHEDULER_H
+#define MIDISCHEDULER_H
+
+#include <stddef.h>
+
+#include "midimessage.h"
+
+/* Available implementations of the event scheduler. */
+enum SchedulerType
+{
+   SCHEDULER_HEAP,
+   SCHEDULER_WHEEL
+};
+
+/*******************************************************************************************/
+/* Time-ordered storage of the midi messages. The implementations are not synchronized;
+   they are owned by the consumer side of MidiQueue. */
+class MidiScheduler
+{
+   public:
+      virtual ~MidiScheduler() {}
+
+      /* Add a new element while maintaining the order. The storage grows if needed. */
+      virtual void insert(const MidiMessage &msg) = 0;
+
+      /* Pop the minimal element. The scheduler must not be empty. */
+      virtual MidiMessage popMin() = 0;
+
+      /* Look the minimal element without removing it. The scheduler must not be empty. */
+      virtual const MidiMessage& peekMin() = 0;
+
+      /* The number of elements available in the buffer. */
+      virtual size_t count() = 0;
+};
+
+#endif
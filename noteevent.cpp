@@ -1,8 +1,7 @@
 #include "events.h"
 
-#include <sstream>
-
 #include "jackengine.h"
+#include "lexer.h"
 #include "sequencer.h"
 
 /*****************************************************************************************************/
@@ -31,10 +30,18 @@ NoteEvent::NoteEvent()
 /*****************************************************************************************************/
 /* Constructor that parses the note from the string. */
 NoteEvent::NoteEvent(const std::string &buf, unsigned aColumn)
+   : NoteEvent(buf.data(), buf.length(), aColumn)
+{
+}
+
+/*****************************************************************************************************/
+/* Constructor that parses the note from a piece of text. */
+NoteEvent::NoteEvent(const char *buf, size_t len, unsigned aColumn)
 {
    column = aColumn;
    const int octaveLen = 12;
    natural = false;
+   endless = false;
 
    pitch = 0;
    volume = (unsigned)-1;
@@ -44,13 +51,13 @@ NoteEvent::NoteEvent(const std::string &buf, unsigned aColumn)
    partDelay = 0;
    partDiv = 1;
 
-   std::istringstream iss (buf);
+   Lexer lex (buf, len);
 
-   if (buf.length() == 0)
+   if (len == 0)
       throw 0;
 
    // The note.
-   switch (toupper(iss.get()))
+   switch (toupper(lex.get()))
    {
       case 'C':
          pitch = 0;
@@ -85,25 +92,25 @@ NoteEvent::NoteEvent(const std::string &buf, unsigned aColumn)
    }
 
    // Check for Flat or Sharp modifer
-   if (iss.peek() == '#')
+   if (lex.peek() == '#')
    {
-      iss.get();
+      lex.get();
       pitch ++;
    }
-   if (iss.peek() == 'b' || iss.peek() == '&')
+   if (lex.peek() == 'b' || lex.peek() == '&')
    {
-      iss.get();
+      lex.get();
       pitch --;
    }
-   if (iss.peek() == 'n')
+   if (lex.peek() == 'n')
    {
-      iss.get();
+      lex.get();
       natural = true;
    }
 
    // Read the octave number:
    unsigned octave = 0;
-   if (iss >> octave)
+   if (lex.next(octave))
       pitch += (octave + 1) * octaveLen;
    else
       // Default is fourth octave
@@ -111,37 +118,37 @@ NoteEvent::NoteEvent(const std::string &buf, unsigned aColumn)
 
    // Read possible modifiers:
    char c = 0;
-   iss.clear();
-   while ((c = iss.get()) != EOF && c != ' ' && c != '\t')
+   lex.clear();
+   while ((c = lex.get()) != EOF && c != ' ' && c != '\t')
    {
       switch (c)
       {
          case '@':
             // Playing time modifier
-            iss >> time;
+            lex.next(time);
             break;
 
          case '%':
             // Delay time modifier
-            iss >> delay;
+            lex.next(delay);
             break;
 
          case '+':
             // Playing time in parts of the current note length.
-            iss >> partDelay;
+            lex.next(partDelay);
             break;
 
          case '/':
-            iss >> partDiv;
+            lex.next(partDiv);
             break;
 
          case ':':
-            iss >> partTime;
+            lex.next(partTime);
             break;
 
          case '!':
             // Volume modifier.
-            iss >> volume;
+            lex.next(volume);
             break;
 
          case '.':
@@ -185,9 +192,9 @@ ControlFlow NoteEvent::execute(JackEngine *jack, Sequencer *seq)
    PortMap pm = seq->getPortMap(column);
       
    // Queue the note on event.
-   jack->queueMidiEvent(MIDI_NOTE_ON, pitch, volume,
+   seq->queueMidiEvent(MIDI_NOTE_ON, pitch, volume,
          seq->getCurrentTime() + jack->msToNframes(delay)
-         + (partDiv != 0 ? (jack->msToNframes(60 * 1000 / seq->getTempo() / seq->getQuant()) * partDelay / partDiv) : 0)
+         + seq->linesToFrames(partDelay, partDiv)
          + column,
          pm.channel, pm.port);
 
@@ -195,13 +202,10 @@ ControlFlow NoteEvent::execute(JackEngine *jack, Sequencer *seq)
    {
       // If the note has specific time, schedule the off event right now.
       ret.bNeedsStopping = false;
-      jack->queueMidiEvent(MIDI_NOTE_OFF, pitch, volume,
+      seq->queueMidiEvent(MIDI_NOTE_OFF, pitch, volume,
             seq->getCurrentTime() + jack->msToNframes(delay)
-            + (partDiv != 0 ? (jack->msToNframes(60 * 1000 / seq->getTempo() / seq->getQuant())
-                  * partDelay / partDiv) : 0)
             + jack->msToNframes(time)
-            + (partDiv != 0 ? (jack->msToNframes(60 * 1000 / seq->getTempo() / seq->getQuant())
-                  * partTime / partDiv) : 0) - 2,
+            + seq->linesToFrames(partDelay + partTime, partDiv) - 2,
             pm.channel, pm.port);
    }
 
@@ -213,6 +217,6 @@ ControlFlow NoteEvent::execute(JackEngine *jack, Sequencer *seq)
 void NoteEvent::stop(JackEngine *jack, Sequencer *seq)
 {
    trace("note stop col%x pitch%x\n", column, pitch);
-   jack->queueMidiEvent(MIDI_NOTE_OFF, pitch, 0, seq->getCurrentTime() - 1 - column,
+   seq->queueMidiEvent(MIDI_NOTE_OFF, pitch, 0, seq->getCurrentTime() - 1 - column,
          seq->getPortMap(column).channel, seq->getPortMap(column).port);
 }
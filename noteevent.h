@@ -30,6 +30,9 @@ struct NoteEvent : public Event
    /* Constructor that parses the note from the string. */
    NoteEvent(const std::string &buf, unsigned aColumn = 0);
 
+   /* Constructor that parses the note from a piece of text. */
+   NoteEvent(const char *buf, size_t len, unsigned aColumn = 0);
+
    /* Destructor. */
    ~NoteEvent();
 
@@ -1,12 +1,12 @@
 #include "parser.h"
 
-#include <sstream>
 #include <climits>
 
 #include <assert.h>
 
 #include "jackengine.h"
 #include "events.h"
+#include "lexer.h"
 #include "midictlevent.h"
 
 /*****************************************************************************************************/
@@ -33,18 +33,18 @@ Parser::~Parser()
 }
 
 /*****************************************************************************************************/
-/* Trim a text string from both ends. */
-std::string Parser::trim(std::string s)
+/* Trim a text from both ends. Like it always did, a single character trims to nothing. */
+TextSpan Parser::trim(TextSpan s)
 {
    if (s.empty())
       return s;   // Empty string.
-   unsigned a = 0, b = s.length() - 1;
+   size_t a = 0, b = s.len - 1;
 
-   while (a < b && isblank(s[a])) a ++;
-   while (a < b && isblank(s[b])) b --;
+   while (a < b && isblank((unsigned char)s.ptr[a])) a ++;
+   while (a < b && isblank((unsigned char)s.ptr[b])) b --;
 
-   if (a == b) return "";
-   else return s.substr(a, b - a + 1);
+   if (a == b) return TextSpan();
+   else return s.sub(a, b - a + 1);
 }
 
 /*****************************************************************************************************/
@@ -56,294 +56,467 @@ void Parser::setSubseqMap(std::map<std::string, Sequencer*> *subseq)
 
 /*****************************************************************************************************/
 /* Parse a text line. */
-EventListT Parser::parseLine(std::string line)
+EventListT Parser::parseLine(const std::string &line)
+{
+   return parseLine(line.data(), line.length());
+}
+
+/*****************************************************************************************************/
+/* Parse a text line. The tokens are read in place; only the events are allocated. */
+EventListT Parser::parseLine(const char *text, size_t length)
+{
+   if (!lexLine(text, length, mLine))
+      return parseDirective(text, length);
+
+   return parseNotes(mLine);
+}
+
+/*****************************************************************************************************/
+/* Parse a lexed line. */
+EventListT Parser::parseLine(LexedLine &line)
+{
+   if (!line.notes)
+      return parseDirective(line.text, line.length);
+
+   return parseNotes(line);
+}
+
+/*****************************************************************************************************/
+/* Is the word a directive. The directives are told by the first byte and the length. */
+static bool isDirective(const TextSpan &word)
+{
+   switch (word.front())
+   {
+      case 'd': return word.is("define") || word.is("default");
+      case 'e': return word.is("end") || word.is("endloop");
+      case 'v': return word.is("volume");
+      case 't': return word.is("tempo") || word.is("transpose");
+      case 'w': return word.is("wait");
+      case 'p': return word.is("port");
+      case 'a': return word.is("alias");
+      case 'l': return word.is("loop");
+   }
+   return false;
+}
+
+/*****************************************************************************************************/
+/* Decode a word as a note or a control. The SysEx data goes to the payload pool, which only the
+   parser thread may fill, so it is left for the parser. */
+static void decodeToken(NoteToken &t)
+{
+   t.decoded = false;
+   t.event = NULL;
+
+   if (t.text.is(".") || t.text.is("|") || t.text.is("*") || t.text.is("^") || t.text.startsWith("$sx="))
+      return;
+
+   t.decoded = true;
+   try
+   {
+      if (t.text.front() == '$')
+         t.event = new MidiCtlEvent(t.text.ptr, t.text.len, t.column);
+      else
+         t.event = new NoteEvent(t.text.ptr, t.text.len);
+   }
+   catch (int e)
+   {
+      // Invalid; reported if the word is still used after the aliases.
+   }
+}
+
+/*****************************************************************************************************/
+/* Split a note line into words. */
+bool Parser::lexLine(const char *text, size_t length, LexedLine &line)
+{
+   line.text = text;
+   line.length = length;
+   line.notes = false;
+   line.tokens.clear();
+
+   // Empty lines and bars.
+   if (length == 0 || text[0] == '-')
+      return false;
+
+   TextSpan chunk;
+   Lexer iss (text, length);
+
+   iss.next(chunk);
+   if (isDirective(chunk))
+      return false;
+
+   line.notes = true;
+
+   bool bGrouped = false;
+   unsigned column = 0;
+   iss.seek(0);
+   iss.clear();
+   while (iss.next(chunk))
+   {
+      NoteToken t;
+      t.column = column;
+      t.pos = (int)iss.tell();
+      t.comment = chunk.len == 0 || chunk.ptr[0] == ';';
+      t.decoded = false;
+      t.event = NULL;
+
+      // Comment.
+      if (t.comment)
+      {
+         line.tokens.push_back(t);
+         break;
+      }
+
+      // If a grouping.
+      if (chunk.front() == '(')
+      {
+         bGrouped = true;
+         chunk = chunk.sub(1);
+      }
+      else if (chunk.back() == ')')
+      {
+         bGrouped = false;
+         chunk = chunk.sub(0, chunk.len - 1);
+      }
+
+      t.text = chunk;
+      decodeToken(t);
+      line.tokens.push_back(t);
+
+      if (!bGrouped)
+         column ++;
+   }
+
+   return true;
+}
+
+/*****************************************************************************************************/
+/* Parse a directive or a bar. */
+EventListT Parser::parseDirective(const char *text, size_t length)
 {
    JackEngine *jack = JackEngine::instance();
 
    mLinePos = 0;
 
-   std::string chunk;          // A piece of the line to read the command.
-   std::istringstream iss (line);
+   TextSpan chunk;             // A piece of the line to read the command.
+   Lexer iss (text, length);
    EventListT eventList;
 
    // Return the empty list if the line is empty.
-   if (line.length() == 0)
+   if (length == 0)
       return eventList;
 
    // A bar; find a number to identify the new size
-   if (line[0] == '-')
+   if (text[0] == '-')
    {
       BarEvent *b;
-      unsigned i = 1;
+      size_t i = 1;
       unsigned n = 0, d = 0;        // Nominator and divisor for the new size.
       char c = 0;
 
       // Skip all '-'.
-      while (i < line.length() && line[i] == '-')
+      while (i < length && text[i] == '-')
          i ++;
 
-      std::istringstream barIss (line.substr(i));
+      Lexer barIss (text + i, length - i);
 
-      if (barIss >> n && barIss >> c && barIss >> d)
+      if (barIss.next(n) && barIss.next(c) && barIss.next(d))
          b = new BarEvent(n, d);
       else
       {
          b = new BarEvent(0, 0);
          barIss.clear();
-         barIss.seekg(0);
+         barIss.seek(0);
       }
       eventList.push_back(b);
 
       // Get the signs if any.
-      while (barIss >> chunk)
+      while (barIss.next(chunk))
       {
          int mod = INT_MAX;
 
-         if (chunk[0] == '#')
+         if (chunk.ptr[0] == '#')
             mod = +1;
-         else if (chunk[0] == 'b' || chunk[0] == '&')
+         else if (chunk.ptr[0] == 'b' || chunk.ptr[0] == '&')
             mod = -1;
-         else if (chunk[0] == 'n')
+         else if (chunk.ptr[0] == 'n')
             mod = 0;
 
          // If the modifier is unchanged, then we should skip this.
          if (mod == INT_MAX)
             continue;
 
-         NoteEvent n (chunk.substr(1));
+         NoteEvent n (chunk.ptr + 1, chunk.len - 1);
          mSigns->at(n.pitch % 12) = mod;
       }
 
       return eventList;
    }
 
-   // Process the line word by word next.
-   iss >> chunk;
+   // Process the line word by word next. The directives are told by the first byte and the length.
+   iss.next(chunk);
 
-   // If this is a beginning of a sub-pattern.
-   if (chunk == "define")
+   switch (chunk.front())
    {
-      std::string name;
-      if (iss >> name)
-         eventList.push_back(new SubpatternBeginEvent(name));
+      case 'd':
+         // If this is a beginning of a sub-pattern.
+         if (chunk.is("define"))
+         {
+            TextSpan name;
+            if (iss.next(name))
+               eventList.push_back(new SubpatternBeginEvent(name.str()));
 
-      return eventList;
-   }
+            return eventList;
+         }
 
-   // End of sub-pattern definition.
-   if (chunk == "end")
-   {
-      eventList.push_back(new SubpatternEndEvent());
-      return eventList;
-   }
+         // Set the default note.
+         if (chunk.is("default"))
+         {
+            iss.next(chunk);
+            try
+            {
+               NoteEvent n (chunk.ptr, chunk.len);
+               mDfltNote.set(n.pitch, n.volume, n.time, n.delay);
+            }
+            catch (int e)
+            {
+               throw (int)iss.tell();
+            }
 
-   // Set the default note.
-   if (chunk == "default")
-   {
-      iss >> chunk;
-      try 
-      {
-         NoteEvent n (chunk);
-         mDfltNote.set(n.pitch, n.volume, n.time, n.delay);
-      }
-      catch (int e)
-      {
-         throw (int)iss.tellg();
-      }
+            return eventList;
+         }
+         break;
 
-      return eventList;
-   }
+      case 'e':
+         // End of sub-pattern definition.
+         if (chunk.is("end"))
+         {
+            eventList.push_back(new SubpatternEndEvent());
+            return eventList;
+         }
 
-   // Set the default volume.
-   if (chunk == "volume")
-   {
-      iss >> mVolume;
-      return eventList;
-   }
+         // End of a loop.
+         if (chunk.is("endloop"))
+         {
+            eventList.push_back(new EndLoopEvent());
+            return eventList;
+         }
+         break;
 
-   // Set the tempo.
-   if (chunk == "tempo")
-   {
-      unsigned tempo;
-      if (iss >> tempo)
-         eventList.push_back(new TempoEvent(tempo));
-      return eventList;
-   }
+      case 'v':
+         // Set the default volume.
+         if (chunk.is("volume"))
+         {
+            iss.next(mVolume);
+            return eventList;
+         }
+         break;
 
-   // Transposition.
-   if (chunk == "transpose")
-   {
-      iss >> mTranspose;
-      return eventList;
-   }
+      case 't':
+         // Set the tempo.
+         if (chunk.is("tempo"))
+         {
+            unsigned tempo;
+            if (iss.next(tempo))
+               eventList.push_back(new TempoEvent(tempo));
+            return eventList;
+         }
 
-   // Wait.
-   if (chunk == "wait")
-   {
-      size_t n;
-      iss >> n;
-      eventList.push_back(new WaitEvent(n));
-      return eventList;
-   }
+         // Transposition.
+         if (chunk.is("transpose"))
+         {
+            iss.next(mTranspose);
+            return eventList;
+         }
+         break;
 
-   // Register the port.
-   if (chunk == "port")
-   {
-      unsigned columnA, columnB;    // Column number range to associate.
-      std::string portName;         // The name of a port to create.
-      unsigned channel;             // Channel number to use.
-      std::string connClient;       // The client name to try to connect to.
+      case 'w':
+         // Wait.
+         if (chunk.is("wait"))
+         {
+            size_t n = 0;
+            iss.next(n);
+            eventList.push_back(new WaitEvent(n));
+            return eventList;
+         }
+         break;
 
-      // Mandatory parameters.
-      if (!(iss >> columnA))
-         throw (int)iss.tellg();
+      case 'p':
+         // Register the port.
+         if (chunk.is("port"))
+         {
+            unsigned columnA, columnB;    // Column number range to associate.
+            TextSpan portName;            // The name of a port to create.
+            unsigned channel = 0;         // Channel number to use.
+
+            // Mandatory parameters.
+            if (!iss.next(columnA))
+               throw (int)iss.tell();
+
+            // Second column number is optional.
+            if (!iss.next(columnB))
+            {
+               columnB = columnA;
+               iss.clear();
+            }
 
-      // Second column number is optional.
-      if (!(iss >> columnB))
-      {
-         columnB = columnA;
-         iss.clear();
-      }
+            // The port name is mandatory.
+            if (!iss.next(portName))
+               throw (int)iss.tell();
 
-      // The port name is mandatory.
-      if (!(iss >> portName))
-         throw (int)iss.tellg();
+            // Optional parameters.
+            iss.next(channel);
 
-      // Optional parameters.
-      iss >> channel;
+            // Create the port.
+            unsigned port = jack->registerOutputPort(portName.str());
 
-      // Create the port.
-      jack_port_t *port = jack->registerOutputPort(portName);
+            // Associate the columns.
+            if (mColumnMap.size() < columnB)
+               mColumnMap.resize(columnB);
 
-      // Associate the columns.
-      if (mColumnMap.size() < columnB)
-         mColumnMap.resize(columnB);
+            for (unsigned i = columnA; i <= columnB; i ++)
+               mColumnMap[i - 1] = PortMap(channel, port);
 
-      for (unsigned i = columnA; i <= columnB; i ++)
-         mColumnMap[i - 1] = PortMap(channel, port);
+            // Try to link to the destination port: the rest of the line.
+            iss.clear();
+            TextSpan connClient = trim(iss.rest());
 
-      // Try to link to the destination port.
-      char c;
-      iss.clear();
-      while ((c = iss.get()) != EOF)
-         connClient += c;
-      connClient = trim(connClient);
+            if (!connClient.empty())
+               if (jack->connectPort(port, connClient.str()) != 0)
+                  std::cerr << "WARNING! Can not connect to client " << connClient.str() << std::endl;
 
-      if (!connClient.empty())
-         if (jack->connectPort(port, connClient) != 0)
-            std::cerr << "WARNING! Can not connect to client " << connClient << std::endl;
+            return eventList;
+         }
+         break;
 
-      return eventList;
-   }
+      case 'a':
+         // Learn a new alias.
+         if (chunk.is("alias"))
+         {
+            TextSpan alias, replacement;
 
-   // Learn a new alias.
-   if (chunk == "alias")
-   {
-      std::string alias, replacement;
+            if (!iss.next(alias))
+               throw (int)iss.tell();
 
-      if (!(iss >> alias))
-         throw (int)iss.tellg();
+            if (!iss.next(replacement))
+            {
+               mAliases.erase(alias.str());
+               return eventList;
+            }
 
-      if (!(iss >> replacement))
-      {
-         mAliases.erase(alias);
-         return eventList;
-      }
+            mAliases[alias.str()] = replacement.str();
+            return eventList;
+         }
+         break;
 
-      mAliases[alias] = replacement;
-      return eventList;
+      case 'l':
+         // Beginning of a loop.
+         if (chunk.is("loop"))
+         {
+            unsigned num;
+            if (iss.next(num))
+               eventList.push_back(new LoopEvent(num));
+            else
+               eventList.push_back(new LoopEvent());
+            return eventList;
+         }
+         break;
    }
 
-   // Beginning of a loop.
-   if (chunk == "loop")
-   {
-      unsigned num;
-      if (iss >> num)
-         eventList.push_back(new LoopEvent(num));
-      else
-         eventList.push_back(new LoopEvent());
-      return eventList;
-   }
+   return eventList;
+}
 
-   // End of a loop.
-   if (chunk == "endloop")
-   {
-      eventList.push_back(new EndLoopEvent());
-      return eventList;
-   }
+/*****************************************************************************************************/
+/* Parse the words of a note line. */
+EventListT Parser::parseNotes(LexedLine &line)
+{
+   EventListT eventList;
+   size_t i = 0;
 
-   // If nothing else, try to parse as a note
-   bool bGrouped = false;
-   unsigned column = 0;
-   iss.seekg(0);
-   iss.clear();
-   while (iss >> chunk)
+   try
    {
-      try
+      for (; i < line.tokens.size(); i ++)
       {
+         NoteToken &t = line.tokens[i];
+         TextSpan chunk = t.text;
+         unsigned column = t.column;
+         Event *decoded = t.event;
+         bool bDecoded = t.decoded;
+
+         t.event = NULL;
+
          // Comment line.
-         if (chunk.length() == 0 || chunk[0] == ';')
+         if (t.comment)
             return eventList;
 
-         // If a grouping.
-         if (chunk.front() == '(')
-         {
-            bGrouped = true;
-            chunk = chunk.substr(1);
-         }
-         else if (chunk.back() == ')')
-         {
-            bGrouped = false;
-            chunk = chunk.substr(0, chunk.length() - 1);
-         }
+         // An aliased name. The lookups reuse the key string; the names are short anyway.
+         size_t terminalPosition = chunk.findFirstOf("!%@/\\#.");
+         TextSpan aliasPart = chunk.sub(0, terminalPosition);
+         bool bSubpattern = false;
 
-         // An aliased name.
-         size_t terminalPosition = chunk.find_first_of("!%@/\\#.");
-         std::string aliasPart = chunk.substr(0, terminalPosition);
+         if (!mAliases.empty() || (mSubSeqMap != NULL && !mSubSeqMap->empty()))
+         {
+            mKey.assign(aliasPart.ptr, aliasPart.len);
+
+            std::map<std::string, std::string>::iterator it = mAliases.find(mKey);
+            if (it != mAliases.end())
+            {
+               mToken.assign(it->second);
+               if (terminalPosition != TextSpan::npos)
+                  mToken.append(chunk.ptr + terminalPosition, chunk.len - terminalPosition);
+               chunk = TextSpan(mToken.data(), mToken.length());
+
+               // The word has changed; decode it again.
+               delete decoded;
+               decoded = NULL;
+               bDecoded = false;
+            }
 
-         if (mAliases.find(aliasPart) != mAliases.end())
-            chunk.replace(0, terminalPosition, mAliases[aliasPart]);
+            bSubpattern = mSubSeqMap != NULL && mSubSeqMap->find(mKey) != mSubSeqMap->end();
+         }
 
          /*=== Starting the individual elements processing in `if ... else if...` . ===*/
 
          // A subpattern by name.
-         if (mSubSeqMap != NULL && mSubSeqMap->find(aliasPart) != mSubSeqMap->end())
+         if (bSubpattern)
          {
-            SubpatternPlayEvent *e = new SubpatternPlayEvent(mSubSeqMap->at(aliasPart), column);
+            delete decoded;
+            SubpatternPlayEvent *e = new SubpatternPlayEvent(mSubSeqMap->at(mKey), column);
             mLastNote[column] = e;
             eventList.push_back(e);
          }
 
          // Silent note.
-         else if (chunk == ".")
+         else if (chunk.is("."))
             eventList.push_back(new SkipEvent(column));
 
          // Continuing the previous note.
-         else if (chunk == "|")
+         else if (chunk.is("|"))
             eventList.push_back(new PedalEvent(column, mLastNote[column]));
 
          // Default note.
-         else if (chunk == "*")
+         else if (chunk.is("*"))
             eventList.push_back(mDfltNote.clone());
 
          // Previous note.
-         else if (chunk == "^")
+         else if (chunk.is("^"))
             eventList.push_back(mLastNote[column]);
 
+         // The decoding has failed.
+         else if (bDecoded && decoded == NULL)
+            throw t.pos;
+
          // A MIDI control message.
          else if (chunk.front() == '$')
          {
-            try {
-               eventList.push_back(new MidiCtlEvent(chunk, column));
-            } catch (int e) {
-               throw e + (int)iss.tellg();
-            }
+            if (!bDecoded)
+               decoded = new MidiCtlEvent(chunk.ptr, chunk.len, column);
+            eventList.push_back(decoded);
          }
 
          // And finally this must be a real note:
          else
          {
-            NoteEvent *n = new NoteEvent(chunk);
+            NoteEvent *n = bDecoded ? (NoteEvent*)decoded : new NoteEvent(chunk.ptr, chunk.len);
 
             // Aply modifiers.
             if (n->volume == (unsigned)-1)
@@ -360,12 +533,16 @@ EventListT Parser::parseLine(std::string line)
             eventList.push_back(n);
          }
       }
-      catch (int e)
+   }
+   catch (int e)
+   {
+      // The rest of the line is not used.
+      for (size_t j = i + 1; j < line.tokens.size(); j ++)
       {
-         throw (int) iss.tellg();
+         delete line.tokens[j].event;
+         line.tokens[j].event = NULL;
       }
-      if (!bGrouped)
-         column ++;
+      throw line.tokens[i].pos;
    }
 
    return eventList;
@@ -375,7 +552,7 @@ EventListT Parser::parseLine(std::string line)
 /* Return the column to port mapping. */
 PortMap& Parser::getPortMap(unsigned column)
 {
-   static PortMap dfltMap (0, NULL);
+   static PortMap dfltMap (0, 0);
    if (column >= mColumnMap.size())
       return dfltMap;
    return mColumnMap[column];
@@ -383,7 +560,7 @@ PortMap& Parser::getPortMap(unsigned column)
 
 /*****************************************************************************************************/
 /* Constructor for PortMap. */
-PortMap::PortMap(unsigned ch, jack_port_t *p)
+PortMap::PortMap(unsigned ch, unsigned p)
 {
    channel = ch;
    port = p;
@@ -394,5 +571,5 @@ PortMap::PortMap(unsigned ch, jack_port_t *p)
 PortMap::PortMap()
 {
    channel = 0;
-   port = NULL;
+   port = 0;
 }
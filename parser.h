@@ -11,6 +11,7 @@
 #include <jack/midiport.h>
 
 #include "events.h"
+#include "lexer.h"
 #include "noteevent.h"
 
 
@@ -22,12 +23,36 @@ class Sequencer;
 struct PortMap
 {
    unsigned channel;
-   jack_port_t *port;
+   unsigned port;          // Output port index.
 
-   PortMap(unsigned ch, jack_port_t *p);
+   PortMap(unsigned ch, unsigned p);
    PortMap();
 };
 
+/*******************************************************************************************/
+/* A word of a note line, decoded ahead of the parser state. */
+struct NoteToken
+{
+   TextSpan    text;          // Without the grouping parentheses.
+   unsigned    column;
+   int         pos;           // Position after the word; thrown on errors.
+   bool        comment;       // The rest of the line is a comment.
+   bool        decoded;       // A note or a control was decoded; invalid if the event is NULL.
+   Event      *event;         // Owned until the parser takes it.
+};
+
+/*******************************************************************************************/
+/* A line split into words by Parser::lexLine. */
+struct LexedLine
+{
+   const char             *text;
+   size_t                  length;
+   bool                    notes;      // A note line; the directives and the bars are parsed from the text.
+   std::vector<NoteToken>  tokens;
+
+   LexedLine() : text(""), length(0), notes(false) {}
+};
+
 /*******************************************************************************************/
 /* Parse an input line. */
 class Parser
@@ -44,10 +69,19 @@ class Parser
    size_t                  mLinePos;
    std::map<std::string, Sequencer*> 
       *mSubSeqMap;
+   std::string             mKey;          // Reused for the name lookups.
+   std::string             mToken;        // A token with the alias replaced.
+   LexedLine               mLine;         // Reused by the line by line parsing.
 
    private:
    /* Remove spaces at the beginning and the end of the string */
-   std::string trim(std::string s);
+   TextSpan trim(TextSpan s);
+
+   /* Parse a directive or a bar line. */
+   EventListT parseDirective(const char *text, size_t length);
+
+   /* Apply the parser state to the words of a note line. */
+   EventListT parseNotes(LexedLine &line);
 
    public:
    /* Create the parser. */
@@ -59,7 +93,18 @@ class Parser
    void setSubseqMap(std::map<std::string, Sequencer*> *subseq);
 
    /* Parse a given line (with one or multiple directives or patterns). */
-   EventListT parseLine(std::string line);
+   EventListT parseLine(const std::string &line);
+
+   /* Parse a line of the given length; it does not need the terminating zero. */
+   EventListT parseLine(const char *text, size_t length);
+
+   /* Parse a line split by lexLine. The decoded events are taken from the tokens. */
+   EventListT parseLine(LexedLine &line);
+
+   /* Split a note line into words and decode the notes and the controls. The result does not
+      depend on the parser state, so the lines may be lexed ahead on any thread. Returns false if
+      this is not a note line. */
+   static bool lexLine(const char *text, size_t length, LexedLine &line);
 
    /* Return a port to which the column matches. */
    PortMap& getPortMap(unsigned column);
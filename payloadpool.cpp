@@ -0,0 +1,109 @@
+#include "payloadpool.h"
+
+#include <string.h>
+
+#define NIL                            ((uint32_t) -1)
+
+/*****************************************************************************************************/
+/* Return the slot with the given handle. */
+inline PayloadPool::Slot& PayloadPool::slot(uint32_t h)
+{
+   return mChunks[h / PAYLOAD_CHUNK_SIZE][h % PAYLOAD_CHUNK_SIZE];
+}
+
+/*****************************************************************************************************/
+/* Put the slot to the free list. */
+void PayloadPool::pushFree(uint32_t h)
+{
+   Slot &s = slot(h);
+   s.nextFree = mFree.load(std::memory_order_relaxed);
+   while (!mFree.compare_exchange_weak(s.nextFree, h,
+            std::memory_order_release, std::memory_order_relaxed));
+}
+
+/*****************************************************************************************************/
+/* Add a chunk of slots to the free list. Returns false if the pool is at its limit. */
+bool PayloadPool::grow()
+{
+   size_t n = mChunkCount.load(std::memory_order_relaxed);
+   if (n >= PAYLOAD_MAX_CHUNKS)
+      return false;
+
+   mChunks[n] = new Slot[PAYLOAD_CHUNK_SIZE];
+   mChunkCount.store(n + 1, std::memory_order_release);
+
+   for (uint32_t i = 0; i < PAYLOAD_CHUNK_SIZE; i ++)
+   {
+      mChunks[n][i].refs = 0;
+      pushFree(n * PAYLOAD_CHUNK_SIZE + i);
+   }
+
+   return true;
+}
+
+/*****************************************************************************************************/
+/* Constructor. */
+PayloadPool::PayloadPool()
+   : mChunkCount(0)
+   , mFree(NIL)
+{
+   memset(mChunks, 0, sizeof(mChunks));
+}
+
+/*****************************************************************************************************/
+/* Destructor. */
+PayloadPool::~PayloadPool()
+{
+   for (size_t i = 0; i < mChunkCount; i ++)
+      delete[] mChunks[i];
+}
+
+/*****************************************************************************************************/
+/* Producer side. Copy the data into the pool. Returns the handle with one reference
+   or (uint32_t)-1 if the pool is exhausted.
+   Only the producer takes the slots, so the free list is safe from ABA. */
+uint32_t PayloadPool::store(const unsigned char *data, size_t len)
+{
+   uint32_t h = mFree.load(std::memory_order_acquire);
+   while (h != NIL && !mFree.compare_exchange_weak(h, slot(h).nextFree,
+            std::memory_order_acquire, std::memory_order_acquire));
+
+   if (h == NIL)
+   {
+      if (!grow())
+         return NIL;
+      return store(data, len);
+   }
+
+   Slot &s = slot(h);
+   s.bytes.assign(data, data + len);
+   s.refs.store(1, std::memory_order_release);
+   return h;
+}
+
+/*****************************************************************************************************/
+/* Add a reference. */
+void PayloadPool::retain(uint32_t h)
+{
+   slot(h).refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+/*****************************************************************************************************/
+/* Drop a reference; the slot goes back to the free list with the last one. RT safe. */
+void PayloadPool::release(uint32_t h)
+{
+   if (slot(h).refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      pushFree(h);
+}
+
+/*****************************************************************************************************/
+/* Access the payload. RT safe. */
+const unsigned char* PayloadPool::data(uint32_t h)
+{
+   return slot(h).bytes.data();
+}
+
+size_t PayloadPool::size(uint32_t h)
+{
+   return slot(h).bytes.size();
+}
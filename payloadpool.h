@@ -0,0 +1,64 @@
+#ifndef PAYLOADPOOL_H
+#define PAYLOADPOOL_H
+
+#include <atomic>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PAYLOAD_CHUNK_SIZE             64       // Payload slots per chunk.
+#define PAYLOAD_MAX_CHUNKS             1024
+
+/*******************************************************************************************/
+/* Reference counted storage for the long midi messages (SysEx).
+   The messages carry a handle instead of the data. Only the producer thread stores new
+   payloads; any thread, including the realtime one, may read and release them.
+   The released slots keep their memory for reuse. */
+class PayloadPool
+{
+   private:
+      /* A stored payload. */
+      struct Slot
+      {
+         std::atomic<int>           refs;
+         uint32_t                   nextFree;
+         std::vector<unsigned char> bytes;
+      };
+
+      Slot                 *mChunks[PAYLOAD_MAX_CHUNKS];
+      std::atomic<size_t>   mChunkCount;
+      std::atomic<uint32_t> mFree;         // Head of the free slots list.
+
+      /* Return the slot with the given handle. */
+      inline Slot& slot(uint32_t h);
+
+      /* Put the slot to the free list. */
+      void pushFree(uint32_t h);
+
+      /* Add a chunk of slots to the free list. Returns false if the pool is at its limit. */
+      bool grow();
+
+   public:
+      /* Constructor. */
+      PayloadPool();
+
+      /* Destructor. */
+      ~PayloadPool();
+
+      /* Producer side. Copy the data into the pool. Returns the handle with one reference
+         or (uint32_t)-1 if the pool is exhausted. */
+      uint32_t store(const unsigned char *data, size_t len);
+
+      /* Add a reference. */
+      void retain(uint32_t h);
+
+      /* Drop a reference; the slot goes back to the free list with the last one. RT safe. */
+      void release(uint32_t h);
+
+      /* Access the payload. RT safe. */
+      const unsigned char* data(uint32_t h);
+      size_t size(uint32_t h);
+};
+
+#endif
@@ -0,0 +1,277 @@
+#include "rawmidibackend.h"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "rtlog.h"
+
+#define RAW_XRUN_PERIODS               4        // A cycle this late is lost; a less late one catches up.
+#define RAW_PENDING_EVENTS             1024     // Preallocated events of a cycle.
+#define RAW_PENDING_BYTES              8192     // Preallocated data space of a cycle.
+
+/*****************************************************************************************************/
+/* The thread running the process cycles. */
+void* rawMidiThread(void *arg)
+{
+   ((RawMidiBackend*) arg)->run();
+   return NULL;
+}
+
+/*****************************************************************************************************/
+/* Microseconds of the monotonic clock. */
+static jack_time_t monotonicUsecs()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (jack_time_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*****************************************************************************************************/
+/* Constructor. */
+RawMidiBackend::RawMidiBackend(const std::string &destination, bool runningStatus,
+      jack_nframes_t sampleRate, jack_nframes_t bufferSize)
+   : VirtualBackend(sampleRate, bufferSize)
+{
+   mDestination = destination;
+   mFd = -1;
+   mbOwnFd = false;
+   mbRunningStatus = runningStatus;
+   mStatus = 0;
+   mStart.tv_sec = mStart.tv_nsec = 0;
+   mbRunning = false;
+   mbThread = false;
+   mXrunDelay = 0;
+   mWriteErrors = 0;
+}
+
+/*****************************************************************************************************/
+/* Open the destination. A FIFO blocks here until there is a reader. */
+void RawMidiBackend::open(JackEngine *engine)
+{
+   if (mDestination == "-")
+      mFd = STDOUT_FILENO;
+   else if (mDestination.compare(0, 3, "fd:") == 0)
+   {
+      const char *num = mDestination.c_str() + 3;
+      char *end;
+      errno = 0;
+      long fd = strtol(num, &end, 10);
+      mFd = (end == num || *end != '\0' || errno != 0 || fd < 0 || fd > INT_MAX) ? -1 : (int)fd;
+   }
+   else
+   {
+      mFd = ::open(mDestination.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      mbOwnFd = true;
+   }
+
+   if (mFd < 0)
+      throw "cannot open the MIDI output";
+
+   // A reader going away should not kill the player; the writes fail instead.
+   signal(SIGPIPE, SIG_IGN);
+
+   VirtualBackend::open(engine);
+
+   // The cycle thread only fills what is reserved here; a bigger cycle grows it once.
+   mPending.reserve(RAW_PENDING_EVENTS);
+   mPendingBytes.reserve(RAW_PENDING_BYTES);
+
+   // The frame 0 is now; the first cycle takes the events of the first period.
+   clock_gettime(CLOCK_MONOTONIC, &mStart);
+   mFrames = mBufferSize;
+}
+
+/*****************************************************************************************************/
+/* Start running the process cycles. */
+void RawMidiBackend::activate()
+{
+   mbRunning = true;
+   if (pthread_create(&mThread, NULL, rawMidiThread, this) != 0)
+      throw "cannot start the MIDI output thread";
+   mbThread = true;
+}
+
+/*****************************************************************************************************/
+/* Stop the cycles and close the destination. */
+void RawMidiBackend::close()
+{
+   mbRunning = false;
+   if (mbThread && !pthread_equal(mThread, pthread_self()))
+   {
+      pthread_join(mThread, NULL);
+      mbThread = false;
+   }
+
+   if (mbOwnFd && mFd >= 0)
+      ::close(mFd);
+   mFd = -1;
+
+   if (mWriteErrors > 0)
+      std::cerr << "WARNING! " << mWriteErrors << " MIDI messages could not be written." << std::endl;
+   mWriteErrors = 0;
+}
+
+/*****************************************************************************************************/
+/* The frames passed since the frame 0. */
+uint64_t RawMidiBackend::elapsedFrames()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   int64_t ns = (int64_t)(ts.tv_sec - mStart.tv_sec) * 1000000000 + (ts.tv_nsec - mStart.tv_nsec);
+   return ns < 0 ? 0 : (uint64_t)ns * mSampleRate / 1000000000;
+}
+
+/*****************************************************************************************************/
+/* The current frame time. */
+jack_nframes_t RawMidiBackend::frameTime()
+{
+   return (jack_nframes_t)elapsedFrames();
+}
+
+/*****************************************************************************************************/
+/* The current time in microseconds. */
+jack_time_t RawMidiBackend::time()
+{
+   return monotonicUsecs();
+}
+
+/*****************************************************************************************************/
+/* The time of the given frame in microseconds. */
+jack_time_t RawMidiBackend::frameToTime(jack_nframes_t frame)
+{
+   uint64_t now = elapsedFrames();
+   int64_t f = (int64_t)now + (int32_t)(frame - (jack_nframes_t)now);
+
+   return (jack_time_t)mStart.tv_sec * 1000000 + mStart.tv_nsec / 1000 + f * 1000000 / (int64_t)mSampleRate;
+}
+
+/*****************************************************************************************************/
+/* How late the latest late cycle was, in microseconds. */
+float RawMidiBackend::xrunDelay()
+{
+   return mXrunDelay.load();
+}
+
+/*****************************************************************************************************/
+/* The cycles run by themselves; just wait. */
+void RawMidiBackend::idle(unsigned ms)
+{
+   usleep(ms * 1000);
+}
+
+/*****************************************************************************************************/
+/* The monotonic time of the given frame. */
+struct timespec RawMidiBackend::frameToTimespec(uint64_t frame)
+{
+   uint64_t ns = frame * 1000000000 / mSampleRate + mStart.tv_nsec;
+   struct timespec ts;
+
+   ts.tv_sec = mStart.tv_sec + ns / 1000000000;
+   ts.tv_nsec = ns % 1000000000;
+   return ts;
+}
+
+/*****************************************************************************************************/
+/* Keep the event until the cycle is over; the ports go one by one, the stream goes in time order. */
+void RawMidiBackend::deliver(unsigned port, uint64_t cycle, jack_nframes_t offset, int64_t frame,
+      const unsigned char *data, size_t size)
+{
+   RawEvent e;
+   e.offset = offset;
+   e.pos = mPendingBytes.size();
+   e.size = size;
+   mPendingBytes.insert(mPendingBytes.end(), data, data + size);
+   mPending.push_back(e);
+}
+
+/*****************************************************************************************************/
+/* Write the event bytes, applying the running status. */
+void RawMidiBackend::writeEvent(const RawEvent &e)
+{
+   const unsigned char *bytes = &mPendingBytes[e.pos];
+   size_t size = e.size;
+   unsigned char status = bytes[0];
+
+   if (status < 0xf0)
+   {
+      // A channel message with the same status may go without it.
+      if (mbRunningStatus && status == mStatus)
+      {
+         bytes ++;
+         size --;
+      }
+      mStatus = status;
+   }
+   else if (status < 0xf8)
+      // The system common messages cancel the running status; the realtime ones do not touch it.
+      mStatus = 0;
+
+   while (size > 0)
+   {
+      ssize_t n = write(mFd, bytes, size);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+      {
+         // The receiver may have lost the status; send it with the next message.
+         if (mWriteErrors ++ == 0)
+            rtwarn("Cannot write to the MIDI output: %M", errno);
+         mStatus = 0;
+         return;
+      }
+      bytes += n;
+      size -= n;
+   }
+}
+
+/*****************************************************************************************************/
+/* Run the cycles until closed. */
+void RawMidiBackend::run()
+{
+   while (mbRunning)
+   {
+      // Wake up at the cycle start.
+      struct timespec deadline = frameToTimespec(mFrames.load());
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+         ;
+
+      // There is no device buffer to miss, so a late cycle runs at once and its events go late.
+      // Far behind, skip the lost cycles; the engine recovers like after a Jack xrun.
+      uint64_t now = elapsedFrames();
+      uint64_t start = mFrames.load();
+      if (now >= start + RAW_XRUN_PERIODS * mBufferSize)
+      {
+         uint64_t skipped = (now - start) / mBufferSize * mBufferSize;
+         mXrunDelay = (float)skipped * 1000000 / mSampleRate;
+         mFrames.store(start + skipped);
+         jack_xrun_cb(mEngine);
+      }
+
+      mPending.clear();
+      mPendingBytes.clear();
+      runCycle();
+
+      // Play the events at their offsets from the cycle start, one period after they were due.
+      std::stable_sort(mPending.begin(), mPending.end(),
+            [](const RawEvent &a, const RawEvent &b) { return a.offset < b.offset; });
+
+      uint64_t cycleStart = mFrames.load() - mBufferSize;
+      for (size_t i = 0; i < mPending.size(); i ++)
+      {
+         if (mPending[i].offset > 0)
+         {
+            struct timespec ts = frameToTimespec(cycleStart + mPending[i].offset);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+               ;
+         }
+         writeEvent(mPending[i]);
+      }
+   }
+}
@@ -0,0 +1,78 @@
+#ifndef RAWMIDIBACKEND_H
+#define RAWMIDIBACKEND_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <time.h>
+
+#include "virtualbackend.h"
+
+/*******************************************************************************************/
+/* Play without a Jack server: write the raw midi bytes to a file, a FIFO or a file descriptor,
+   each at its time. The process cycles run in a thread of their own on the monotonic clock;
+   like with Jack, an event plays one period after the cycle start it is due by. All the
+   ports share the stream. */
+class RawMidiBackend : public VirtualBackend
+{
+   private:
+      /* An event of the current cycle waiting for its time. */
+      struct RawEvent
+      {
+         jack_nframes_t     offset;
+         size_t             pos;             // Of the data in mPendingBytes.
+         size_t             size;
+      };
+
+      std::string        mDestination;     // A path, "-" for stdout or "fd:N".
+      int                mFd;
+      bool               mbOwnFd;
+      bool               mbRunningStatus;  // Leave out the repeated channel message status bytes.
+      unsigned char      mStatus;          // The running status, 0 if none.
+      struct timespec    mStart;           // The monotonic time of the frame 0.
+      std::atomic<bool>  mbRunning;
+      bool               mbThread;
+      pthread_t          mThread;
+      std::atomic<float> mXrunDelay;       // Microseconds.
+      std::vector<RawEvent>
+                         mPending;
+      std::vector<unsigned char>
+                         mPendingBytes;    // The data of the pending events.
+      uint64_t           mWriteErrors;
+
+      /* The frames passed since the frame 0. */
+      uint64_t elapsedFrames();
+
+      /* The monotonic time of the given frame. */
+      struct timespec frameToTimespec(uint64_t frame);
+
+      /* Write the event bytes, applying the running status. */
+      void writeEvent(const RawEvent &e);
+
+      /* Run the cycles until closed. */
+      void run();
+
+      friend void* rawMidiThread(void *arg);
+
+   protected:
+      void deliver(unsigned port, uint64_t cycle, jack_nframes_t offset, int64_t frame,
+            const unsigned char *data, size_t size);
+
+   public:
+      /* Constructor. */
+      RawMidiBackend(const std::string &destination, bool runningStatus,
+            jack_nframes_t sampleRate, jack_nframes_t bufferSize);
+
+      void open(JackEngine *engine);
+      void activate();
+      void close();
+      jack_nframes_t frameTime();
+      jack_time_t time();
+      jack_time_t frameToTime(jack_nframes_t frame);
+      float xrunDelay();
+      void idle(unsigned ms);
+};
+
+#endif
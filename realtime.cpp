@@ -0,0 +1,98 @@
+#include "realtime.h"
+
+#include <iostream>
+#include <sstream>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*****************************************************************************************************/
+/* Print a warning about a failed setup step; permissions get a hint. */
+static void warnFailure(const char *what, const char *name, int err)
+{
+   std::cerr << "WARNING! Cannot " << what;
+   if (name != NULL)
+      std::cerr << " for the " << name << " thread";
+   std::cerr << ": " << strerror(err) << "." << std::endl;
+
+   if (err == EPERM || err == ENOMEM)
+      std::cerr << "         Check the rtprio and memlock limits (ulimit -r, ulimit -l) of the user." << std::endl;
+}
+
+/*****************************************************************************************************/
+/* Lock all the current and future memory of the process. */
+bool lockMemory()
+{
+   if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+      return true;
+
+   warnFailure("lock the memory", NULL, errno);
+   return false;
+}
+
+/*****************************************************************************************************/
+/* Touch the stack of the calling thread, so it does not page fault later. */
+void prefaultStack()
+{
+   volatile unsigned char stack[RT_PREFAULT_STACK];
+   for (size_t i = 0; i < sizeof(stack); i += 4096)
+      stack[i] = 0;
+}
+
+/*****************************************************************************************************/
+/* Run the thread under SCHED_FIFO with the given priority. */
+bool setRealtimePriority(pthread_t thread, int priority, const char *name)
+{
+   struct sched_param param;
+   memset(&param, 0, sizeof(param));
+   param.sched_priority = priority;
+
+   int err = pthread_setschedparam(thread, SCHED_FIFO, &param);
+   if (err == 0)
+      return true;
+
+   warnFailure("set the realtime priority", name, err);
+   return false;
+}
+
+/*****************************************************************************************************/
+/* Parse a CPU list like "1,3-5". Returns false if the list is malformed. */
+bool parseCpuList(const std::string &list, cpu_set_t &cpus)
+{
+   std::istringstream iss(list);
+   std::string item;
+
+   CPU_ZERO(&cpus);
+   while (std::getline(iss, item, ','))
+   {
+      char *end;
+      long first = strtol(item.c_str(), &end, 10);
+      long last = first;
+
+      if (end == item.c_str())
+         return false;
+      if (*end == '-')
+         last = strtol(end + 1, &end, 10);
+      if (*end != 0 || first < 0 || last < first || last >= CPU_SETSIZE)
+         return false;
+
+      for (long cpu = first; cpu <= last; cpu ++)
+         CPU_SET(cpu, &cpus);
+   }
+
+   return CPU_COUNT(&cpus) > 0;
+}
+
+/*****************************************************************************************************/
+/* Pin the thread to the given CPUs. */
+bool setCpuAffinity(pthread_t thread, const cpu_set_t &cpus, const char *name)
+{
+   int err = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpus);
+   if (err == 0)
+      return true;
+
+   warnFailure("set the CPU affinity", name, err);
+   return false;
+}
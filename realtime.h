@@ -0,0 +1,31 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <string>
+
+#include <pthread.h>
+#include <sched.h>
+
+#define RT_FALLBACK_PRIORITY           10       // The base priority if Jack does not run realtime.
+#define RT_PREFAULT_STACK              (256 * 1024)
+
+/*******************************************************************************************/
+/* Realtime setup of the process and its threads. The functions print a warning and return
+   false if the system does not allow the change. */
+
+/* Lock all the current and future memory of the process. */
+bool lockMemory();
+
+/* Touch the stack of the calling thread, so it does not page fault later. */
+void prefaultStack();
+
+/* Run the thread under SCHED_FIFO with the given priority. */
+bool setRealtimePriority(pthread_t thread, int priority, const char *name);
+
+/* Parse a CPU list like "1,3-5". Returns false if the list is malformed. */
+bool parseCpuList(const std::string &list, cpu_set_t &cpus);
+
+/* Pin the thread to the given CPUs. */
+bool setCpuAffinity(pthread_t thread, const cpu_set_t &cpus, const char *name);
+
+#endif
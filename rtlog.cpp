@@ -0,0 +1,233 @@
+#include "rtlog.h"
+
+#include <string.h>
+#include <unistd.h>
+
+/*****************************************************************************************************/
+/* The text of strerror_r, whichever of its two variants the C library has. */
+static inline const char* errorText(int result, const char *buffer)
+{
+   return result == 0 ? buffer : "Unknown error";
+}
+
+static inline const char* errorText(const char *result, const char *buffer)
+{
+   return result;
+}
+
+/*****************************************************************************************************/
+/* The thread writing the records. */
+void* rtLogThread(void *arg)
+{
+   RtLog *log = (RtLog*) arg;
+
+   while (log->mbRunning)
+   {
+      log->flush();
+      usleep(RTLOG_FLUSH_MS * 1000);
+   }
+
+   return NULL;
+}
+
+/*****************************************************************************************************/
+/* Hide the constructor, as it is a singleton. */
+RtLog::RtLog()
+{
+   for (size_t i = 0; i < RTLOG_SIZE; i ++)
+      mRecords[i].seq = i;
+
+   mEnqueuePos = 0;
+   mDequeuePos = 0;
+   mDropped = 0;
+   mDroppedReported = 0;
+   mOut = stderr;
+   mbRunning = false;
+}
+
+/*****************************************************************************************************/
+/* Return an instance of the singleton. */
+RtLog* RtLog::instance()
+{
+   static RtLog *inst = new RtLog();
+   return inst;
+}
+
+/*****************************************************************************************************/
+/* Take a free record. Returns NULL if the queue is full. RT safe.
+   A writer owns the record once it has moved the enqueue position past it; the record
+   sequence tells whether the reader is done with the previous round. */
+RtLog::Record* RtLog::reserve(size_t &pos)
+{
+   pos = mEnqueuePos.load(std::memory_order_relaxed);
+
+   for (;;)
+   {
+      Record &r = mRecords[pos & (RTLOG_SIZE - 1)];
+      intptr_t diff = (intptr_t)r.seq.load(std::memory_order_acquire) - (intptr_t)pos;
+
+      if (diff == 0)
+      {
+         if (mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            return &r;
+      }
+      else if (diff < 0)
+      {
+         mDropped.fetch_add(1, std::memory_order_relaxed);
+         return NULL;
+      }
+      else
+         pos = mEnqueuePos.load(std::memory_order_relaxed);
+   }
+}
+
+/*****************************************************************************************************/
+/* Format and write one record. The arguments are passed with the types their conversions want. */
+void RtLog::format(const Record &r)
+{
+   char text[512];
+   size_t len = 0;
+   unsigned arg = 0;
+   const char *f = r.fmt;
+
+   text[0] = 0;
+   while (*f && len < sizeof(text) - 1)
+   {
+      if (*f != '%')
+      {
+         text[len ++] = *f ++;
+         text[len] = 0;
+         continue;
+      }
+
+      if (f[1] == '%')
+      {
+         text[len ++] = '%';
+         text[len] = 0;
+         f += 2;
+         continue;
+      }
+
+      // Copy the flags, width and precision; the length modifier is replaced to fit the argument.
+      char spec[32] = "%";
+      size_t s = 1;
+      for (f ++; *f && strchr("-+ #0123456789.", *f) && s < sizeof(spec) - 4; f ++)
+         spec[s ++] = *f;
+      while (*f && strchr("hlLqjzt", *f))
+         f ++;
+      if (*f == 0 || arg >= r.nargs)
+         break;
+
+      char conv = *f ++;
+      const Arg &a = r.args[arg ++];
+      size_t room = sizeof(text) - len;
+      int n = 0;
+
+      if (strchr("di", conv))
+      {
+         spec[s ++] = 'l';
+         spec[s ++] = 'l';
+         spec[s ++] = conv;
+         spec[s] = 0;
+         n = snprintf(text + len, room, spec, a.i);
+      }
+      else if (strchr("uoxX", conv))
+      {
+         spec[s ++] = 'l';
+         spec[s ++] = 'l';
+         spec[s ++] = conv;
+         spec[s] = 0;
+         n = snprintf(text + len, room, spec, (unsigned long long)a.i);
+      }
+      else if (strchr("eEfFgGaA", conv))
+      {
+         spec[s ++] = conv;
+         spec[s] = 0;
+         n = snprintf(text + len, room, spec, a.d);
+      }
+      else if (conv == 'c')
+      {
+         spec[s ++] = conv;
+         spec[s] = 0;
+         n = snprintf(text + len, room, spec, (int)a.i);
+      }
+      else if (conv == 's' || conv == 'p')
+      {
+         spec[s ++] = conv;
+         spec[s] = 0;
+         n = snprintf(text + len, room, spec, a.p);
+      }
+      else if (conv == 'M')
+      {
+         // An errno value, written as its text here rather than by the thread that logged it.
+         char error[128];
+         spec[s ++] = 's';
+         spec[s] = 0;
+         n = snprintf(text + len, room, spec, errorText(strerror_r((int)a.i, error, sizeof(error)), error));
+      }
+      else
+         break;
+
+      if (n > 0)
+         len += (size_t)n < room ? n : room - 1;
+   }
+
+   if (r.level == RTLOG_TRACE)
+      fprintf(mOut, "TRACE(%s:%d): %s", r.file, r.line, text);
+   else
+      fprintf(mOut, "WARNING! %s", text);
+
+   if (len == 0 || text[len - 1] != '\n')
+      fputc('\n', mOut);
+}
+
+/*****************************************************************************************************/
+/* Write all the records in the queue and report the dropped ones. */
+void RtLog::flush()
+{
+   for (;;)
+   {
+      Record &r = mRecords[mDequeuePos & (RTLOG_SIZE - 1)];
+      if (r.seq.load(std::memory_order_acquire) != mDequeuePos + 1)
+         break;
+
+      format(r);
+      r.seq.store(mDequeuePos + RTLOG_SIZE, std::memory_order_release);
+      mDequeuePos ++;
+   }
+
+   uint64_t dropped = mDropped.load(std::memory_order_relaxed);
+   if (dropped != mDroppedReported)
+   {
+      fprintf(mOut, "WARNING! %llu log records dropped.\n", (long long unsigned)(dropped - mDroppedReported));
+      mDroppedReported = dropped;
+   }
+
+   fflush(mOut);
+}
+
+/*****************************************************************************************************/
+/* Start the thread which writes the records to the given stream. */
+void RtLog::start(FILE *out)
+{
+   mOut = out;
+   mbRunning = true;
+   if (pthread_create(&mThread, NULL, rtLogThread, this) != 0)
+      mbRunning = false;
+}
+
+/*****************************************************************************************************/
+/* Stop the thread and write what is left. */
+void RtLog::stop()
+{
+   if (mbRunning.exchange(false))
+      pthread_join(mThread, NULL);
+   flush();
+}
+
+/*****************************************************************************************************/
+/* The number of records dropped as the queue was full. */
+uint64_t RtLog::dropped()
+{
+   return mDropped.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,151 @@
+#ifndef RTLOG_H
+#define RTLOG_H
+
+#include <atomic>
+#include <type_traits>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <pthread.h>
+
+#define RTLOG_SIZE                     1024     // Records in the queue; a power of two.
+#define RTLOG_MAX_ARGS                 6
+#define RTLOG_FLUSH_MS                 50       // How often the records are formatted and written.
+
+enum RtLogLevel
+{
+   RTLOG_TRACE,
+   RTLOG_WARNING
+};
+
+/*******************************************************************************************/
+/* A log for the realtime threads. The writers put fixed-size records with a printf format
+   and its arguments into a lock-free queue; a non-realtime thread formats and writes them.
+   A record is dropped, and counted, if the queue is full. The format and the string
+   arguments must be static, as they are read later; so an error is given as its errno
+   value to the %M conversion, which writes its text. Singleton. */
+class RtLog
+{
+   private:
+      union Arg
+      {
+         long long   i;
+         double      d;
+         const void *p;
+      };
+
+      struct Record
+      {
+         std::atomic<size_t> seq;      // The queue position the record is ready for.
+         RtLogLevel          level;
+         const char         *file;
+         int                 line;
+         const char         *fmt;
+         unsigned            nargs;
+         Arg                 args[RTLOG_MAX_ARGS];
+      };
+
+      Record                mRecords[RTLOG_SIZE];
+      std::atomic<size_t>   mEnqueuePos;
+      size_t                mDequeuePos;
+      std::atomic<uint64_t> mDropped;
+      uint64_t              mDroppedReported;
+      FILE                 *mOut;
+      pthread_t             mThread;
+      std::atomic<bool>     mbRunning;
+
+      /* Pack the arguments of a record. */
+      template <typename T>
+      static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, Arg>::type pack(T v)
+      {
+         Arg a;
+         a.i = (long long) v;
+         return a;
+      }
+
+      template <typename T>
+      static typename std::enable_if<std::is_floating_point<T>::value, Arg>::type pack(T v)
+      {
+         Arg a;
+         a.d = v;
+         return a;
+      }
+
+      template <typename T>
+      static Arg pack(const T *v)
+      {
+         Arg a;
+         a.p = v;
+         return a;
+      }
+
+      static void fill(Arg *args)
+      {
+      }
+
+      template <typename T, typename... A>
+      static void fill(Arg *args, T v, A... rest)
+      {
+         *args = pack(v);
+         fill(args + 1, rest...);
+      }
+
+      /* Take a free record. Returns NULL if the queue is full. RT safe. */
+      Record* reserve(size_t &pos);
+
+      /* Format and write one record. */
+      void format(const Record &r);
+
+      /* Write all the records in the queue and report the dropped ones. */
+      void flush();
+
+      /* Hide the constructor, as it is a singleton. */
+      RtLog();
+
+   public:
+      static RtLog* instance();
+
+      /* Start the thread which writes the records to the given stream. */
+      void start(FILE *out);
+
+      /* Stop the thread and write what is left. */
+      void stop();
+
+      /* The number of records dropped as the queue was full. */
+      uint64_t dropped();
+
+      /* Put a record into the queue. RT safe. */
+      template <typename... A>
+      void log(RtLogLevel level, const char *file, int line, const char *fmt, A... args)
+      {
+         static_assert(sizeof...(A) <= RTLOG_MAX_ARGS, "Too many arguments for a log record");
+
+         size_t pos;
+         Record *r = reserve(pos);
+         if (r == NULL)
+            return;
+
+         r->level = level;
+         r->file = file;
+         r->line = line;
+         r->fmt = fmt;
+         r->nargs = sizeof...(A);
+         fill(r->args, args...);
+         r->seq.store(pos + 1, std::memory_order_release);
+      }
+
+      friend void* rtLogThread(void *arg);
+};
+
+/*******************************************************************************************/
+/* Logging from the realtime threads. */
+#define rtwarn(...) {RtLog::instance()->log(RTLOG_WARNING, __FILE__, __LINE__, __VA_ARGS__);}
+#ifdef DEBUG
+#define rttrace(...) {RtLog::instance()->log(RTLOG_TRACE, __FILE__, __LINE__, __VA_ARGS__);}
+#else
+#define rttrace(...) {}
+#endif
+
+#endif
@@ -1,5 +1,7 @@
 #include <algorithm>
 
+#include <math.h>
+
 #include "sequencer.h"
 #include "parser.h"
 #include "events.h"
@@ -15,7 +17,13 @@ Sequencer::Sequencer(JackEngine *j)
    mCurrentTime = mJack->currentFrameTime();
    mTempo = 100;
    mQuantSize = 4;
+   mLineFrac = 0;
+   mLineDen = 1;
+   updateLineDuration();
    mParser = new Parser(&mSubSeqMap);
+   mParent = NULL;
+   mEarliest = 0;
+   mBackdate = SEQUENCER_BACKDATE;
 }
 
 /*****************************************************************************************************/
@@ -26,16 +34,26 @@ Sequencer::~Sequencer()
 }
 
 /*****************************************************************************************************/
-/* Read a pattern from a stringstream. */
+/* Read a pattern from a stream. */
 void Sequencer::readFromStream(std::istream &ss)
 {
-   std::string line;
+   StreamLineReader reader (ss);
+   readLines(reader);
+}
+
+/*****************************************************************************************************/
+/* Read a pattern line by line. Nested sequences continue with the same reader. */
+void Sequencer::readLines(LineReader &reader)
+{
+   const char *line;
+   size_t length;
 
-   while (std::getline(ss, line))
+   while (reader.next(line, length))
    {
       try
       {
-         EventListT lst = mParser->parseLine(line);
+         LexedLine *lexed = reader.lexed();
+         EventListT lst = lexed != NULL ? mParser->parseLine(*lexed) : mParser->parseLine(line, length);
 
          // Continue if the event list is empty.
          if (lst.empty())
@@ -47,7 +65,8 @@ void Sequencer::readFromStream(std::istream &ss)
             if (e != NULL)
             {
                Sequencer *seq = new Sequencer(mJack);
-               seq->readFromStream(ss);
+               seq->mParent = this;
+               seq->readLines(reader);
                mSubSeqMap[e->name] = seq;
                continue;
             }
@@ -65,7 +84,8 @@ void Sequencer::readFromStream(std::istream &ss)
       }
       catch (int e)
       {
-         std::cerr << "Cannot parse line: " << line << std::endl;
+         std::cerr << "Cannot parse line: ";
+         std::cerr.write(line, length) << std::endl;
       }
    }
 }
@@ -77,12 +97,20 @@ bool Sequencer::playNextLine()
    std::vector<EventListT> nextActives (mActiveNotesVec.size());
 
    bool bAdvanceTime = false;
+   Sequencer *topSeq = top();
 
    while (!bAdvanceTime)
    {
+      frametime_t lineStart = mCurrentTime;
+      if (topSeq == this)
+         mEarliest = lineStart;
+
       EventListT eventLst = getNextLine();
       if (eventLst.empty())
+      {
+         flushEvents();
          return false;
+      }
 
       // Start new notes. Loop through the event list.
       for (EventListT::iterator jt = eventLst.begin(); jt != eventLst.end(); jt ++)
@@ -102,8 +130,12 @@ bool Sequencer::playNextLine()
          }
 
          // If the event needs to be stopped at the next line, add it to the list.
+         // The stop goes before the start of that line by the column number and one.
          if (type.bNeedsStopping)
+         {
             nextActives[event->column].push_back(event);
+            topSeq->mBackdate = std::max(topSeq->mBackdate, (frametime_t)event->column + 1);
+         }
 
          // Stop previous note(s) on this channel.
          if (type.bSilencePrevious)
@@ -125,12 +157,36 @@ bool Sequencer::playNextLine()
 
       // Advance the current time.
       if (bAdvanceTime)
-         mCurrentTime += mJack->msToNframes(60 * 1000 / mTempo / mQuantSize);
+         advanceLine();
+
+      // Queue everything the line has produced.
+      flushEvents();
+
+      // The following lines may go as early before their start as this one.
+      if (topSeq == this)
+         mBackdate = std::max(mBackdate, lineStart - mEarliest);
    }
 
    return true;
 }
 
+/*****************************************************************************************************/
+/* The time up to which the events may be released. */
+frametime_t Sequencer::releaseTime()
+{
+   return mCurrentTime > mBackdate ? mCurrentTime - mBackdate : 0;
+}
+
+/*****************************************************************************************************/
+/* The top level sequencer. */
+Sequencer* Sequencer::top()
+{
+   Sequencer *seq = this;
+   while (seq->mParent != NULL)
+      seq = seq->mParent;
+   return seq;
+}
+
 /*****************************************************************************************************/
 /* Returns a list of events and increments internal position pointer. */
 EventListT Sequencer::getNextLine()
@@ -184,14 +240,14 @@ PortMap& Sequencer::getPortMap(unsigned column)
 
 /*****************************************************************************************************/
 /* Set the current time frame. */
-void Sequencer::setCurrentTime(jack_nframes_t time)
+void Sequencer::setCurrentTime(frametime_t time)
 {
    mCurrentTime = time;
 }
 
 /*****************************************************************************************************/
 /* Return the current time frame. */
-jack_nframes_t Sequencer::getCurrentTime()
+frametime_t Sequencer::getCurrentTime()
 {
    return mCurrentTime;
 }
@@ -208,6 +264,7 @@ unsigned Sequencer::getTempo()
 void Sequencer::setTempo(unsigned t)
 {
    mTempo = t;
+   updateLineDuration();
 }
 
 /*****************************************************************************************************/
@@ -222,6 +279,7 @@ unsigned Sequencer::getQuant()
 void Sequencer::setQuant(unsigned q)
 {
    mQuantSize = q;
+   updateLineDuration();
 }
 
 /*****************************************************************************************************/
@@ -237,6 +295,8 @@ void Sequencer::silence()
          (*it).pop_front();
       }
    }
+
+   flushEvents();
 }
 
 std::vector<EventListT>& Sequencer::getActiveNotes()
@@ -248,3 +308,96 @@ void Sequencer::advanceTime(jack_nframes_t tm)
 {
    mCurrentTime += tm;
 }
+
+/*****************************************************************************************************/
+/* Recalculate the line duration after the tempo or quant change.
+   A line lasts 60 / tempo / quant seconds, i.e. rate * 60 / (tempo * quant) frames exactly. */
+void Sequencer::updateLineDuration()
+{
+   uint64_t num = (uint64_t)mJack->sampleRate() * 60;
+   uint64_t den = (uint64_t)mTempo * mQuantSize;
+   if (den == 0)
+      den = 1;
+
+   // Keep the accumulated fraction, rescaled to the new denominator and rounded to the nearest.
+   mLineFrac = (mLineFrac * den * 2 + mLineDen) / (mLineDen * 2);
+   if (mLineFrac >= den)
+   {
+      mCurrentTime ++;
+      mLineFrac -= den;
+   }
+
+   mLineFrames = num / den;
+   mLineRem = num % den;
+   mLineDen = den;
+}
+
+/*****************************************************************************************************/
+/* Advance current sequencer's time by one line without accumulating the rounding error. */
+void Sequencer::advanceLine()
+{
+   mCurrentTime += mLineFrames;
+   mLineFrac += mLineRem;
+   if (mLineFrac >= mLineDen)
+   {
+      mCurrentTime ++;
+      mLineFrac -= mLineDen;
+   }
+}
+
+/*****************************************************************************************************/
+/* The duration of one line in frames. */
+jack_nframes_t Sequencer::getLineDuration()
+{
+   return mLineFrames;
+}
+
+/*****************************************************************************************************/
+/* The frames from the current time to the given part of the lines ahead, lines / div, on the same
+   exact grid as advanceLine. */
+int64_t Sequencer::linesToFrames(double lines, double div)
+{
+   if (div == 0)
+      return 0;
+
+   long double exact = (long double)mLineFrames * mLineDen + mLineRem;
+   return (int64_t)floorl((mLineFrac * (long double)div + lines * exact) / ((long double)div * mLineDen));
+}
+
+/*****************************************************************************************************/
+/* Stage a midi message; it is queued when the current line is done. */
+void Sequencer::queueMidiEvent(const MidiMessage &message)
+{
+   mStaging.push_back(message);
+}
+
+/*****************************************************************************************************/
+/* Construct and stage a midi message. */
+void Sequencer::queueMidiEvent(unsigned char b0, unsigned char b1, unsigned char b2, frametime_t time,
+      unsigned channel, unsigned port)
+{
+   mStaging.push_back(MidiMessage(b0, b1, b2, time, channel, port));
+}
+
+/*****************************************************************************************************/
+/* Compare the midi messages by time. */
+static bool earlier(const MidiMessage &a, const MidiMessage &b)
+{
+   return a.time < b.time;
+}
+
+/*****************************************************************************************************/
+/* Sort the staged messages and pass them to the engine at once. */
+void Sequencer::flushEvents()
+{
+   if (mStaging.empty())
+      return;
+
+   std::stable_sort(mStaging.begin(), mStaging.end(), earlier);
+
+   Sequencer *topSeq = top();
+   topSeq->mEarliest = std::min(topSeq->mEarliest, mStaging.front().time);
+
+   mJack->queueMidiEvents(mStaging.data(), mStaging.size());
+   mStaging.clear();
+}
@@ -8,6 +8,9 @@
 #include "events.h"
 #include "parser.h"
 #include "jackengine.h"
+#include "linereader.h"
+
+#define SEQUENCER_BACKDATE             128      // Frames; the initial guess how early before its start a line may queue.
 
 /*******************************************************************************************/
 /* Interpret and process the pattern line by line. */
@@ -25,10 +28,28 @@ class Sequencer
                mSubSeqMap;
    std::vector<EventListT>
                mActiveNotesVec;
-   jack_nframes_t
-               mCurrentTime;
+   frametime_t mCurrentTime;
    unsigned    mTempo;
    unsigned    mQuantSize;
+   jack_nframes_t
+               mLineFrames;   // Whole frames of the line duration.
+   uint64_t    mLineRem;      // The line duration is mLineFrames + mLineRem / mLineDen frames.
+   uint64_t    mLineDen;
+   uint64_t    mLineFrac;     // Accumulated fraction of a frame, in 1 / mLineDen units.
+   std::vector<MidiMessage>
+               mStaging;      // Midi messages produced by the current line.
+   Sequencer  *mParent;       // The sequencer playing this one as a subpattern; NULL at the top.
+   frametime_t mEarliest;     // The earliest time queued by the current top level line.
+   frametime_t mBackdate;     // How early before its start a top level line may queue.
+
+   /* The top level sequencer, which releases the events. */
+   Sequencer* top();
+
+   /* Sort the staged messages and pass them to the engine at once. */
+   void flushEvents();
+
+   /* Recalculate the line duration after the tempo or quant change. */
+   void updateLineDuration();
 
    public:
       /* Constructor. */
@@ -40,12 +61,19 @@ class Sequencer
       /* Read the data from the stream. */
       void readFromStream(std::istream &ss);
 
+      /* Read the data line by line from the reader. */
+      void readLines(LineReader &reader);
+
       /* Get the vector of the next events. */
       EventListT getNextLine();
 
       /* Queue MIDI events from the current position of the sequencer. */
       bool playNextLine();
 
+      /* Nothing earlier than this time will be queued by the following lines. The events up to it
+         may be released to the engine after a top level line. */
+      frametime_t releaseTime();
+
       /* Stop all active notes. */
       void silence();
 
@@ -55,14 +83,23 @@ class Sequencer
       PortMap& getPortMap(unsigned column);
 
       /* Set the current time. */
-      void setCurrentTime(jack_nframes_t time);
+      void setCurrentTime(frametime_t time);
 
       /* Return current sequencer's time. */
-      jack_nframes_t getCurrentTime();
+      frametime_t getCurrentTime();
 
       /* Advance current sequencer's time. */
       void advanceTime(jack_nframes_t tm);
 
+      /* Advance current sequencer's time by one line without accumulating the rounding error. */
+      void advanceLine();
+
+      /* The duration of one line in frames. */
+      jack_nframes_t getLineDuration();
+
+      /* The frames from the current time to lines / div lines ahead, without the rounding error. */
+      int64_t linesToFrames(double lines, double div);
+
       /* Get tempo. */
       unsigned getTempo();
 
@@ -75,6 +112,13 @@ class Sequencer
       /* Set quant size. */
       void setQuant(unsigned q);
 
+      /* Stage a midi message; it is queued when the current line is done. */
+      void queueMidiEvent(const MidiMessage &message);
+
+      /* Construct and stage a midi message. */
+      void queueMidiEvent(unsigned char b0, unsigned char b1, unsigned char b2, frametime_t time,
+            unsigned channel = 0, unsigned port = 0);
+
       /* Get the vector of all active events. Vector's index corresponds to column. */
       std::vector<EventListT>& getActiveNotes();
 };
@@ -0,0 +1,61 @@
+#include "simbackend.h"
+
+#include <iostream>
+
+/*****************************************************************************************************/
+/* Constructor. */
+SimBackend::SimBackend(const std::string &path, jack_nframes_t sampleRate, jack_nframes_t bufferSize)
+   : VirtualBackend(sampleRate, bufferSize)
+{
+   mPath = path;
+   mFile = NULL;
+}
+
+/*****************************************************************************************************/
+/* Destructor. */
+SimBackend::~SimBackend()
+{
+   close();
+}
+
+/*****************************************************************************************************/
+/* Open the record. */
+void SimBackend::open(JackEngine *engine)
+{
+   mFile = mPath == "-" ? stdout : fopen(mPath.c_str(), "w");
+   if (mFile == NULL)
+      throw "cannot create the simulation record";
+
+   fprintf(mFile, "# rate %u period %u\n", mSampleRate, mBufferSize);
+   fprintf(mFile, "# cycle offset frame port bytes\n");
+
+   VirtualBackend::open(engine);
+}
+
+/*****************************************************************************************************/
+/* Finish the record and stop recording. */
+void SimBackend::close()
+{
+   if (mFile == NULL)
+      return;
+
+   if (fflush(mFile) != 0 || ferror(mFile))
+      std::cerr << "WARNING! Cannot write the simulation record " << mPath << "." << std::endl;
+   if (mFile != stdout)
+      fclose(mFile);
+   mFile = NULL;
+}
+
+/*****************************************************************************************************/
+/* Write an event to the record. */
+void SimBackend::deliver(unsigned port, uint64_t cycle, jack_nframes_t offset, int64_t frame,
+      const unsigned char *data, size_t size)
+{
+   if (mFile == NULL)
+      return;
+
+   fprintf(mFile, "%llu %u %lld %s", (unsigned long long)cycle, offset, (long long)frame, portName(port).c_str());
+   for (size_t i = 0; i < size; i ++)
+      fprintf(mFile, " %02x", data[i]);
+   fputc('\n', mFile);
+}
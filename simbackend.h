@@ -0,0 +1,37 @@
+#ifndef SIMBACKEND_H
+#define SIMBACKEND_H
+
+#include <string>
+
+#include <stdio.h>
+
+#include "virtualbackend.h"
+
+/*******************************************************************************************/
+/* Simulate the playback on a virtual clock and record every emitted event with its cycle and
+   offset. The record is written as text while the cycles run, one event per line:
+   cycle offset frame port bytes. The same song gives the same record on any machine. */
+class SimBackend : public VirtualBackend
+{
+   private:
+      std::string        mPath;            // "-" for stdout.
+      FILE              *mFile;
+
+   protected:
+      void deliver(unsigned port, uint64_t cycle, jack_nframes_t offset, int64_t frame,
+            const unsigned char *data, size_t size);
+
+   public:
+      /* Constructor. */
+      SimBackend(const std::string &path, jack_nframes_t sampleRate, jack_nframes_t bufferSize);
+
+      /* Destructor. */
+      ~SimBackend();
+
+      /* Open the record and write its header. Throws if it cannot be created. */
+      void open(JackEngine *engine);
+
+      void close();
+};
+
+#endif
@@ -0,0 +1,161 @@
+#include "smfbackend.h"
+
+#include <iostream>
+
+#define SMF_MAX_DIVISION               0x7fff   // The division is a 15-bit number.
+
+/*****************************************************************************************************/
+/* Append a variable length quantity. */
+static void putVarLen(std::vector<unsigned char> &out, uint64_t value)
+{
+   unsigned char buf[10];
+   size_t n = 0;
+
+   buf[n ++] = value & 0x7f;
+   while ((value >>= 7) > 0)
+      buf[n ++] = 0x80 | (value & 0x7f);
+
+   while (n > 0)
+      out.push_back(buf[-- n]);
+}
+
+/*****************************************************************************************************/
+/* Append a big endian number of the given size. */
+static void putNumber(std::vector<unsigned char> &out, uint32_t value, size_t size)
+{
+   while (size-- > 0)
+      out.push_back((value >> (8 * size)) & 0xff);
+}
+
+/*****************************************************************************************************/
+/* Write a chunk with the given type. Returns false on failure. */
+static bool writeChunk(FILE *f, const char *type, const std::vector<unsigned char> &data)
+{
+   std::vector<unsigned char> header (type, type + 4);
+   putNumber(header, data.size(), 4);
+
+   return fwrite(&header[0], 1, header.size(), f) == header.size()
+      && (data.empty() || fwrite(&data[0], 1, data.size(), f) == data.size());
+}
+
+/*****************************************************************************************************/
+/* Constructor. */
+SmfBackend::SmfBackend(const std::string &path, jack_nframes_t sampleRate, jack_nframes_t bufferSize)
+   : VirtualBackend(sampleRate, bufferSize)
+{
+   mPath = path;
+   mFile = NULL;
+   mDivision = 0;
+   mTempo = 0;
+}
+
+/*****************************************************************************************************/
+/* Open the file and find the tempo at which a tick takes a frame. */
+void SmfBackend::open(JackEngine *engine)
+{
+   // A quarter note of k microseconds * 10^6 lasts k * rate frames; both must be whole numbers.
+   for (unsigned k = 1; k <= mSampleRate && mDivision == 0; k ++)
+   {
+      if (mSampleRate % k == 0 && 1000000 % k == 0 && mSampleRate / k <= SMF_MAX_DIVISION)
+      {
+         mDivision = mSampleRate / k;
+         mTempo = 1000000 / k;
+      }
+   }
+   if (mDivision == 0)
+      throw "the sample rate cannot be written to a MIDI file";
+
+   if ((mFile = fopen(mPath.c_str(), "wb")) == NULL)
+      throw "cannot open the MIDI file";
+
+   VirtualBackend::open(engine);
+}
+
+/*****************************************************************************************************/
+/* Write the file and close it. */
+void SmfBackend::close()
+{
+   if (mFile == NULL)
+      return;
+
+   writeFile();
+   fclose(mFile);
+   mFile = NULL;
+}
+
+/*****************************************************************************************************/
+/* Add an event to the track of the port. */
+void SmfBackend::deliver(unsigned port, uint64_t cycle, jack_nframes_t offset, int64_t frame,
+      const unsigned char *data, size_t size)
+{
+   if (port >= mTracks.size())
+   {
+      mTracks.resize(port + 1);
+      mLastTick.resize(port + 1, 0);
+   }
+
+   std::vector<unsigned char> &track = mTracks[port];
+   int64_t tick = frame < mLastTick[port] ? mLastTick[port] : frame;
+   putVarLen(track, tick - mLastTick[port]);
+   mLastTick[port] = tick;
+
+   if (data[0] == 0xf0)
+   {
+      // Sysex: the length goes after the status byte.
+      track.push_back(0xf0);
+      putVarLen(track, size - 1);
+      track.insert(track.end(), data + 1, data + size);
+   }
+   else if (data[0] > 0xf0)
+   {
+      // The other system messages have no place in a file; escape them.
+      track.push_back(0xf7);
+      putVarLen(track, size);
+      track.insert(track.end(), data, data + size);
+   }
+   else
+      track.insert(track.end(), data, data + size);
+}
+
+/*****************************************************************************************************/
+/* Write the file. */
+void SmfBackend::writeFile()
+{
+   std::vector<unsigned char> header, tempo;
+
+   putNumber(header, 1, 2);
+   putNumber(header, 1 + mPortCount, 2);
+   putNumber(header, mDivision, 2);
+
+   // The tempo track.
+   const unsigned char tempoMeta[] = { 0x00, 0xff, 0x51, 0x03 };
+   tempo.insert(tempo.end(), tempoMeta, tempoMeta + sizeof(tempoMeta));
+   putNumber(tempo, mTempo, 3);
+
+   const unsigned char endOfTrack[] = { 0x00, 0xff, 0x2f, 0x00 };
+   tempo.insert(tempo.end(), endOfTrack, endOfTrack + sizeof(endOfTrack));
+
+   bool ok = writeChunk(mFile, "MThd", header) && writeChunk(mFile, "MTrk", tempo);
+
+   // A track per port, named after it.
+   for (unsigned i = 0; i < mPortCount && ok; i ++)
+   {
+      std::vector<unsigned char> track;
+      std::string name = portName(i);
+
+      track.push_back(0x00);
+      track.push_back(0xff);
+      track.push_back(0x03);
+      putVarLen(track, name.size());
+      track.insert(track.end(), name.begin(), name.end());
+
+      if (i < mTracks.size())
+         track.insert(track.end(), mTracks[i].begin(), mTracks[i].end());
+      track.insert(track.end(), endOfTrack, endOfTrack + sizeof(endOfTrack));
+
+      ok = writeChunk(mFile, "MTrk", track);
+   }
+
+   if (!ok)
+      std::cerr << "WARNING! Cannot write the MIDI file " << mPath << "." << std::endl;
+}
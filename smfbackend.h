@@ -0,0 +1,46 @@
+#ifndef SMFBACKEND_H
+#define SMFBACKEND_H
+
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+
+#include "virtualbackend.h"
+
+#define SMF_SAMPLE_RATE                48000    // The default rate of the virtual clock.
+#define SMF_BUFFER_SIZE                256      // The default virtual period.
+
+/*******************************************************************************************/
+/* Render the output offline into a type 1 Standard MIDI File: a tempo track and a track per port.
+   The tempo and the division make a tick of every frame, so the events keep the exact frames
+   Jack would have played them at. */
+class SmfBackend : public VirtualBackend
+{
+   private:
+      std::string        mPath;
+      FILE              *mFile;
+      unsigned           mDivision;        // Ticks per quarter note.
+      unsigned           mTempo;           // Microseconds per quarter note.
+      std::vector<std::vector<unsigned char> >
+                         mTracks;          // The events of every port.
+      std::vector<int64_t>
+                         mLastTick;        // The time of the last event on every track.
+
+      /* Write the file. */
+      void writeFile();
+
+   protected:
+      void deliver(unsigned port, uint64_t cycle, jack_nframes_t offset, int64_t frame,
+            const unsigned char *data, size_t size);
+
+   public:
+      /* Constructor. */
+      SmfBackend(const std::string &path, jack_nframes_t sampleRate = SMF_SAMPLE_RATE,
+            jack_nframes_t bufferSize = SMF_BUFFER_SIZE);
+
+      void open(JackEngine *engine);
+      void close();
+};
+
+#endif
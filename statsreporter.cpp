@@ -0,0 +1,90 @@
+#include "statsreporter.h"
+
+#include <fstream>
+#include <iostream>
+
+#include <stdio.h>
+#include <unistd.h>
+
+/*****************************************************************************************************/
+/* The reporting thread. */
+void* statsReporterThread(void *arg)
+{
+   StatsReporter *reporter = (StatsReporter*) arg;
+   unsigned polls = 0;
+
+   while (reporter->mbRunning)
+   {
+      usleep(STATS_POLL_MS * 1000);
+
+      if (reporter->mbDumpRequested.exchange(false))
+         reporter->mJack->writeStats(std::cerr);
+
+      if (++ polls * STATS_POLL_MS >= STATS_INTERVAL_MS)
+      {
+         reporter->writeFile();
+         polls = 0;
+      }
+   }
+
+   return NULL;
+}
+
+/*****************************************************************************************************/
+/* Constructor. */
+StatsReporter::StatsReporter(JackEngine *jack)
+{
+   mJack = jack;
+   mbRunning = false;
+   mbDumpRequested = false;
+}
+
+/*****************************************************************************************************/
+/* Set the file to rewrite periodically. Must be called before start(). */
+void StatsReporter::setPath(std::string path)
+{
+   mPath = path;
+}
+
+/*****************************************************************************************************/
+/* Start the reporting thread. */
+void StatsReporter::start()
+{
+   mbRunning = true;
+   if (pthread_create(&mThread, NULL, statsReporterThread, this) != 0)
+      mbRunning = false;
+}
+
+/*****************************************************************************************************/
+/* Stop the reporting thread and write the final stats file. */
+void StatsReporter::stop()
+{
+   if (!mbRunning.exchange(false))
+      return;
+
+   pthread_join(mThread, NULL);
+   writeFile();
+}
+
+/*****************************************************************************************************/
+/* Ask for a dump to stderr. Async-signal safe. */
+void StatsReporter::requestDump()
+{
+   mbDumpRequested = true;
+}
+
+/*****************************************************************************************************/
+/* Rewrite the stats file at once, so a reader never sees it half written. */
+void StatsReporter::writeFile()
+{
+   if (mPath.empty())
+      return;
+
+   std::string tmp = mPath + ".tmp";
+   std::ofstream out(tmp.c_str());
+   mJack->writeStats(out);
+   out.close();
+
+   if (!out || rename(tmp.c_str(), mPath.c_str()) != 0)
+      std::cerr << "WARNING! Cannot write the stats file " << mPath << "." << std::endl;
+}
@@ -0,0 +1,48 @@
+#ifndef STATSREPORTER_H
+#define STATSREPORTER_H
+
+#include <atomic>
+#include <string>
+
+#include <pthread.h>
+
+#include "jackengine.h"
+
+#define STATS_INTERVAL_MS              1000     // How often the stats file is rewritten.
+#define STATS_POLL_MS                  100      // How often a dump request is checked for.
+
+/*******************************************************************************************/
+/* Dump the engine statistics from a non-realtime thread: to stderr on request (SIGUSR1)
+   and periodically to a file if one is set. */
+class StatsReporter
+{
+   private:
+      JackEngine        *mJack;
+      std::string        mPath;            // The stats file; empty if none.
+      pthread_t          mThread;
+      std::atomic<bool>  mbRunning;
+      std::atomic<bool>  mbDumpRequested;
+
+      /* Rewrite the stats file at once, so a reader never sees it half written. */
+      void writeFile();
+
+   public:
+      /* Constructor. */
+      StatsReporter(JackEngine *jack);
+
+      /* Set the file to rewrite periodically. Must be called before start(). */
+      void setPath(std::string path);
+
+      /* Start the reporting thread. */
+      void start();
+
+      /* Stop the reporting thread and write the final stats file. */
+      void stop();
+
+      /* Ask for a dump to stderr. Async-signal safe. */
+      void requestDump();
+
+      friend void* statsReporterThread(void *arg);
+};
+
+#endif
@@ -0,0 +1,290 @@
+#include "timingwheel.h"
+
+#include <string.h>
+
+#define NIL                            ((uint32_t) -1)
+#define L0_MASK                        (WHEEL_L0_SLOTS - 1)
+#define L1_MASK                        (WHEEL_L1_SLOTS - 1)
+#define POOL_CHUNK                     (1 << WHEEL_POOL_BITS)
+
+/*****************************************************************************************************/
+/* Set, clear and test a bit in a slot bitmap. */
+static inline void setBit(uint64_t *bits, unsigned i)
+{
+   bits[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static inline void clearBit(uint64_t *bits, unsigned i)
+{
+   bits[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+/*****************************************************************************************************/
+/* Return the first set bit in [from, to) or -1 if there is none. */
+static int nextBit(const uint64_t *bits, unsigned from, unsigned to)
+{
+   while (from < to)
+   {
+      uint64_t w = bits[from / 64] >> (from % 64);
+      if (w != 0)
+      {
+         unsigned i = from + __builtin_ctzll(w);
+         return i < to ? (int)i : -1;
+      }
+      from = (from / 64 + 1) * 64;
+   }
+   return -1;
+}
+
+/*****************************************************************************************************/
+/* Return true if the message a should go before the message b. */
+static inline bool before(const MidiMessage &a, const MidiMessage &b)
+{
+   if (a.time != b.time)
+      return a.time < b.time;
+   return a.port < b.port;
+}
+
+/*****************************************************************************************************/
+/* Return the node with the given index. */
+inline TimingWheel::Node& TimingWheel::node(uint32_t n)
+{
+   return mPool[n >> WHEEL_POOL_BITS][n & (POOL_CHUNK - 1)];
+}
+
+/*****************************************************************************************************/
+/* Add a chunk of nodes to the free list. */
+void TimingWheel::grow()
+{
+   uint32_t base = mPool.size() << WHEEL_POOL_BITS;
+   Node *chunk = new Node[POOL_CHUNK];
+   mPool.push_back(chunk);
+
+   for (uint32_t i = 0; i < POOL_CHUNK; i ++)
+      chunk[i].next = (i + 1 < POOL_CHUNK) ? base + i + 1 : mFree;
+   mFree = base;
+}
+
+/*****************************************************************************************************/
+/* Constructor. Preallocates the nodes for s messages. */
+TimingWheel::TimingWheel(size_t s)
+{
+   mCount = 0;
+   mFree = NIL;
+   for (size_t i = 0; i < s; i += POOL_CHUNK)
+      grow();
+
+   for (unsigned i = 0; i < WHEEL_L0_SLOTS; i ++)
+      mL0[i].head = mL0[i].tail = NIL;
+   for (unsigned i = 0; i < WHEEL_L1_SLOTS; i ++)
+      mL1[i].head = mL1[i].tail = NIL;
+   memset(mL0Bits, 0, sizeof(mL0Bits));
+   memset(mL1Bits, 0, sizeof(mL1Bits));
+
+   mOverflow = new MidiHeap(s);
+   mBlock = 0;
+   mNow = 0;
+}
+
+/*****************************************************************************************************/
+/* Destructor. */
+TimingWheel::~TimingWheel()
+{
+   delete mOverflow;
+   for (size_t i = 0; i < mPool.size(); i ++)
+      delete[] mPool[i];
+}
+
+/*****************************************************************************************************/
+/* Take a node from the free list. */
+inline uint32_t TimingWheel::allocNode(const MidiMessage &msg)
+{
+   if (mFree == NIL)
+      grow();
+
+   uint32_t n = mFree;
+   mFree = node(n).next;
+   node(n).msg = msg;
+   node(n).next = NIL;
+   return n;
+}
+
+/*****************************************************************************************************/
+/* Put the node back to the free list. */
+inline void TimingWheel::freeNode(uint32_t n)
+{
+   node(n).next = mFree;
+   mFree = n;
+}
+
+/*****************************************************************************************************/
+/* Put the node into a first level slot keeping the slot sorted.
+   The late messages go to the current slot. */
+void TimingWheel::placeL0(uint32_t n)
+{
+   const MidiMessage &msg = node(n).msg;
+   unsigned i = (msg.time < mNow ? mNow : msg.time) & L0_MASK;
+   Slot &slot = mL0[i];
+
+   if (slot.head == NIL)
+   {
+      slot.head = slot.tail = n;
+      setBit(mL0Bits, i);
+   }
+   else if (!before(msg, node(slot.tail).msg))
+   {
+      // The most common case: append to the end.
+      node(slot.tail).next = n;
+      slot.tail = n;
+   }
+   else if (before(msg, node(slot.head).msg))
+   {
+      node(n).next = slot.head;
+      slot.head = n;
+   }
+   else
+   {
+      uint32_t p = slot.head;
+      while (!before(msg, node(node(p).next).msg))
+         p = node(p).next;
+      node(n).next = node(p).next;
+      node(p).next = n;
+   }
+}
+
+/*****************************************************************************************************/
+/* Put the node to the right level. */
+void TimingWheel::place(uint32_t n)
+{
+   frametime_t block = node(n).msg.time >> WHEEL_L0_BITS;
+
+   if (block <= mBlock)
+      placeL0(n);
+   else if (block - mBlock < WHEEL_L1_SLOTS)
+   {
+      unsigned i = block & L1_MASK;
+      node(n).next = NIL;
+      if (mL1[i].head == NIL)
+      {
+         mL1[i].head = mL1[i].tail = n;
+         setBit(mL1Bits, i);
+      }
+      else
+      {
+         node(mL1[i].tail).next = n;
+         mL1[i].tail = n;
+      }
+   }
+   else
+   {
+      mOverflow->insert(node(n).msg);
+      freeNode(n);
+   }
+}
+
+/*****************************************************************************************************/
+/* Move to the next non-empty block and cascade its messages to the first level.
+   Returns false if there are no more messages. */
+bool TimingWheel::advanceBlock()
+{
+   unsigned cur = mBlock & L1_MASK;
+   int i = nextBit(mL1Bits, cur + 1, WHEEL_L1_SLOTS);
+   if (i < 0)
+      i = nextBit(mL1Bits, 0, cur);
+
+   if (i >= 0)
+      mBlock += (i - cur) & L1_MASK;
+   else if (mOverflow->count() > 0)
+      mBlock = mOverflow->peekMin().time >> WHEEL_L0_BITS;
+   else
+      return false;
+
+   mNow = mBlock << WHEEL_L0_BITS;
+
+   // Cascade the second level slot.
+   if (i >= 0)
+   {
+      uint32_t n = mL1[i].head;
+      mL1[i].head = mL1[i].tail = NIL;
+      clearBit(mL1Bits, i);
+
+      while (n != NIL)
+      {
+         uint32_t next = node(n).next;
+         node(n).next = NIL;
+         placeL0(n);
+         n = next;
+      }
+   }
+
+   // Pull the overflow messages which got in range.
+   while (mOverflow->count() > 0
+         && (mOverflow->peekMin().time >> WHEEL_L0_BITS) - mBlock < WHEEL_L1_SLOTS)
+      place(allocNode(mOverflow->popMin()));
+
+   return true;
+}
+
+/*****************************************************************************************************/
+/* Return the first level slot holding the minimal element or -1 if empty. */
+int TimingWheel::findMin()
+{
+   if (mCount == 0)
+      return -1;
+
+   for (;;)
+   {
+      int i = nextBit(mL0Bits, mNow & L0_MASK, WHEEL_L0_SLOTS);
+      if (i >= 0)
+      {
+         mNow = (mBlock << WHEEL_L0_BITS) + i;
+         return i;
+      }
+
+      if (!advanceBlock())
+         return -1;
+   }
+}
+
+/*****************************************************************************************************/
+/* Add a new element while maintaining the order. The pool grows if needed. */
+void TimingWheel::insert(const MidiMessage &msg)
+{
+   mCount ++;
+   place(allocNode(msg));
+}
+
+/*****************************************************************************************************/
+/* Pop the minimal element. The wheel must not be empty. */
+MidiMessage TimingWheel::popMin()
+{
+   int i = findMin();
+   uint32_t n = mL0[i].head;
+
+   mL0[i].head = node(n).next;
+   if (mL0[i].head == NIL)
+   {
+      mL0[i].tail = NIL;
+      clearBit(mL0Bits, i);
+   }
+
+   MidiMessage msg = node(n).msg;
+   freeNode(n);
+   mCount --;
+
+   return msg;
+}
+
+/*****************************************************************************************************/
+/* Look the minimal element without removing it. The wheel must not be empty. */
+const MidiMessage& TimingWheel::peekMin()
+{
+   return node(mL0[findMin()].head).msg;
+}
+
+/*****************************************************************************************************/
+/* The number of elements available in the buffer. */
+size_t TimingWheel::count()
+{
+   return mCount;
+}
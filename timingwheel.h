@@ -0,0 +1,100 @@
+#ifndef TIMINGWHEEL_H
+#define TIMINGWHEEL_H
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "midimessage.h"
+#include "midischeduler.h"
+#include "midiheap.h"
+
+#define WHEEL_L0_BITS                  10       // Frame-granular slots of the current block.
+#define WHEEL_L1_BITS                  8        // Block-granular slots of the following blocks.
+#define WHEEL_L0_SLOTS                 (1 << WHEEL_L0_BITS)
+#define WHEEL_L1_SLOTS                 (1 << WHEEL_L1_BITS)
+#define WHEEL_POOL_BITS                10       // Nodes per pool chunk (log2).
+
+/*******************************************************************************************/
+/* Hierarchical timing wheel. The first level holds the messages of the current block
+   of WHEEL_L0_SLOTS frames, one frame per slot. The second level holds the next blocks,
+   one block per slot. Everything farther goes to an overflow heap.
+   Insert and pop are O(1) for the messages within a few seconds from the current time. */
+class TimingWheel : public MidiScheduler
+{
+   private:
+      /* A list node holding a message. */
+      struct Node
+      {
+         MidiMessage msg;
+         uint32_t    next;
+      };
+
+      /* A slot is a linked list of nodes. */
+      struct Slot
+      {
+         uint32_t head;
+         uint32_t tail;
+      };
+
+      std::vector<Node*>
+                       mPool;             // Chunks of nodes; grows without moving the nodes.
+      uint32_t         mFree;             // Head of the free nodes list.
+      size_t           mCount;            // Current number of messages.
+
+      Slot             mL0[WHEEL_L0_SLOTS];
+      Slot             mL1[WHEEL_L1_SLOTS];
+      uint64_t         mL0Bits[WHEEL_L0_SLOTS / 64];    // Non-empty slots.
+      uint64_t         mL1Bits[WHEEL_L1_SLOTS / 64];
+      MidiHeap        *mOverflow;         // The messages beyond the second level.
+
+      frametime_t      mBlock;            // The current block number.
+      frametime_t      mNow;              // The earliest time that might be in the first level.
+
+      /* Return the node with the given index. */
+      inline Node& node(uint32_t n);
+
+      /* Add a chunk of nodes to the free list. */
+      void grow();
+
+      /* Take a node from the free list. */
+      inline uint32_t allocNode(const MidiMessage &msg);
+
+      /* Put the node back to the free list. */
+      inline void freeNode(uint32_t n);
+
+      /* Put the node into a first level slot keeping the slot sorted. */
+      void placeL0(uint32_t n);
+
+      /* Put the node to the right level. */
+      void place(uint32_t n);
+
+      /* Move to the next non-empty block and cascade its messages to the first level.
+         Returns false if there are no more messages. */
+      bool advanceBlock();
+
+      /* Return the first level slot holding the minimal element or -1 if empty. */
+      int findMin();
+
+   public:
+      /* Constructor. Preallocates the nodes for s messages. */
+      TimingWheel(size_t s);
+
+      /* Destructor. */
+      ~TimingWheel();
+
+      /* Add a new element while maintaining the order. The pool grows if needed. */
+      void insert(const MidiMessage &msg);
+
+      /* Pop the minimal element. The wheel must not be empty. */
+      MidiMessage popMin();
+
+      /* Look the minimal element without removing it. The wheel must not be empty. */
+      const MidiMessage& peekMin();
+
+      /* The number of elements available in the buffer. */
+      size_t count();
+};
+
+#endif
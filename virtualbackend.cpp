@@ -0,0 +1,230 @@
+#include "virtualbackend.h"
+
+#include <string.h>
+
+#include "common.h"
+
+#define VIRTUAL_BUFFER_BYTES           4096     // Preallocated data space of a port buffer.
+
+/*****************************************************************************************************/
+/* Constructor. */
+VirtualBackend::VirtualBackend(jack_nframes_t sampleRate, jack_nframes_t bufferSize)
+{
+   mBusy.clear();
+   mEngine = NULL;
+   mSampleRate = sampleRate;
+   mBufferSize = bufferSize;
+   mFrames = 0;
+   mCycles = 0;
+   mFrameLimit = 0;
+   mPortCount = 0;
+   memset(mPorts, 0, sizeof(mPorts));
+}
+
+/*****************************************************************************************************/
+/* Destructor. */
+VirtualBackend::~VirtualBackend()
+{
+   for (unsigned i = 0; i < mPortCount; i ++)
+      delete mPorts[i];
+}
+
+/*****************************************************************************************************/
+/* Set the end of the virtual time. */
+void VirtualBackend::setFrameLimit(uint64_t frames)
+{
+   mFrameLimit = frames;
+}
+
+/*****************************************************************************************************/
+/* Remember the engine to drive. */
+void VirtualBackend::open(JackEngine *engine)
+{
+   mEngine = engine;
+}
+
+/*****************************************************************************************************/
+/* Nothing to start: the cycles run when the engine idles. */
+void VirtualBackend::activate()
+{
+}
+
+/*****************************************************************************************************/
+/* The sample rate in frames per second. */
+jack_nframes_t VirtualBackend::sampleRate()
+{
+   return mSampleRate;
+}
+
+/*****************************************************************************************************/
+/* The number of frames in a process cycle. */
+jack_nframes_t VirtualBackend::bufferSize()
+{
+   return mBufferSize;
+}
+
+/*****************************************************************************************************/
+/* The current frame time: the end of the last cycle run. */
+jack_nframes_t VirtualBackend::frameTime()
+{
+   return (jack_nframes_t)mFrames.load();
+}
+
+/*****************************************************************************************************/
+/* The frame time the current process cycle started at. */
+jack_nframes_t VirtualBackend::cycleStart()
+{
+   return (jack_nframes_t)mFrames.load();
+}
+
+/*****************************************************************************************************/
+/* The current time in microseconds. */
+jack_time_t VirtualBackend::time()
+{
+   return mFrames.load() * 1000000 / mSampleRate;
+}
+
+/*****************************************************************************************************/
+/* The time of the given frame in microseconds. */
+jack_time_t VirtualBackend::frameToTime(jack_nframes_t frame)
+{
+   uint64_t now = mFrames.load();
+   int64_t t = (int64_t)now + (int32_t)(frame - (jack_nframes_t)now);
+   return t < 0 ? 0 : t * 1000000 / mSampleRate;
+}
+
+/*****************************************************************************************************/
+/* The cycles never run late. */
+float VirtualBackend::xrunDelay()
+{
+   return 0;
+}
+
+/*****************************************************************************************************/
+/* The cycles do not run realtime. */
+int VirtualBackend::realtimePriority()
+{
+   return -1;
+}
+
+/*****************************************************************************************************/
+/* Register an output port with the given index. */
+bool VirtualBackend::registerPort(unsigned idx, const std::string &name)
+{
+   if (idx >= MAX_OUTPUT_PORTS)
+      return false;
+
+   VirtualPort *p = new VirtualPort();
+   p->name = name;
+   p->nframes = 0;
+   p->bytes.reserve(VIRTUAL_BUFFER_BYTES);
+
+   mPorts[idx] = p;
+   if (idx >= mPortCount)
+      mPortCount = idx + 1;
+   return true;
+}
+
+/*****************************************************************************************************/
+/* The short name of the output port. */
+std::string VirtualBackend::portName(unsigned idx)
+{
+   return idx < mPortCount && mPorts[idx] != NULL ? mPorts[idx]->name : "";
+}
+
+/*****************************************************************************************************/
+/* There is nothing to connect to. */
+int VirtualBackend::connectPort(unsigned idx, const std::string &destination)
+{
+   return 0;
+}
+
+/*****************************************************************************************************/
+/* The midi buffer of the output port for the current cycle. */
+void* VirtualBackend::portBuffer(unsigned idx, jack_nframes_t nframes)
+{
+   if (idx >= mPortCount || mPorts[idx] == NULL)
+      return NULL;
+
+   mPorts[idx]->nframes = nframes;
+   return mPorts[idx];
+}
+
+/*****************************************************************************************************/
+/* Remove all the events from the midi buffer. */
+void VirtualBackend::clearBuffer(void *buffer)
+{
+   VirtualPort *p = (VirtualPort*) buffer;
+   p->events.clear();
+   p->bytes.clear();
+}
+
+/*****************************************************************************************************/
+/* Make room for an event in the midi buffer. Like with Jack, the offsets may not go back. */
+unsigned char* VirtualBackend::reserveEvent(void *buffer, jack_nframes_t offset, size_t size)
+{
+   VirtualPort *p = (VirtualPort*) buffer;
+
+   if (size == 0 || offset >= p->nframes || (!p->events.empty() && offset < p->events.back().offset))
+      return NULL;
+
+   VirtualEvent e;
+   e.offset = offset;
+   e.pos = p->bytes.size();
+   e.size = size;
+   p->events.push_back(e);
+   p->bytes.resize(e.pos + size);
+   return &p->bytes[e.pos];
+}
+
+/*****************************************************************************************************/
+/* Run the cycles until the given time has passed on the virtual clock, at least one. */
+void VirtualBackend::idle(unsigned ms)
+{
+   // A signal handler may idle while the cycles are running; the clock is moving anyway.
+   if (mBusy.test_and_set())
+      return;
+
+   uint64_t frames = (uint64_t)ms * mSampleRate / 1000;
+   uint64_t cycles = (frames + mBufferSize - 1) / mBufferSize;
+   if (cycles == 0)
+      cycles = 1;
+
+   for (uint64_t i = 0; i < cycles; i ++)
+      runCycle();
+
+   mBusy.clear();
+}
+
+/*****************************************************************************************************/
+/* Run one process cycle and pass its events on. */
+void VirtualBackend::runCycle()
+{
+   int64_t start = mFrames.load();
+
+   // The time is up; a song that loops forever ends here.
+   if (mFrameLimit > 0 && (uint64_t)start >= mFrameLimit)
+   {
+      gPlaying = false;
+      return;
+   }
+
+   jack_process_cb(mBufferSize, mEngine);
+
+   for (unsigned i = 0; i < mPortCount; i ++)
+   {
+      VirtualPort *p = mPorts[i];
+      if (p == NULL)
+         continue;
+
+      for (size_t j = 0; j < p->events.size(); j ++)
+      {
+         const VirtualEvent &e = p->events[j];
+         deliver(i, mCycles, e.offset, start - mBufferSize + e.offset, &p->bytes[e.pos], e.size);
+      }
+      clearBuffer(p);
+   }
+
+   mFrames.store(start + mBufferSize);
+   mCycles ++;
+}
@@ -0,0 +1,90 @@
+#ifndef VIRTUALBACKEND_H
+#define VIRTUALBACKEND_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "jackengine.h"
+#include "midibackend.h"
+
+/* An event written to a virtual port buffer. */
+struct VirtualEvent
+{
+   jack_nframes_t     offset;          // Within the cycle.
+   size_t             pos;             // Of the data in the buffer bytes.
+   size_t             size;
+};
+
+/* A virtual output port with its midi buffer. */
+struct VirtualPort
+{
+   std::string        name;
+   jack_nframes_t     nframes;         // The length of the current cycle.
+   std::vector<VirtualEvent>
+                      events;
+   std::vector<unsigned char>
+                      bytes;
+};
+
+/*******************************************************************************************/
+/* An output without a server: the process cycles run on a virtual clock whenever the engine
+   idles, as fast as the CPU allows. The port buffers take any number of events in the order
+   of their offsets, like the Jack ones do. The subclasses receive what each cycle emitted. */
+class VirtualBackend : public MidiBackend
+{
+   private:
+      std::atomic_flag   mBusy;            // The cycles are running.
+
+   protected:
+      JackEngine        *mEngine;
+      jack_nframes_t     mSampleRate;
+      jack_nframes_t     mBufferSize;
+      std::atomic<uint64_t>
+                         mFrames;          // The start of the next cycle.
+      uint64_t           mCycles;          // The number of cycles run.
+      uint64_t           mFrameLimit;      // No cycle starts at or after it; 0 for no limit.
+      VirtualPort       *mPorts[MAX_OUTPUT_PORTS];
+      std::atomic<unsigned>
+                         mPortCount;       // Published after the port.
+
+      /* Run one process cycle and pass its events on. */
+      void runCycle();
+
+      /* Take an event the given cycle emitted; frame = cycle start - period + offset, which is
+         where the engine meant it to play. */
+      virtual void deliver(unsigned port, uint64_t cycle, jack_nframes_t offset, int64_t frame,
+            const unsigned char *data, size_t size) = 0;
+
+   public:
+      /* Constructor. */
+      VirtualBackend(jack_nframes_t sampleRate, jack_nframes_t bufferSize);
+
+      /* Destructor. */
+      virtual ~VirtualBackend();
+
+      /* Stop the clock and the playback when it reaches the given frame; 0 runs forever. */
+      void setFrameLimit(uint64_t frames);
+
+      void open(JackEngine *engine);
+      void activate();
+      jack_nframes_t sampleRate();
+      jack_nframes_t bufferSize();
+      jack_nframes_t frameTime();
+      jack_nframes_t cycleStart();
+      jack_time_t time();
+      jack_time_t frameToTime(jack_nframes_t frame);
+      float xrunDelay();
+      int realtimePriority();
+      bool registerPort(unsigned idx, const std::string &name);
+      std::string portName(unsigned idx);
+      int connectPort(unsigned idx, const std::string &destination);
+      void* portBuffer(unsigned idx, jack_nframes_t nframes);
+      void clearBuffer(void *buffer);
+      unsigned char* reserveEvent(void *buffer, jack_nframes_t offset, size_t size);
+      void idle(unsigned ms);
+};
+
+#endif